@@ -25,6 +25,13 @@ import matplotlib
 import pandas as pd
 matplotlib.use("TkAgg") # use a backend to allow the current_fig_manager section to position the windows
 import matplotlib.pyplot as plt
+import os
+
+# spherify may have written its output gzip-compressed (e.g. 'high_res.txt.gz') -- use whichever version of the file is newest
+def newest(filename):
+    if os.path.exists(filename+'.gz') and (not os.path.exists(filename) or os.path.getmtime(filename+'.gz')>os.path.getmtime(filename)):
+        return filename+'.gz'
+    return filename
 
 print("\n\n ------------------------------------------------------------------------------------------------")
 print("     Welcome to S.T.A.G (Simulated Three-dimensional Aerosol Geometries!): Spherify Edition")
@@ -35,7 +42,7 @@ print(" ------------------------------------------------------------------------
 print("\n ORIGINAL POSITIONS:\n")
 
 # Import dipole positions
-original = pd.read_csv('original.txt', header=None, names=['X', 'Y', 'Z'])
+original = pd.read_csv(newest('original.txt'), header=None, names=['X', 'Y', 'Z'])
 
 print(" ",len(original)-1," dipoles imported successfully from original image.")
 
@@ -86,7 +93,7 @@ ax.set_axis_off() # optional: removes axes and grey area around shape
 print(" SPHERIFIED POSITIONS:\n")
 
 # Import dipole positions
-high_res = pd.read_csv('high_res.txt', header=None, names=['X', 'Y', 'Z'])
+high_res = pd.read_csv(newest('high_res.txt'), header=None, names=['X', 'Y', 'Z'])
 
 print(" ",len(high_res)-1," dipoles imported successfully from spherified image.")
 
@@ -6,8 +6,13 @@ Aerosol are note Spherical Cows, Lodge (2023) for details on the algorithm and v
 INSTRUCTIONS FOR USE
 
 - Name the input file "shape.dat" and place in the same folder as this code
+- Alternatively, a closed triangle mesh named "shape.obj" or "shape.stl" can be voxelised instead -- set voxel_spacing in main()
 - Additionally place "STAG_spherify.py" in the same folder if you wish to visualise the input and output files immediately
 - Compile and run the code!
+- For targets too large for the memory of one computer, compile with "mpicc -fopenmp -DUSE_MPI spherify.c -lm" and run with
+  "mpirun -np N ./a.out" -- the grid is split into N slabs along x, one for each process, and the output files are identical
+- To read and write gzip-compressed files, compile with "-DUSE_ZLIB ... -lz". shape.dat (or shape.dat.gz) can then be compressed,
+  and setting compress_output in main() writes shape2.dat.gz, high_res.txt.gz and original.txt.gz instead of the plain text files
 
 
 #
@@ -27,1098 +32,7060 @@ INSTRUCTIONS FOR USE
 # Matt Lodge 01/07/22
 
 */
+#if (defined(USE_ZLIB) || defined(USE_MPI)) && !defined(__APPLE__)
+#define _GNU_SOURCE //for fopencookie()
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <complex.h>
 #include <math.h>
 #include <omp.h>
 #include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+
+#define TILE_BITS 3                  //tiled layout: tiles are 2^3 = 8 cells along each side...
+#define TILE_SIZE (1<<TILE_BITS)
+#define TILE_MASK (TILE_SIZE-1)
+#define HUGE_PAGE (2<<20) //grids at least this big are aligned to (and, where the system allows, stored in) 2 MB pages
+#define TILE_CELLS (TILE_SIZE*TILE_SIZE*TILE_SIZE)    //...and so hold 512 cells (2 kB)
 
 
 FILE* DDSCAT_infile;
 FILE* DDSCAT_outfile;
 FILE* original_grid_outfile;
 FILE* new_grid_outfile;
-int diagnostics, i, j, k, x, y ,z, original_N, original_lattice_dim, new_lattice_dim, dipole_count, JA, IX, IY, IZ, ICOMPX, ICOMPY, ICOMPZ, STAG_lattice_dim,edgecase;
-double STAG_odd_even_offset, min[3], max[3], STAG_offset[3];
-char buf[1000];
+int diagnostics, i, j, k, x, y ,z, original_N, original_lattice_dim, new_lattice_dim, IX, IY, IZ, ICOMPX, ICOMPY, ICOMPZ, STAG_lattice_dim, engine, layout, benchmark, run_count, compress_output, statistics, mesh_output, count_only, dipole_budget, memory_limit, first_touch, connectivity, image_output, delta_output, orientations, orientation_jobs, smooth_iterations, smooth_vote, output_formats, geom_materials, ladder, ladder_coarse, ladder_fine, rounding, rounding_resolution, batch, trace_output, trace_query, trace_rule, trace_low[3], trace_high[3], query_benchmark, query_input, material_test, large_test;
+double STAG_odd_even_offset, min[3], max[3], STAG_offset[3], export_time[2], planned_memory, voxel_spacing, image_slice, rounding_radius;
+long long dipole_count, JA; //dipoles in the new grid, and the number (JA) of the dipole being read or written -- both pass 2^31 for large grids
+#define LINE_LENGTH 65536 //longest line read from a header
+char buf[LINE_LENGTH];
 int*** original_grid;
 int*** new_grid;
-double** dipole_info;
-double** STAG_dipole_positions;
+int* original_block; //dense grids: every plane of this process's slab, one after another, in one block of memory (original_grid[x][y] points into it)
+int* new_block;
+size_t* original_row_start; //run-length engine: the runs of dipoles along row x-y of the original grid are stored as (start z, end z) pairs in original_runs[original_row_start[x*original_lattice_dim+y]] -> original_runs[original_row_start[x*original_lattice_dim+y+1]-1]
+int* original_runs;
+size_t* new_row_start; //run-length engine: the same for the new grid, with rows X-Y indexed by X*new_lattice_dim+Y
+int* new_runs;
+int* row_runs;
+int* original_tiles; //tiled layout: both grids are stored as 8x8x8 tiles of cells, one tile after another (see tile_index())
+int* new_tiles;
+int original_tiles_per_side, new_tiles_per_side;
+size_t* original_tile_offsets; //tiled layout: the part of the position of each cell that comes from each of its x, y and z coordinates (see tile_index())
+size_t* new_tile_offsets;
+void* dipole_table; //every dipole in shape.dat, in one block of memory: the x, y and z coordinates (16-bit if they all fit, otherwise 32-bit), followed by the three composition IDs (8-bit)
+int dipole_bits; //16 or 32 - the size of each coordinate in dipole_table
+int16_t* dipole_xyz16[3]; //the x, y and z coordinates within dipole_table, when dipole_bits==16...
+int32_t* dipole_xyz32[3]; //...or when dipole_bits==32
+unsigned char* dipole_comp[3]; //ICOMPX, ICOMPY and ICOMPZ of each dipole
+typedef struct {
+    uint64_t cell;          //(x*original_lattice_dim+y)*original_lattice_dim+z
+    unsigned char comp[3];  //ICOMPX, ICOMPY and ICOMPZ of the dipole in it
+} material_cell;
+material_cell* material_cells; //the compositions of the original cells, sorted by cell, for looking up what each new dipole is made of (NULL when every dipole has the same compositions)
+size_t material_cell_count;
+unsigned char material_default[3]; //the compositions of the first dipole in shape.dat (all of them, when material_cells is NULL)
+int material_count; //the number of different ICOMPX values -- Nmat in shape2.geom...
+unsigned char material_number[256]; //...and the material number (1 to Nmat) of each ICOMPX value, in order
+int mpi_rank, mpi_size; //this process, and the number of processes (0 and 1 unless compiled with USE_MPI and run with mpirun)
+int slab_begin, slab_end; //the x-slab of the original grid swept by this process: slab_begin <= x < slab_end (the whole grid in a single process)
+long long dipoles_before; //dipoles written by the processes before this one -- JA numbering in shape2.dat carries on from here
+#define PART_SLOTS 4 //output files that can be open at the same time (shape2.dat, shape2.geom and shape2.raw are written together)
+#define PLAN_TOLERANCE 0.10 //the memory plan is an upper bound: warn if the measured peak goes over it by more than this fraction (plus 1 MB for small runs)
+#define PART_CHUNK (1<<20) //MPI: each process writes its part of an output file in chunks of this many bytes (see open_part())
+char* part_buffer[PART_SLOTS]; //MPI with compress_output: this process's compressed part of each output file currently being written
+size_t part_size[PART_SLOTS];
+FILE* part_file[PART_SLOTS]; //(NULL for a free slot)
+int grid_offset[3]; //STAG_offset as integers: added to a dipole's coordinates to find its cell in the original grid
+int* stream_events; //streaming engine: space for refine_row_runs(), and the four new rows made from the last original row x-y (stream_x, stream_y)
+int* stream_rows[2][2];
+int stream_row_count[2][2];
+int stream_x, stream_y;
+size_t* delta_row_start; //delta_output = 2: the cells of new row X-Y to change, as a sorted list of positions where a run starts or ends, in delta_toggles[delta_row_start[X*new_lattice_dim+Y]] -> delta_toggles[delta_row_start[X*new_lattice_dim+Y+1]-1]
+int* delta_toggles;
+#define TRACE_BUFFER 8192 //decisions each thread holds before writing them to trace.bin
+#define TRACE_FILL_0 1 //what one sweep did with a cell: the low 3 bits of its 6-bit field in a trace record (the high 3 bits hold the edge case found, 1-4, or 0 if none)
+#define TRACE_FILL_1 2
+#define TRACE_RULE_1 3
+#define TRACE_RULE_2 4
+typedef struct{
+    uint16_t x, y, z, length; //a cell of the original grid (and length-1 more cells after it along z, decided the same way)
+    uint32_t code; //bits 0-5: the y-z sweep's decision, 6-11: z-x, 12-17: x-y (0 for a sweep that isn't part of this record)
+} trace_record;
+typedef struct{
+    trace_record* records;
+    int count;
+    char pad[64-sizeof(trace_record*)-sizeof(int)]; //(each thread's count on its own cache line)
+} trace_buffer;
+FILE* trace_file; //trace_output: trace.bin while the sweeps are traced (NULL otherwise)
+trace_buffer* trace_buffers; //one for each thread
+long long trace_records;
+uint64_t* query_bits; //query API: the original grid as one bit per cell (see query_begin())
+#define QUERY_SAMPLES (1<<22) //random cells timed by the query benchmark
+
+
+
+/* allocate one of the large arrays (grids, dipole table, runs) -- if the memory is not there, stop with a message instead of crashing partway through */
+
+static void out_of_memory(size_t bytes, const char* what)
+{
+    printf("\n\nError- not enough memory for the %s (%.1f MB)!! Try a smaller memory_limit so that a leaner engine is chosen.\n\n\n", what, bytes/1048576.0);
+#ifdef USE_MPI
+    MPI_Abort(MPI_COMM_WORLD, 1);
+#endif
+    exit(1);
+}
 
+static void* checked_malloc(size_t bytes, const char* what)
+{
+    void* p;
 
+    p=malloc(bytes);
+    if((p==NULL)&&(bytes>0)){
+        out_of_memory(bytes, what);
+    }
+    return p;
+}
 
-int main()
+static void* checked_calloc(size_t count, size_t size, const char* what)
 {
+    void* p;
 
+    p=calloc(count, size);
+    if((p==NULL)&&(count>0)&&(size>0)){
+        out_of_memory(count*size, what);
+    }
+    return p;
+}
 
-    printf("\n\n ---------------------------------------------------------------------------------------------------------------------");
-    printf("\n ---------------------------------------------------------------------------------------------------------------------");
-    printf("\n\n                                                  WELCOME TO SPHERIFY!                            \n\n");
+static void* checked_realloc(void* old, size_t bytes, const char* what)
+{
+    void* p;
 
+    p=realloc(old, bytes);
+    if((p==NULL)&&(bytes>0)){
+        out_of_memory(bytes, what);
+    }
+    return p;
+}
 
-    printf("\n                  ________________                     __________                          .  =  .                    ");
-    printf("\n                 |                |                   |          |                       '         '                  ");
-    printf("\n                 |                |                  (            )                    /             \\                ");
-    printf("\n                 |                |                 |              |                  |               |               ");
-    printf("\n                 |                |      --->      (                )      --->       |               |               ");
-    printf("\n                 |                |                 |              |                   \\             /                ");
-    printf("\n                 |                |                  (            )                      .         .                  ");
-    printf("\n                 |________________|                   |__________|                         '  =  '                    ");
+/* allocate a grid: with first_touch set, grids of HUGE_PAGE or more are aligned to 2 MB and marked for transparent huge pages, so that one TLB entry covers 512 times as many cells. Nothing is written here -- the memory is only placed (next to whichever thread writes to it first) by touch_grid() */
 
+static int* grid_alloc(size_t bytes, const char* what)
+{
+    void* p;
 
+#ifdef MADV_HUGEPAGE
+    if((first_touch==1)&&(bytes>=HUGE_PAGE)){
+        if(posix_memalign(&p, HUGE_PAGE, bytes)!=0){
+            out_of_memory(bytes, what);
+        }
+        madvise(p, bytes, MADV_HUGEPAGE); //(only a hint -- ignored where huge pages are turned off)
+        return (int*)p;
+    }
+#endif
+    p=checked_malloc(bytes, what);
+    return (int*)p;
+}
 
-    printf("\n\n\n ---------------------------------------------------------------------------------------------------------------------");
-    printf("\n ---------------------------------------------------------------------------------------------------------------------\n\n");
+/* set cells [0, total) of a grid to 0. The sweeps share the x-planes of the slab between threads in blocks (see sweep_pass()), and block b of the sweeps uses cells [b*block_cells, (b+1)*block_cells) here -- so with first_touch set, the same thread zeroes them, and on multi-socket computers each block ends up in the memory next to the thread that sweeps it. Otherwise one thread zeroes everything, as before */
 
-    diagnostics=0; //set = 1 to print diagnostic statements
+static void touch_grid(int* cells, size_t block_cells, size_t total)
+{
+    int b, blocks;
+    size_t lo, hi;
+
+    blocks=(int)((total+block_cells-1)/block_cells);
+    #pragma omp parallel for schedule(static) private(lo, hi) if(first_touch==1)
+    for(b=0;b<blocks;b++){
+        lo=(size_t)b*block_cells;
+        hi=(lo+block_cells<total) ? lo+block_cells : total;
+        memset(cells+lo, 0, (hi-lo)*sizeof(int));
+    }
+}
 
-    /* read in shape.dat file */
+/* set up the dipole table for n dipoles with 32-bit coordinates (one allocation - 15 bytes per dipole) */
 
-    if((DDSCAT_infile=fopen("shape.dat","r")) == NULL){
-        printf("\n\nError- the shape file cannot be found!! \n\n\n");
-        system("pause");
-        return 1;
-    }
-    else{
-        DDSCAT_infile=fopen("shape.dat","r");
+static void dipole_table_init(int n)
+{
+    int a;
+
+    dipole_table=checked_malloc((size_t)n*(3*sizeof(int32_t)+3), "dipole table");
+    dipole_bits=32;
+    for(a=0;a<3;a++){
+        dipole_xyz32[a]=(int32_t*)dipole_table+(size_t)a*n;
+        dipole_comp[a]=(unsigned char*)dipole_table+(size_t)n*3*sizeof(int32_t)+(size_t)a*n;
     }
+}
 
-    printf("\n Shape data file opened successfully. Analysing data:\n");
+/* find the smallest and largest coordinate along each axis in one pass over the table - like the original search, min[] and max[] start at 0 */
 
-    /* read the information from the header of the DDSCAT file and find where the data starts (these header sections can be flexible and have different numbers of lines before the data starts -- so we just find where line containing JA, IX, IY, IZ is and assume the data begins underneath)*/
+static void dipole_bounds(void)
+{
+    int a, n, lo, hi;
+
+    for(a=0;a<3;a++){
+        lo=0;
+        hi=0;
+        if(dipole_bits==16){
+            const int16_t* c=dipole_xyz16[a];
+            #pragma omp simd reduction(min:lo) reduction(max:hi)
+            for(n=0;n<original_N;n++){
+                lo=c[n]<lo ? c[n] : lo;
+                hi=c[n]>hi ? c[n] : hi;
+            }
+        }
+        else{
+            const int32_t* c=dipole_xyz32[a];
+            #pragma omp simd reduction(min:lo) reduction(max:hi)
+            for(n=0;n<original_N;n++){
+                lo=c[n]<lo ? c[n] : lo;
+                hi=c[n]>hi ? c[n] : hi;
+            }
+        }
+        min[a]=lo;
+        max[a]=hi;
+    }
+}
 
-    while (fgets(buf,1000, DDSCAT_infile)!=NULL){ //if something is read
+/* once min[] and max[] are known, shrink the coordinates to 16 bits if they all fit (9 bytes per dipole). Each value moves to a lower address than the one it came from, so the table can be repacked in place */
 
-        if(strstr(buf,"NAT") != NULL){ //check if "NAT" is in the string for this line
-            if(1==sscanf(buf,"%*[^0123456789]%d", &original_N)){ //record the number of dipoles (the first instance where any of the numbers 0->9 appear in this line)
-                printf("\n \t NAT found: %d dipoles are in the original data file.", original_N);
-            }
+static void compact_dipole_table(void)
+{
+    int a, n;
+    int16_t* packed;
+
+    for(a=0;a<3;a++){
+        if(min[a]<INT16_MIN || max[a]>INT16_MAX){
+            return; //keep 32-bit coordinates
         }
+    }
 
-        if(strstr(buf,"JA") != NULL){
-            if(strstr(buf,"IX") != NULL){       //check if the current line contains the strings "JA", "IX", "IY" and "IZ" (seperately in case the spacing is changed by the user).
-                if(strstr(buf,"IY") != NULL){
-                    if(strstr(buf,"IZ") != NULL){
-                        break;		//then exit the loop -- data is about to start
-                    }
-                }
-            }
+    packed=(int16_t*)dipole_table;
+    for(a=0;a<3;a++){
+        for(n=0;n<original_N;n++){
+            packed[(size_t)a*original_N+n]=(int16_t)dipole_xyz32[a][n];
         }
     }
+    memmove(packed+(size_t)3*original_N, dipole_comp[0], (size_t)3*original_N);
+
+    dipole_table=checked_realloc(dipole_table, (size_t)original_N*(3*sizeof(int16_t)+3), "dipole table");
+    dipole_bits=16;
+    for(a=0;a<3;a++){
+        dipole_xyz16[a]=(int16_t*)dipole_table+(size_t)a*original_N;
+        dipole_comp[a]=(unsigned char*)dipole_table+(size_t)original_N*3*sizeof(int16_t)+(size_t)a*original_N;
+    }
+}
 
-    /* initialise matrix to store dipoles, now that we know how many there were originally */
-    dipole_info=(double**)malloc(original_N*sizeof(double*));
-    for (i=0; i<original_N; i++) {
-        dipole_info[i]=(double*)malloc((6)*sizeof(double));   //matrix will record each of the values for "IX IY IZ ICOMPX ICOMPY ICOMPZ" in array elements [0]->[5]
+/* coordinate of dipole n along axis a (0 = x, 1 = y, 2 = z), as read from shape.dat */
+
+static inline int dipole_position(int n, int a)
+{
+    if(dipole_bits==16){
+        return dipole_xyz16[a][n];
     }
+    return dipole_xyz32[a][n];
+}
 
-    /* begin recording values and saving only the required composition (default ==1, for soot) */
+/* cell of the original grid that holds dipole n, along axis a */
 
-    k=0; //counts the number of dipoles with composition 1
+static inline int dipole_cell(int n, int a)
+{
+    return dipole_position(n, a)+grid_offset[a];
+}
 
-    while(fscanf(DDSCAT_infile, " %d  %d  %d  %d  %d  %d  %d", &JA, &IX, &IY, &IZ, &ICOMPX, &ICOMPY, &ICOMPZ)>0){ //scan each line of data after this point and record the values as individual buffers JA, IX etc...
+/* tiled layout: cells are numbered x-y-z within each 8x8x8 tile, and the tiles are numbered x-y-z in turn, so that any 8x8x8 block of the grid sits together in memory. The position of a cell is then a sum of separate parts for x, y and z, which are worked out once here for a grid with dim cells along each side: offsets[x] + offsets[dim+y] + offsets[2*dim+z] */
 
-        dipole_info[k][0]=IX;
-        dipole_info[k][1]=IY;
-        dipole_info[k][2]=IZ;            //save info for all dipoles
-        dipole_info[k][3]=ICOMPX;
-        dipole_info[k][4]=ICOMPY;
-        dipole_info[k][5]=ICOMPZ;
-        k++; //we found a dipole - keep track of total number
+static size_t* tile_offsets(int dim, int tiles_per_side)
+{
+    int n;
+    size_t* offsets;
+
+    offsets=(size_t*)checked_malloc(3*dim*sizeof(size_t), "tiled layout");
+    for(n=0;n<dim;n++){
+        offsets[n]=(size_t)(n>>TILE_BITS)*tiles_per_side*tiles_per_side*TILE_CELLS+((n&TILE_MASK)<<(2*TILE_BITS));
+        offsets[dim+n]=(size_t)(n>>TILE_BITS)*tiles_per_side*TILE_CELLS+((n&TILE_MASK)<<TILE_BITS);
+        offsets[2*dim+n]=(size_t)(n>>TILE_BITS)*TILE_CELLS+(n&TILE_MASK);
     }
+    return offsets;
+}
 
-    if(k==0){
-        printf("\n\nError- no dipoles were found!! \n\n\n");
-        system("pause");
-        return 1;
+/* pointers to cell x-y-z of the original and new grids, in whichever layout they are stored */
+
+static int* original_cell(int x, int y, int z)
+{
+    if(layout==1){
+        return &original_tiles[original_tile_offsets[x]+original_tile_offsets[original_lattice_dim+y]+original_tile_offsets[2*original_lattice_dim+z]];
     }
-    else{
-        printf("\n\n %d dipoles successfully imported.", k);
+    return &original_grid[x][y][z];
+}
+
+static int* new_cell(int x, int y, int z)
+{
+    if(layout==1){
+        return &new_tiles[new_tile_offsets[x]+new_tile_offsets[new_lattice_dim+y]+new_tile_offsets[2*new_lattice_dim+z]];
     }
+    return &new_grid[x][y][z];
+}
 
-    fclose(DDSCAT_infile);
+/* returns the value of original_grid at x-y-z, treating any position outside the grid as unoccupied (0). This replaces the "(z==0)||..." style boundary checks in the edge case logic */
 
-    /* convert dipole positions to STAG grid format -- all need to be > 0 (positive integers)*/
+static int occupied(int x, int y, int z)
+{
+    if((x<0)||(y<0)||(z<0)||(x>=original_lattice_dim)||(y>=original_lattice_dim)||(z>=original_lattice_dim)){
+        return 0;
+    }
+    return *original_cell(x, y, z);
+}
 
-    printf(" \n Translating %d dipoles to positive values... ", original_N);
-    /* make new matrix to store STAG version of dipoles for 3D visualisation */
-    STAG_dipole_positions=(double**)malloc(original_N*sizeof(double*));
-    for (i=0; i<original_N; i++) {
-        STAG_dipole_positions[i]=(double*)malloc((3)*sizeof(double));  //makes matrix to store dipole positions, now that we know the number of dipoles within the object geometry and the number of spheres
+/* DECISION TRACE (trace_output = 1 or 2): instead of printing every decision to the console as diagnostics does, each sweep's decision for a cell is kept as a 6-bit field of a small record (see trace_record), gathered by each thread in its own buffer and written to trace.bin a block at a time -- cheap enough to leave on for large runs. The records are in the order the threads finished their blocks, not grid order; read them back with trace_query */
+
+static void trace_name(char* name, size_t size, int rank)
+{
+    if(rank==0){
+        snprintf(name, size, "trace.bin");
     }
+    else{
+        snprintf(name, size, "trace_%d.bin", rank); //(the other processes of an MPI run each save their own slab)
+    }
+}
 
-    /* Search to find the most negative x,y,z points in the dipole positions - in a moment, we will need to translate them again to make them all positive for viewing in S.T.A.G */
-    min[0]=0;
-    min[1]=0;
-    min[2]=0;
-    max[0]=0;
-    max[1]=0;
-    max[2]=0;
+static void trace_flush(trace_buffer* b)
+{
+    #pragma omp critical(trace)
+    {
+        fwrite(b->records, sizeof(trace_record), b->count, trace_file);
+        trace_records=trace_records+b->count;
+    }
+    b->count=0;
+}
 
-    for(i=0;i<original_N;i++){
-        if(dipole_info[i][0]<min[0]){
-            min[0]=dipole_info[i][0]; //find min x
-        }
-        if(dipole_info[i][1]<min[1]){
-            min[1]=dipole_info[i][1]; //find min y
-        }
-        if(dipole_info[i][2]<min[2]){
-            min[2]=dipole_info[i][2]; //find min z
-        }
+/* record the decisions (code) made for cells x-y-z to x-y-(z+length-1). With trace_output = 1 only the sweeps where an edge case was found are kept, with = 2 also those that filled with 1's. "Filling with 0's" is never kept, so a cell missing from trace.bin was left empty by every sweep. The fields of the other sweeps are blanked, so that a trace holds the same decisions whether the engine records each sweep on its own (dense) or all three together */
 
-        if(dipole_info[i][0]>max[0]){
-            max[0]=dipole_info[i][0]; //find max x
-        }
-        if(dipole_info[i][1]>max[1]){
-            max[1]=dipole_info[i][1]; //find max y
-        }
-        if(dipole_info[i][2]>max[2]){
-            max[2]=dipole_info[i][2]; //find max z
+static void trace_cell(int x, int y, int z, int length, unsigned int code)
+{
+    trace_buffer* b;
+    int s, field;
+    unsigned int kept;
+
+    kept=0;
+    for(s=0;s<3;s++){
+        field=(code>>(6*s))&63;
+        if(((field>>3)!=0)||((trace_output==2)&&(field==TRACE_FILL_1))){ //an edge case was found (or, with trace_output = 2, filled with 1's)
+            kept=kept|((unsigned int)field<<(6*s));
         }
     }
+    if(kept==0){
+        return;
+    }
+    code=kept;
 
-    STAG_lattice_dim=0;
-    if((max[0]-min[0])>STAG_lattice_dim){
-        STAG_lattice_dim = ceil(max[0]-min[0]); //if the x-coord has the biggest variation, use this as our lattice size in S.T.A.G
+    b=&trace_buffers[omp_get_thread_num()];
+    if(b->count==TRACE_BUFFER){
+        trace_flush(b);
     }
-    if((max[1]-min[1])>STAG_lattice_dim){
-        STAG_lattice_dim = ceil(max[1]-min[1]); //if the y-coord has the biggest variation, use this as our lattice size in S.T.A.G
+    b->records[b->count].x=(uint16_t)x;
+    b->records[b->count].y=(uint16_t)y;
+    b->records[b->count].z=(uint16_t)z;
+    b->records[b->count].length=(uint16_t)length;
+    b->records[b->count].code=code;
+    b->count++;
+}
+
+/* open trace.bin before the sweeps. It starts with "SPTR", then four ints (version, original_lattice_dim, engine, trace_output) and the number of records (long long, filled in by trace_finish()) */
+
+static void trace_begin(void)
+{
+    char name[32];
+    int t, header[4];
+
+    if(trace_output==0){
+        return;
     }
-    if((max[2]-min[2])>STAG_lattice_dim){
-        STAG_lattice_dim = ceil(max[2]-min[2]); //if the z-coord has the biggest variation, use this as our lattice size in S.T.A.G
+    if(engine==4){
+        printf(" Rebuilding from delta.bin runs no sweeps -- there are no decisions to trace.\n\n");
+        return;
+    }
+    if(original_lattice_dim>65535){
+        printf(" The grid is too large to trace (trace.bin holds coordinates up to 65535) -- carrying on without it.\n\n");
+        return;
     }
-    STAG_lattice_dim= STAG_lattice_dim + 1; //then add 1 to make the lattice large enough to hold the final values
-    original_lattice_dim=STAG_lattice_dim; //save this value for the original grid
 
-    //printf("\n\n\n\n min_x= %f \n min_y= %f \n min_z= %f \n max_x= %f \n max_y= %f \n max_z= %f \n\n STAG_lattice_dim = %d \n", min[0], min[1], min[2], max[0], max[1], max[2], STAG_lattice_dim);
+    trace_name(name, sizeof(name), mpi_rank);
+    trace_file=fopen(name, "wb");
+    if(trace_file==NULL){
+        printf(" Could not open %s -- carrying on without the decision trace.\n\n", name);
+        return;
+    }
+    header[0]=1;
+    header[1]=original_lattice_dim;
+    header[2]=engine;
+    header[3]=trace_output;
+    trace_records=0;
+    fwrite("SPTR", 1, 4, trace_file);
+    fwrite(header, sizeof(int), 4, trace_file);
+    fwrite(&trace_records, sizeof(long long), 1, trace_file);
+
+    trace_buffers=(trace_buffer*)checked_calloc(omp_get_max_threads(), sizeof(trace_buffer), "decision trace");
+    for(t=0;t<omp_get_max_threads();t++){
+        trace_buffers[t].records=(trace_record*)checked_malloc(TRACE_BUFFER*sizeof(trace_record), "decision trace");
+    }
+}
 
-    /* calculate how much the non-"controller" axes will be moved by in STAG (this basically finds the "middle" square of the lattice, which depends if the lattice is odd or even. See comments below for examples */
-    if((STAG_lattice_dim%2)==0){ //if STAG_lattice is even
-        STAG_odd_even_offset= STAG_lattice_dim/2.0;    //e.g. If the lattice is 16 x 16 x 16, the "middle" square is 8 (either 7 or 8 are the middle numbers between squares 0,1,2,3,4,5,6,7,!!8!!,9,10,11,12,13,14,15, and it doesn't matter which we pick -- you can't center a coordinate on an even lattice. Here we pick "8" and shift it slightly up, but it's barely noticeable for large N). We calculate it using 16/2 = 8.
+static void trace_finish(void)
+{
+    char name[32];
+    int t;
+
+    if(trace_file==NULL){
+        return;
     }
-    else{ //if STAG_lattice is odd
-        STAG_odd_even_offset= (STAG_lattice_dim-1)/2.0;   //e.g. If the lattice is 15 x 15 x 15, the "middle" square is "7" (because it's the middle number between squares 0,1,2,3,4,5,6,!!7!!,8,9,10,11,12,13,14). We find this by calculating (15-1)/2 =7.
+    for(t=0;t<omp_get_max_threads();t++){
+        if(trace_buffers[t].count>0){
+            trace_flush(&trace_buffers[t]);
+        }
+        free((void*)trace_buffers[t].records);
     }
+    free((void*)trace_buffers);
 
-    /* find which axes is the "controller" of the grid size - this the the axis that is most negative, and thus needs the biggest shift to make it positive (whichever holds the smallest minimum value) */
-    // These all work in the same way -- once we have the "controller", we base the shift for that axis on it's min[] value, and then simply "center" the other two axes using the offset calculated above (which finds the distance to the "middle" square of the odd or even STAG lattice)
+    fseek(trace_file, 4+4*sizeof(int), SEEK_SET);
+    fwrite(&trace_records, sizeof(long long), 1, trace_file);
+    fclose(trace_file);
+    trace_file=NULL;
 
-    if(min[1]<min[0]){
-        if(min[2]<min[1]){ //z axes is the controller
-            if(ceil(min[0])==ceil(min[2])){
-                STAG_offset[0]= -1.0*min[0]; //if the x-axis has the same minimum as the controller, also translate it by the same amount.
+    trace_name(name, sizeof(name), mpi_rank);
+    printf(" Decision trace: %lld records saved in %s (%.1f MB).\n\n", trace_records, name, (4+4*sizeof(int)+sizeof(long long)+trace_records*sizeof(trace_record))/1.0e6);
+}
+
+/* apply the edge case rules of one sweep to a single cell. All three sweeps use the same rules -- they only differ in which two axes form the slice -- so each sweep passes:
+
+    p[u][v]        the 3x3 neighbourhood of the cell within its slice. u is the "top/bottom" axis, v is the "right/left" axis, and p[1][1] is the cell itself (e.g. p[2][1] == top, p[1][0] == left, p[2][0] == top-left diagonal)
+    top_ec1        the cell checked for an unoccupied "top" edge in edge case 1. This is p[2][1] for the y-z and z-x sweeps -- see sweep_xy() for the exception
+    c[u][v][w]     pointers to the 8 cells in the new grid made from this cell (u and v as above, w along the axis the slices are stacked on)
+
+and it returns the decision made, for the decision trace: (edge case found, or 0) << 3 | TRACE_FILL_0, TRACE_FILL_1, TRACE_RULE_1 or TRACE_RULE_2
+*/
+
+static int slice_rules(int p[3][3], int top_ec1, int* c[2][2][2], int x, int y, int z)
+{
+    int w, edgecase, edge, decision;
+
+    edgecase=0;
+    edge=0;
+    decision=0;
+
+    /* check if there are only two occupied edges, and define which type of shape they are in */
+
+    //edge case 1: bottom-left
+
+    if((p[1][0]==1)&&(p[0][1]==1)&&(p[1][2]==0)&&(top_ec1==0)){ // check if bottom and left edges are occupied (==1), and that the other two edges are either the boundaries of the grid or unoccupied (==0)
+
+        if(diagnostics==1){
+            printf("\n %d %d %d   Edge case 1 found.", x, y, z);
+        }
+        edge=1;
+        //rule 1
+        if(p[1][1]==0){ //if cell is unoccupied
+            for(w=0;w<2;w++){
+                *c[0][0][w]=3; //follow rule 1 for edge case 1 (because we double the resolution, there are two w-positions to apply this rule to!)
             }
-            else{
-                STAG_offset[0]= STAG_odd_even_offset - ceil((max[0]+min[0])/2.0); //otherwise center it in the lattice
+            edgecase=1; //set switch to state that an "edge case has been assigned"
+            decision=TRACE_RULE_1;
+        }
+
+        //rule 2
+        if((p[1][1]==1)&&(p[2][0]==0)&&(p[0][2]==0)){ //if cell is occupied, and both cells along the diagonal are also unoccupied (if either is occupied, we ignore rule 2 -- see 08/08/22)
+            for(w=0;w<2;w++){
+                (*c[0][0][w])++; //inner edge
+                (*c[1][0][w])--; //follow rule 2 and set all new cells to zero except inner edge
+                (*c[1][1][w])--;
+                (*c[0][1][w])--;
             }
+            edgecase=1; //set switch to state that an "edge case has been assigned"
+            decision=TRACE_RULE_2;
+        }
+    }
 
-            if(ceil(min[1])==ceil(min[2])){
-                STAG_offset[1]= -1.0*min[1]; //if the y-axis has the same minimum as the controller, also translate it by the same amount.
+    //edge case 2: top-left
+
+    else if((p[2][1]==1)&&(p[1][0]==1)&&(p[0][1]==0)&&(p[1][2]==0)){ // check if left and top edges are occupied (and check that the other two edges are unoccupied)
+
+        if(diagnostics==1){
+            printf("\n %d %d %d   Edge case 2 found.", x, y, z);
+        }
+        edge=2;
+        //rule 1
+        if(p[1][1]==0){ //if cell is unoccupied
+            for(w=0;w<2;w++){
+                *c[1][0][w]=3; //follow rule 1 for edge case 2
             }
-            else{
-                STAG_offset[1]= STAG_odd_even_offset - ceil((max[1]+min[1])/2.0); //otherwise center it in the lattice
+            edgecase=1; //set switch to state that an "edge case has been assigned"
+            decision=TRACE_RULE_1;
+        }
+
+        //rule 2
+        if((p[1][1]==1)&&(p[2][2]==0)&&(p[0][0]==0)){ //if cell is occupied, and both cells along the diagonal are also unoccupied
+            for(w=0;w<2;w++){
+                (*c[0][0][w])--; //follow rule 2 and set all new cells to zero except inner edge
+                (*c[1][0][w])++; //inner edge
+                (*c[1][1][w])--;
+                (*c[0][1][w])--;
             }
+            edgecase=1; //set switch to state that an "edge case has been assigned"
+            decision=TRACE_RULE_2;
+        }
+    }
 
-            STAG_offset[2]= -1.0*min[2]; //move the z-axis to get it's smallest value increased up to zero
+    //edge case 3: top-right
 
-            //printf("\n The z-axis is the controller (switch 1).");
-            //printf("\n\n STAG_offset[0] = %f \n STAG_offset[1] = %f \n STAG_offset[2] = %f (controller) \n ", STAG_offset[0], STAG_offset[1], STAG_offset[2]);
-        }
-        else{ //y axis is the controller
+    else if((p[1][2]==1)&&(p[2][1]==1)&&(p[1][0]==0)&&(p[0][1]==0)){ // check if top and right edges are occupied (and check that the other two edges are unoccupied)
 
-            if(ceil(min[0])==ceil(min[1])){
-                STAG_offset[0]= -1.0*min[0]; //if the x-axis has the same minimum as the controller, also translate it by the same amount.
+        if(diagnostics==1){
+            printf("\n %d %d %d   Edge case 3 found.", x, y, z);
+        }
+        edge=3;
+        //rule 1
+        if(p[1][1]==0){ //if cell is unoccupied
+            for(w=0;w<2;w++){
+                *c[1][1][w]=3; //follow rule 1 for edge case 3
             }
-            else{
-                STAG_offset[0]= STAG_odd_even_offset - ceil((max[0]+min[0])/2.0); //otherwise center it in the lattice
+            edgecase=1; //set switch to state that an "edge case has been assigned"
+            decision=TRACE_RULE_1;
+        }
+
+        //rule 2
+        if((p[1][1]==1)&&(p[2][0]==0)&&(p[0][2]==0)){ //if cell is occupied, and both cells along the diagonal are also unoccupied
+            for(w=0;w<2;w++){
+                (*c[0][0][w])--; //follow rule 2 and set all new cells to zero except inner edge
+                (*c[1][0][w])--;
+                (*c[1][1][w])++; //inner edge
+                (*c[0][1][w])--;
             }
+            edgecase=1; //set switch to state that an "edge case has been assigned"
+            decision=TRACE_RULE_2;
+        }
+    }
 
-            STAG_offset[1]= -1.0*min[1]; //move the y-axis to get it's smallest value increased up to zero
+    //edge case 4: bottom-right
 
-            if(ceil(min[2])==ceil(min[1])){
-                STAG_offset[2]= -1.0*min[2]; //if the z-axis has the same minimum as the controller, also translate it by the same amount.
-            }
-            else{
-                STAG_offset[2]= STAG_odd_even_offset - ceil((max[2]+min[2])/2.0); //otherwise center it in the lattice
+    else if((p[0][1]==1)&&(p[1][2]==1)&&(p[2][1]==0)&&(p[1][0]==0)){ // check if right and bottom edges are occupied (and check that the other two edges are unoccupied)
+
+        if(diagnostics==1){
+            printf("\n %d %d %d   Edge case 4 found.", x, y, z);
+        }
+        edge=4;
+        //rule 1
+        if(p[1][1]==0){ //if cell is unoccupied
+            for(w=0;w<2;w++){
+                *c[0][1][w]=3; //follow rule 1 for edge case 4
             }
+            edgecase=1; //set switch to state that an "edge case has been assigned"
+            decision=TRACE_RULE_1;
+        }
 
-            //printf("\n The y-axis is the controller.");
-            //printf("\n\n STAG_offset[0] = %f \n STAG_offset[1] = %f (controller) \n STAG_offset[2] = %f \n ", STAG_offset[0], STAG_offset[1], STAG_offset[2]);
+        //rule 2
+        if((p[1][1]==1)&&(p[2][2]==0)&&(p[0][0]==0)){ //if cell is occupied, and both cells along the diagonal are also unoccupied
+            for(w=0;w<2;w++){
+                (*c[0][0][w])--; //follow rule 2 and set all new cells to zero except inner edge
+                (*c[1][0][w])--;
+                (*c[1][1][w])--;
+                (*c[0][1][w])++; //inner edge
+            }
+            edgecase=1; //set switch to state that an "edge case has been assigned"
+            decision=TRACE_RULE_2;
         }
     }
-    else if (min[2]<min[0]){ //z axis is the controller
-        if(ceil(min[0])==ceil(min[2])){
-            STAG_offset[0]= -1.0*min[0]; //if the x-axis has the same minimum as the controller, also translate it by the same amount.
+
+    //if none of the edge cases are satisfied (or if an edge was found, but the checks for RULE 2 failed, leaving edgecase==0 still), fill the new grid with 1's if occupied
+    if((edgecase==0)&&(p[1][1]==1)){
+        if(diagnostics==1){
+            printf("\n %d %d %d   No edge case found, filling with 1's.", x, y, z);
         }
-        else{
-            STAG_offset[0]= STAG_odd_even_offset - ceil((max[0]+min[0])/2.0); //otherwise center it in the lattice
+        decision=TRACE_FILL_1;
+        for(w=0;w<2;w++){
+            (*c[0][0][w])++;
+            (*c[1][0][w])++;       // 1 dipole in original grid -> 8 dipoles in new grid
+            (*c[1][1][w])++;
+            (*c[0][1][w])++;
         }
-
-        if(ceil(min[1])==ceil(min[2])){
-            STAG_offset[1]= -1.0*min[1]; //if the y-axis has the same minimum as the controller, also translate it by the same amount.
+    }
+    //or 0's if unoccupied
+    else if(edgecase==0){
+        if(diagnostics==1){
+            printf("\n %d %d %d   No edge case found, filling with 0's.", x, y, z);
         }
-        else{
-            STAG_offset[1]= STAG_odd_even_offset - ceil((max[1]+min[1])/2.0); //otherwise center it in the lattice
+        decision=TRACE_FILL_0;
+        for(w=0;w<2;w++){
+            (*c[0][0][w])--;
+            (*c[1][0][w])--;
+            (*c[1][1][w])--;
+            (*c[0][1][w])--;
         }
+    }
+    return (edge<<3)|decision;
+}
 
-        STAG_offset[2]= -1.0*min[2]; //move the z-axis to get it's smallest value increased up to zero
+/* the three sweeps for a single cell. child[dx][dy][dz] points at new cell (2x+dx, 2y+dy, 2z+dz) -- either in new_grid itself or in a local 2x2x2 block */
 
-        //printf("\n The z-axis is the controller (switch 2).");
-        //printf("\n\n STAG_offset[0] = %f \n STAG_offset[1] = %f \n STAG_offset[2] = %f (controller) \n ", STAG_offset[0], STAG_offset[1], STAG_offset[2]);
-    }
-    else{ //x axis is the controller
-        STAG_offset[0]= -1.0*min[0]; //move the x-axis to get it's smallest value increased up to zero
+static int sweep_yz(int x, int y, int z, int* child[2][2][2]) // y-z slices along the x-axis: top == y+1, right == z+1
+{
+    int p[3][3], u, v, w;
+    int* c[2][2][2];
 
-        if(ceil(min[1])==ceil(min[0])){
-            STAG_offset[1]= -1.0*min[1]; //if the y-axis has the same minimum as the controller, also translate it by the same amount.
+    for(u=0;u<3;u++){
+        for(v=0;v<3;v++){
+            p[u][v]=occupied(x, y+u-1, z+v-1);
         }
-        else{
-            STAG_offset[1]= STAG_odd_even_offset - ceil((max[1]+min[1])/2.0); //otherwise center it in the lattice
+    }
+    for(u=0;u<2;u++){
+        for(v=0;v<2;v++){
+            for(w=0;w<2;w++){
+                c[u][v][w]=child[w][u][v];
+            }
         }
+    }
+    return slice_rules(p, p[2][1], c, x, y, z);
+}
 
-        if(ceil(min[2])==ceil(min[0])){
-            STAG_offset[2]= -1.0*min[2]; //if the z-axis has the same minimum as the controller, also translate it by the same amount.
+static int sweep_zx(int x, int y, int z, int* child[2][2][2]) // z-x slices along the y-axis: top == z+1, right == x+1
+{
+    int p[3][3], u, v, w;
+    int* c[2][2][2];
+
+    for(u=0;u<3;u++){
+        for(v=0;v<3;v++){
+            p[u][v]=occupied(x+v-1, y, z+u-1);
         }
-        else{
-            STAG_offset[2]= STAG_odd_even_offset - ceil((max[2]+min[2])/2.0); //otherwise center it in the lattice
+    }
+    for(u=0;u<2;u++){
+        for(v=0;v<2;v++){
+            for(w=0;w<2;w++){
+                c[u][v][w]=child[v][w][u];
+            }
         }
+    }
+    return slice_rules(p, p[2][1], c, x, y, z);
+}
 
-        //printf("\n The x-axes is the controller.");
-        //printf("\n\n STAG_offset[0] = %f (controller) \n STAG_offset[1] = %f \n STAG_offset[2] = %f \n ", STAG_offset[0], STAG_offset[1], STAG_offset[2]);
+static int sweep_xy(int x, int y, int z, int* child[2][2][2]) // x-y slices along the z-axis: top == x+1, right == y+1
+{
+    int p[3][3], u, v, w;
+    int* c[2][2][2];
+
+    for(u=0;u<3;u++){
+        for(v=0;v<3;v++){
+            p[u][v]=occupied(x+u-1, y+v-1, z);
+        }
     }
+    for(u=0;u<2;u++){
+        for(v=0;v<2;v++){
+            for(w=0;w<2;w++){
+                c[u][v][w]=child[u][v][w];
+            }
+        }
+    }
+    return slice_rules(p, occupied(x+1, y, 1), c, x, y, z); // NOTE: the x-y sweep has always checked original_grid[x+1][y][1] (rather than [x+1][y][z]) for the top edge in edge case 1. This is kept so that shapes come out identical to earlier versions
+}
 
-    //printf(" \n\n STAG_lattice_dim = %d \n STAG_odd_even_offset = %f     (this is the value that the 'non controller' axes will shift by in STAG coords. It is the 'middle square' of the STAG lattice (depends if STAG lattice is odd or even).\n\n", STAG_lattice_dim, STAG_odd_even_offset);
+/* point child[][][] at the 8 cells of new_grid made from cell x-y-z of the original grid */
 
-    /* Adjust the dipole positions by the offsets found above and same them as positive values for STAG */
+static void new_grid_block(int x, int y, int z, int* child[2][2][2])
+{
+    int dx, dy, dz;
 
-    //printf("\n Dipole position \t\t\t STAG position\n ");
-    for(i=0;i<original_N;i++){
-        STAG_dipole_positions[i][0]= dipole_info[i][0] + STAG_offset[0];
-        STAG_dipole_positions[i][1]= dipole_info[i][1] + STAG_offset[1];
-        STAG_dipole_positions[i][2]= dipole_info[i][2] + STAG_offset[2];
+    for(dx=0;dx<2;dx++){
+        for(dy=0;dy<2;dy++){
+            for(dz=0;dz<2;dz++){
+                child[dx][dy][dz]=new_cell(2*x+dx, 2*y+dy, 2*z+dz);
+            }
+        }
     }
+}
 
-    /* print diagnostics and dipole transformations - two different versions, either for imported coords or sphere-made coords
+/* fill nb[][][] with the 3x3x3 neighbourhood of cell x-y-z in the original grid (nb[1][1][1] is the cell itself) */
+
+static void gather_neighbourhood(int x, int y, int z, int nb[3][3][3])
+{
+    int dx, dy, dz;
+
+    for(dx=0;dx<3;dx++){
+        for(dy=0;dy<3;dy++){
+            for(dz=0;dz<3;dz++){
+                nb[dx][dy][dz]=occupied(x+dx-1, y+dy-1, z+dz-1);
+            }
+        }
+    }
+}
+
+/* run all three sweeps on a single cell, given its 3x3x3 neighbourhood, and return their decisions. Each cell only ever changes its own 8 cells in the new grid, so the result can be worked out in a local block, which holds exactly what new_grid[2x+dx][2y+dy][2z+dz] would after the three sweeps of the dense engine. "quirk" is the cell that sweep_xy() checks instead of the top edge in edge case 1, i.e. original_grid[x+1][y][1] */
+
+static unsigned int spherify_cell(int nb[3][3][3], int quirk, int x, int y, int z, int block[2][2][2])
+{
+    int p[3][3], u, v, w;
+    int* c[2][2][2];
+    unsigned int code;
+
+    for(u=0;u<2;u++){
+        for(v=0;v<2;v++){
+            for(w=0;w<2;w++){
+                block[u][v][w]=0;
+            }
+        }
+    }
+
+    /* y-z slice: top == y+1, right == z+1 */
+    for(u=0;u<3;u++){
+        for(v=0;v<3;v++){
+            p[u][v]=nb[1][u][v];
+        }
+    }
+    for(u=0;u<2;u++){
+        for(v=0;v<2;v++){
+            for(w=0;w<2;w++){
+                c[u][v][w]=&block[w][u][v];
+            }
+        }
+    }
+    code=slice_rules(p, p[2][1], c, x, y, z);
+
+    /* z-x slice: top == z+1, right == x+1 */
+    for(u=0;u<3;u++){
+        for(v=0;v<3;v++){
+            p[u][v]=nb[v][1][u];
+        }
+    }
+    for(u=0;u<2;u++){
+        for(v=0;v<2;v++){
+            for(w=0;w<2;w++){
+                c[u][v][w]=&block[v][w][u];
+            }
+        }
+    }
+    code=code|(slice_rules(p, p[2][1], c, x, y, z)<<6);
+
+    /* x-y slice: top == x+1, right == y+1 */
+    for(u=0;u<3;u++){
+        for(v=0;v<3;v++){
+            p[u][v]=nb[u][v][1];
+        }
+    }
+    for(u=0;u<2;u++){
+        for(v=0;v<2;v++){
+            for(w=0;w<2;w++){
+                c[u][v][w]=&block[u][v][w];
+            }
+        }
+    }
+    code=code|(slice_rules(p, quirk, c, x, y, z)<<12);
+    return code; //the decisions of all three sweeps, as kept in a trace record
+}
+
+/* run one of the three sweeps (0 = y-z, 1 = z-x, 2 = x-y) over every cell of the grid (or of this process's slab), and return how long it took. With the tiled layout the grid is swept one tile at a time, so the neighbours of each cell (and the new cells it fills) are nearly always still in the cache, whichever way the slices are oriented. Otherwise the whole grid is one "tile" and the cells are visited in the same order as always */
+
+/* the sweeps share the slab between threads in blocks of sweep_block() x-planes: one tile in the tiled layout, otherwise one plane. Every cell only changes its own 8 cells in the new grid, so the blocks can be swept in any order (except with diagnostics, which prints as it goes) */
+
+static int sweep_block(void)
+{
+    if(layout==1){
+        return TILE_SIZE;
+    }
+    return 1;
+}
+
+static double sweep_pass(int sweep)
+{
+    int x, y, z, b, blocks, tx, ty, tz, x1, y1, z1, step, code;
+    int* child[2][2][2];
+    double start;
+
+    start=omp_get_wtime();
+
+    step=original_lattice_dim;
+    if(layout==1){
+        step=TILE_SIZE;
+    }
+    blocks=(slab_end-slab_begin+sweep_block()-1)/sweep_block();
+
+    #pragma omp parallel for schedule(static) private(x, y, z, tx, ty, tz, x1, y1, z1, child, code) if(diagnostics==0)
+    for(b=0;b<blocks;b++){
+        tx=slab_begin+b*sweep_block();
+        for(ty=0;ty<original_lattice_dim;ty=ty+step){
+            for(tz=0;tz<original_lattice_dim;tz=tz+step){
+                x1=(tx+sweep_block()<slab_end) ? tx+sweep_block() : slab_end;
+                y1=(ty+step<original_lattice_dim) ? ty+step : original_lattice_dim;
+                z1=(tz+step<original_lattice_dim) ? tz+step : original_lattice_dim;
+
+                if(sweep==0){
+                    for(x=tx;x<x1;x++){
+                        for(y=ty;y<y1;y++){
+                            for(z=tz;z<z1;z++){
+                                new_grid_block(x, y, z, child);
+                                code=sweep_yz(x, y, z, child);
+                                if(trace_file!=NULL){
+                                    trace_cell(x, y, z, 1, code);
+                                }
+                            }
+                        }
+                    }
+                }
+                else if(sweep==1){
+                    for(y=ty;y<y1;y++){
+                        for(z=tz;z<z1;z++){
+                            for(x=tx;x<x1;x++){
+                                new_grid_block(x, y, z, child);
+                                code=sweep_zx(x, y, z, child);
+                                if(trace_file!=NULL){
+                                    trace_cell(x, y, z, 1, code<<6);
+                                }
+                            }
+                        }
+                    }
+                }
+                else{
+                    for(z=tz;z<z1;z++){
+                        for(x=tx;x<x1;x++){
+                            for(y=ty;y<y1;y++){
+                                new_grid_block(x, y, z, child);
+                                code=sweep_xy(x, y, z, child);
+                                if(trace_file!=NULL){
+                                    trace_cell(x, y, z, 1, code<<12);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    return omp_get_wtime()-start;
+}
+
+/* DENSE ENGINE: the original method -- three sweeps over every cell of the original grid, in y-z, z-x and x-y slices */
+
+static void dense_engine(void)
+{
+    double sweep_time[3];
+
+    /* search through y-z slices along the x-axis */
+
+    sweep_time[0]=sweep_pass(0);
+
+    /* diagnostics - print original grid to screen (only for small grid sizes that will display in the console) */
+
+    if(diagnostics==1){
+        printf ("\n\n --------------------- Original grid ---------------------\n");
+        for(x=0;x<original_lattice_dim;x++){
+            printf("\n  y-z slice at x = %d    \n", x);
+            printf("\n        Coordinates                                 Values                                       xyz coords  \n\n");
+            for(y=(original_lattice_dim-1);y>(-1);y--){
+                for(z=0;z<original_lattice_dim;z++){
+                    printf("   %d-%d   ", y,z); //print coord positions
+                }
+                printf("                  ");
+                for(z=0;z<original_lattice_dim;z++){
+                    printf("   %d   ", *original_cell(x, y, z)); //print values at these coords
+                }
+                printf("                  ");
+                for(z=0;z<original_lattice_dim;z++){
+                    printf("   %d %d %d   ", x,y,z); //print values at these coords
+                }
+                printf("\n\n");
+            }
+            printf("\n\n\n\n");
+        }
+
+        printf ("\n\n --------------------- New grid ---------------------\n");
+        for(x=0;x<new_lattice_dim;x++){
+            printf("\n  y-z slice at x = %d    \n", x);
+            printf("\n                       Coordinates                                                       Values                                                            xyz coords \n\n");
+            for(y=(new_lattice_dim-1);y>(-1);y--){
+                for(z=0;z<new_lattice_dim;z++){
+                    printf("   %d-%d   ", y,z); //print coord positions
+                }
+                printf("                  ");
+                for(z=0;z<new_lattice_dim;z++){
+                    printf("   %d   ", *new_cell(x, y, z)); //print values at these coords
+                }
+                printf("                  ");
+                for(z=0;z<new_lattice_dim;z++){
+                    printf("   %d %d %d   ", x,y,z); //print values at these coords
+                }
+                printf("\n\n");
+            }
+            printf("\n\n\n\n");
+        }
+
+
+        /* save high resolution output to STAG_spherify data file */
+
+        new_grid_outfile=fopen("high_res.txt","w"); //open file for saving dipole positions
+
+        dipole_count=0;
+        for(x=0;x<new_lattice_dim;x++){
+            for(y=0;y<new_lattice_dim;y++){
+                for(z=0;z<new_lattice_dim;z++){
+                    if(*new_cell(x, y, z)>0){
+                        fprintf(new_grid_outfile,"%d, %d, %d\n", x,y,z); //save x-y-z coords of any dipoles that have values > 0 (should still be dipoles, on average, after three "sweeps" in the x-,  y- and z- directions)
+                        dipole_count++; //keep track of how many dipoles we are recording
+                    }
+                }
+            }
+        }
+
+        /* The final row is extra data needed for the python visulisation S.T.A.G program, NOT a dipole! */
+        fprintf(new_grid_outfile,"%d, %lld, %d\n", new_lattice_dim, dipole_count, new_lattice_dim); //the final row contains the number of dipoles, the grid size, and a random number just to keep the shape of three columns for python to read */
+        fclose(new_grid_outfile);
+
+        /* run xSTAG_spherify on each file - views both the original and higher resolution images in 3D */
+
+        system("xSTAG_spherify.bat"); //opens a batch file with a command to run STAG_spherify as a python script
+    }
+
+
+
+    /* search through z-x slices along the y-axis */
+
+    sweep_time[1]=sweep_pass(1);
+
+    if(diagnostics==1){
+        printf ("\n\n --------------------- Original grid ---------------------\n");
+        for(y=0;y<original_lattice_dim;y++){
+            printf("\n  z-x slice at y = %d    \n", y);
+            printf("\n        Coordinates                                 Values                                       xyz coords  \n\n");
+            for(z=(original_lattice_dim-1);z>(-1);z--){
+                for(x=0;x<original_lattice_dim;x++){
+                    printf("   %d-%d   ", z,x); //print coord positions
+                }
+                printf("                  ");
+                for(x=0;x<original_lattice_dim;x++){
+                    printf("   %d   ", *original_cell(x, y, z)); //print values at these coords
+                }
+                printf("                  ");
+                for(x=0;x<original_lattice_dim;x++){
+                    printf("   %d %d %d   ", x,y,z); //print values at these coords
+                }
+                printf("\n\n");
+            }
+            printf("\n\n\n\n");
+        }
+
+        printf ("\n\n --------------------- New grid ---------------------\n");
+        for(y=0;y<new_lattice_dim;y++){
+            printf("\n  z-x slice at y = %d    \n", y);
+            printf("\n                       Coordinates                                                       Values                                                            xyz coords \n\n");
+            for(z=(new_lattice_dim-1);z>(-1);z--){
+                for(x=0;x<new_lattice_dim;x++){
+                    printf("   %d-%d   ", z,x); //print coord positions
+                }
+                printf("                  ");
+                for(x=0;x<new_lattice_dim;x++){
+                    printf("   %d   ", *new_cell(x, y, z)); //print values at these coords
+                }
+                printf("                  ");
+                for(x=0;x<new_lattice_dim;x++){
+                    printf("   %d %d %d   ", x,y,z); //print values at these coords
+                }
+                printf("\n\n");
+            }
+            printf("\n\n\n\n");
+        }
+
+        /* save high resolution output to STAG_spherify data file */
+
+        new_grid_outfile=fopen("high_res.txt","w"); //open file for saving dipole positions
+
+        dipole_count=0;
+        for(x=0;x<new_lattice_dim;x++){
+            for(y=0;y<new_lattice_dim;y++){
+                for(z=0;z<new_lattice_dim;z++){
+                    if(*new_cell(x, y, z)>0){
+                        fprintf(new_grid_outfile,"%d, %d, %d\n", x,y,z); //save x-y-z coords of any dipoles that have values > 0 (should still be dipoles, on average, after three "sweeps" in the x-,  y- and z- directions)
+                        dipole_count++; //keep track of how many dipoles we are recording
+                    }
+                }
+            }
+        }
+
+        /* The final row is extra data needed for the python visulisation S.T.A.G program, NOT a dipole! */
+        fprintf(new_grid_outfile,"%d, %lld, %d\n", new_lattice_dim, dipole_count, new_lattice_dim); //the final row contains the number of dipoles, the grid size, and a random number just to keep the shape of three columns for python to read */
+        fclose(new_grid_outfile);
+
+        /* run xSTAG_spherify on each file - views both the original and higher resolution images in 3D */
+
+        system("xSTAG_spherify.bat"); //opens a batch file with a command to run STAG_spherify as a python script
+    }
+
+
+
+    /* search through x-y slices along the z-axis */
+
+    sweep_time[2]=sweep_pass(2);
+
+    if(diagnostics==1){
+        printf ("\n\n --------------------- Original grid ---------------------\n");
+        for(z=0;z<original_lattice_dim;z++){
+            printf("\n  x-y slice at z = %d    \n", z);
+            printf("\n        Coordinates                                 Values                                       xyz coords  \n\n");
+            for(x=(original_lattice_dim-1);x>(-1);x--){
+                for(y=0;y<original_lattice_dim;y++){
+                    printf("   %d-%d   ", x,y); //print coord positions
+                }
+                printf("                  ");
+                for(y=0;y<original_lattice_dim;y++){
+                    printf("   %d   ", *original_cell(x, y, z)); //print values at these coords
+                }
+                printf("                  ");
+                for(y=0;y<original_lattice_dim;y++){
+                    printf("   %d %d %d   ", x,y,z); //print values at these coords
+                }
+                printf("\n\n");
+            }
+            printf("\n\n\n\n");
+        }
+
+        printf ("\n\n --------------------- New grid ---------------------\n");
+        for(z=0;z<new_lattice_dim;z++){
+            printf("\n  x-y slice at z = %d    \n", z);
+            printf("\n                       Coordinates                                                       Values                                                            xyz coords \n\n");
+            for(x=(new_lattice_dim-1);x>(-1);x--){
+                for(y=0;y<new_lattice_dim;y++){
+                    printf("   %d-%d   ", x,y); //print coord positions
+                }
+                printf("                  ");
+                for(y=0;y<new_lattice_dim;y++){
+                    printf("   %d   ", *new_cell(x, y, z)); //print values at these coords
+                }
+                printf("                  ");
+                for(y=0;y<new_lattice_dim;y++){
+                    printf("   %d %d %d   ", x,y,z); //print values at these coords
+                }
+                printf("\n\n");
+            }
+            printf("\n\n\n\n");
+        }
+    }
+
+    printf(" Sweeps complete (y-z: %.3f s, z-x: %.3f s, x-y: %.3f s).\n\n", sweep_time[0], sweep_time[1], sweep_time[2]);
+}
+
+/* compare function for qsort - sorts dipoles into x-y-z order */
+
+static int compare_cells(const void* a, const void* b)
+{
+    size_t cell_a, cell_b;
+
+    cell_a=*(const size_t*)a;
+    cell_b=*(const size_t*)b;
+    if(cell_a<cell_b){
+        return -1;
+    }
+    return (cell_a>cell_b);
+}
+
+/* SURFACE ENGINE: in a compact particle, most cells are either deep interior (which always get "filling with 1's" in all three sweeps) or empty space (which always gets "filling with 0's"). Only cells within one step of the surface can trigger an edge case. So first build a work list of boundary cells -- those with a face or edge neighbour that differs from themselves -- and run the edge case logic on those alone. Interior blocks are bulk-filled and exterior blocks are skipped (they stay <= 0, which is all the exporters check), so the work scales with the surface area of the particle rather than the volume of the grid */
+
+/* sort a list of cells (x-y-z indices into the original grid) and remove any repeats, returning how many are left */
+
+static size_t unique_cells(size_t* cells, size_t count)
+{
+    size_t m, kept;
+
+    if(count==0){
+        return 0;
+    }
+    qsort(cells, count, sizeof(size_t), compare_cells);
+    kept=1;
+    for(m=1;m<count;m++){
+        if(cells[m]!=cells[kept-1]){
+            cells[kept]=cells[m];
+            kept++;
+        }
+    }
+    return kept;
+}
+
+/* add cell x-y-z to the surface work list. Each boundary cell is added once for every dipole next to it, so whenever the list fills up it is sorted and the repeats removed before it is allowed to grow -- the list stays the size of the surface, without a flag for every cell in the grid */
+
+static void add_surface_cell(size_t** cells, size_t* count, size_t* size, int x, int y, int z)
+{
+    if(*count==*size){
+        *count=unique_cells(*cells, *count);
+        if(*count>*size/2){
+            *size=2*(*size);
+            *cells=(size_t*)checked_realloc(*cells, *size*sizeof(size_t), "surface work list");
+        }
+    }
+    (*cells)[*count]=((size_t)x*original_lattice_dim+y)*original_lattice_dim+z;
+    (*count)++;
+}
+
+static void surface_engine(void)
+{
+    int n, cx, cy, cz, dx, dy, dz, interior, interior_count;
+    size_t m, surface_count, surface_size;
+    size_t* surface_cells;
+    int nb[3][3][3], block[2][2][2];
+    size_t plane;
+    unsigned int code;
+
+    surface_size=1024;
+    surface_cells=(size_t*)checked_malloc(surface_size*sizeof(size_t), "surface work list"); //x-y-z index of each cell in the work list
+    surface_count=0;
+    interior_count=0;
+
+    /* every boundary cell is either a dipole, or an empty cell next to one -- so the list can be built from the dipoles alone, without searching the empty space around the particle */
+
+    for(n=0;n<original_N;n++){
+        cx=dipole_cell(n, 0);
+        cy=dipole_cell(n, 1);
+        cz=dipole_cell(n, 2);
+
+        interior=1;
+        for(dx=-1;dx<2;dx++){
+            for(dy=-1;dy<2;dy++){
+                for(dz=-1;dz<2;dz++){
+                    if((abs(dx)+abs(dy)+abs(dz)==0)||(abs(dx)+abs(dy)+abs(dz)==3)){
+                        continue; //only face and edge neighbours -- the corners never take part in any edge case
+                    }
+                    if(occupied(cx+dx, cy+dy, cz+dz)==0){
+                        interior=0; //this dipole is on the surface...
+
+                        if((cx+dx>=0)&&(cy+dy>=0)&&(cz+dz>=0)&&(cx+dx<original_lattice_dim)&&(cy+dy<original_lattice_dim)&&(cz+dz<original_lattice_dim)){
+                            add_surface_cell(&surface_cells, &surface_count, &surface_size, cx+dx, cy+dy, cz+dz); //...and so is the empty cell next to it
+                        }
+                    }
+                }
+            }
+        }
+
+        if(interior==1){
+            if(*new_cell(2*cx, 2*cy, 2*cz)==3){
+                continue; //already filled (repeated dipole in shape.dat)
+            }
+            /* deep interior - no edge case can be found here, so all three sweeps would just fill the new cells with 1's */
+            for(dx=0;dx<2;dx++){
+                for(dy=0;dy<2;dy++){
+                    for(dz=0;dz<2;dz++){
+                        *new_cell(2*cx+dx, 2*cy+dy, 2*cz+dz)=3;
+                    }
+                }
+            }
+            if(trace_file!=NULL){
+                trace_cell(cx, cy, cz, 1, TRACE_FILL_1|(TRACE_FILL_1<<6)|(TRACE_FILL_1<<12));
+            }
+            interior_count++;
+        }
+        else{
+            add_surface_cell(&surface_cells, &surface_count, &surface_size, cx, cy, cz);
+        }
+    }
+    surface_count=unique_cells(surface_cells, surface_count); //so that no cell is swept twice
+
+    printf(" Surface work list built: %zu boundary cells, %d interior cells bulk-filled (%lld cells in grid).\n\n", surface_count, interior_count, (long long)original_lattice_dim*original_lattice_dim*original_lattice_dim);
+
+    /* run all three sweeps on each boundary cell */
+
+    plane=(size_t)original_lattice_dim*original_lattice_dim;
+    for(m=0;m<surface_count;m++){
+        cx=(int)(surface_cells[m]/plane);
+        cy=(int)(surface_cells[m]%plane/original_lattice_dim);
+        cz=(int)(surface_cells[m]%original_lattice_dim);
+
+        gather_neighbourhood(cx, cy, cz, nb);
+        code=spherify_cell(nb, occupied(cx+1, cy, 1), cx, cy, cz, block);
+        if(trace_file!=NULL){
+            trace_cell(cx, cy, cz, 1, code);
+        }
+
+        for(dx=0;dx<2;dx++){
+            for(dy=0;dy<2;dy++){
+                for(dz=0;dz<2;dz++){
+                    *new_cell(2*cx+dx, 2*cy+dy, 2*cz+dz)=block[dx][dy][dz];
+                }
+            }
+        }
+    }
+
+    free((void*)surface_cells);
+}
+
+/* RUN-LENGTH ENGINE: along any axis, a DDSCAT target is mostly made of long runs of occupied cells, and every edge case check in the sweeps can only change where a run starts or ends (in the current row, or one of the 8 rows around it). So this engine stores the original grid as a list of runs along z for each x-y row, only works out the sweeps at the ends of runs, and stores the new grid as runs too. Neither full grid is ever allocated. */
+
+static int compare_ints(const void* a, const void* b)
+{
+    return (*(const int*)a>*(const int*)b)-(*(const int*)a<*(const int*)b);
+}
+
+/* turn the list of dipoles into runs along each row of the original grid (report = 1 to print how much memory they take) */
+
+static void build_original_runs(int report)
+{
+    int n, z0, run_end;
+    size_t row, current_row, *cells;
+    size_t run_total;
+
+    cells=(size_t*)checked_malloc(original_N*sizeof(size_t), "sorted dipole list");
+    for(n=0;n<original_N;n++){
+        cells[n]=((size_t)dipole_cell(n, 0)*original_lattice_dim+dipole_cell(n, 1))*original_lattice_dim+dipole_cell(n, 2);
+    }
+    qsort(cells, original_N, sizeof(size_t), compare_cells);
+
+    original_row_start=(size_t*)checked_malloc(((size_t)original_lattice_dim*original_lattice_dim+1)*sizeof(size_t), "original grid (runs)");
+    original_runs=(int*)checked_malloc(2*(size_t)original_N*sizeof(int), "original grid (runs)"); //there can never be more runs than dipoles
+
+    run_total=0;
+    current_row=0;
+    original_row_start[0]=0;
+    for(n=0;n<original_N;n++){
+        row=cells[n]/original_lattice_dim;
+        z0=cells[n]%original_lattice_dim;
+
+        while(current_row<row){ //moved on to a new row -- any rows skipped over are empty
+            current_row++;
+            original_row_start[current_row]=run_total;
+        }
+
+        run_end=-1;
+        if(run_total>original_row_start[current_row]){
+            run_end=original_runs[run_total-1]; //end of the last run in this row
+        }
+
+        if(run_end==z0){
+            original_runs[run_total-1]=z0+1; //this dipole continues the last run
+        }
+        else if(run_end<z0){
+            original_runs[run_total]=z0; //this dipole starts a new run
+            original_runs[run_total+1]=z0+1;
+            run_total=run_total+2;
+        }
+        //otherwise this dipole is a repeat of one already in shape.dat -- ignore it
+    }
+    while(current_row<(size_t)original_lattice_dim*original_lattice_dim){
+        current_row++;
+        original_row_start[current_row]=run_total;
+    }
+
+    free((void*)cells);
+
+    if(report==1){
+        printf(" Run-length grid created: %zu runs (%.1f MB, compared to %.1f MB for the full grid).\n", run_total/2, (run_total*sizeof(int)+((size_t)original_lattice_dim*original_lattice_dim+1)*sizeof(size_t))/1.0e6, (double)original_lattice_dim*original_lattice_dim*original_lattice_dim*sizeof(int)/1.0e6);
+    }
+}
+
+/* is z inside one of the n runs in r[]? The search starts at run number "first", so a row can be walked along in increasing z without starting from the beginning each time */
+
+static int run_occupied(int* r, int n, int first, int z)
+{
+    int m;
+
+    for(m=first;(m<n)&&(r[2*m]<=z);m++){
+        if(z<r[2*m+1]){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* add the cells from z0 up to (but not including) z1 onto the end of a row of runs, joining them onto the last run if they touch it */
+
+static void append_run(int* r, int* n, int z0, int z1)
+{
+    if((*n>0)&&(r[2*(*n)-1]==z0)){
+        r[2*(*n)-1]=z1;
+    }
+    else{
+        r[2*(*n)]=z0;
+        r[2*(*n)+1]=z1;
+        (*n)++;
+    }
+}
+
+/* work out rows 2y, 2y+1 of planes 2x, 2x+1 of the new grid (new_row[dx][dy], with new_row_count[dx][dy] runs) from the runs of the original grid around row x-y. events[] is space for the positions to check: 54*original_lattice_dim+1 ints */
+
+static void refine_row_runs(int px, int py, int* events, int* new_row[2][2], int new_row_count[2][2])
+{
+    int dx, dy, dz, a, b, e, n, z0, z1, quirk, nonzero, event_count;
+    int nb[3][3][3], block[2][2][2];
+    unsigned int code;
+    int* rows[3][3];
+    int row_count[3][3], row_position[3][3];
+    size_t r;
+
+    /* find the 9 rows around this one (rows outside the grid are empty) */
+
+    event_count=0;
+    events[event_count++]=0; //always check the first cell of the row
+    for(a=0;a<3;a++){
+        for(b=0;b<3;b++){
+            row_count[a][b]=0;
+            rows[a][b]=NULL;
+            row_position[a][b]=0;
+            if((px+a-1>=0)&&(px+a-1<original_lattice_dim)&&(py+b-1>=0)&&(py+b-1<original_lattice_dim)){
+                r=(size_t)(px+a-1)*original_lattice_dim+(py+b-1);
+                rows[a][b]=original_runs+original_row_start[r];
+                row_count[a][b]=(original_row_start[r+1]-original_row_start[r])/2;
+            }
+
+            /* the neighbourhood of a cell only changes where it is within one cell of a run starting or ending */
+            for(n=0;n<row_count[a][b];n++){
+                for(e=0;e<2;e++){
+                    for(dz=-1;dz<2;dz++){
+                        z0=rows[a][b][2*n+e]+dz;
+                        if((z0>=0)&&(z0<original_lattice_dim)){
+                            events[event_count++]=z0;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    for(dx=0;dx<2;dx++){
+        for(dy=0;dy<2;dy++){
+            new_row_count[dx][dy]=0;
+        }
+    }
+
+    if(event_count>1){ //if not, the row and everything around it is empty, so all of the new cells will be empty too
+
+        qsort(events, event_count, sizeof(int), compare_ints);
+
+        quirk=0;
+        if(px+1<original_lattice_dim){
+            quirk=run_occupied(rows[2][1], row_count[2][1], 0, 1); //see sweep_xy()
+        }
+
+        for(e=0;e<event_count;e++){
+            if((e>0)&&(events[e]==events[e-1])){
+                continue; //already checked here
+            }
+            z0=events[e]; //the neighbourhood is the same for every cell from z0 up to the next position in the list...
+            z1=original_lattice_dim;
+            for(n=e+1;n<event_count;n++){
+                if(events[n]!=z0){
+                    z1=events[n]; //...which is here
+                    break;
+                }
+            }
+
+            nonzero=0;
+            for(a=0;a<3;a++){
+                for(b=0;b<3;b++){
+                    while((row_position[a][b]<row_count[a][b])&&(rows[a][b][2*row_position[a][b]+1]<=z0-1)){
+                        row_position[a][b]++; //skip past any runs that end before this neighbourhood starts
+                    }
+                    for(dz=0;dz<3;dz++){
+                        nb[a][b][dz]=0;
+                        if((z0+dz-1>=0)&&(z0+dz-1<original_lattice_dim)){
+                            nb[a][b][dz]=run_occupied(rows[a][b], row_count[a][b], row_position[a][b], z0+dz-1);
+                        }
+                        nonzero=nonzero+nb[a][b][dz];
+                    }
+                }
+            }
+
+            if(nonzero==0){
+                continue; //empty space -- "filling with 0's"
+            }
+
+            code=spherify_cell(nb, quirk, px, py, z0, block);
+            if(trace_file!=NULL){
+                trace_cell(px, py, z0, z1-z0, code); //(every cell from z0 to z1 has the same neighbourhood, so the same decisions)
+            }
+
+            for(dx=0;dx<2;dx++){
+                for(dy=0;dy<2;dy++){
+                    if((block[dx][dy][0]>0)&&(block[dx][dy][1]>0)){
+                        append_run(new_row[dx][dy], &new_row_count[dx][dy], 2*z0, 2*z1);
+                    }
+                    else{
+                        for(dz=0;dz<2;dz++){
+                            if(block[dx][dy][dz]>0){
+                                for(n=z0;n<z1;n++){
+                                    append_run(new_row[dx][dy], &new_row_count[dx][dy], 2*n+dz, 2*n+dz+1);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void rle_engine(void)
+{
+    int dx, dy;
+    int* events;
+    int* new_row[2][2];
+    int new_row_count[2][2];
+    int* plane_runs[2];
+    size_t plane_size[2], plane_total[2], new_size, new_total, row;
+    size_t* plane_row_start[2];
+
+    events=(int*)checked_malloc((54*original_lattice_dim+1)*sizeof(int), "run-length engine"); //every run end in the 9 rows around a cell adds up to 6 positions to check (3 for each row, at most)
+    for(dx=0;dx<2;dx++){
+        for(dy=0;dy<2;dy++){
+            new_row[dx][dy]=(int*)checked_malloc((2*new_lattice_dim+2)*sizeof(int), "run-length engine");
+        }
+        plane_size[dx]=1024;
+        plane_runs[dx]=(int*)checked_malloc(plane_size[dx]*sizeof(int), "run-length engine");
+        plane_row_start[dx]=(size_t*)checked_malloc((new_lattice_dim+1)*sizeof(size_t), "run-length engine");
+    }
+
+    new_size=1024;
+    new_total=0;
+    new_runs=(int*)checked_malloc(new_size*sizeof(int), "new grid (runs)");
+    new_row_start=(size_t*)checked_malloc(((size_t)new_lattice_dim*new_lattice_dim+1)*sizeof(size_t), "new grid (runs)");
+
+    for(x=0;x<original_lattice_dim;x++){
+
+        plane_total[0]=0;
+        plane_total[1]=0;
+
+        for(y=0;y<original_lattice_dim;y++){
+
+            refine_row_runs(x, y, events, new_row, new_row_count);
+
+            /* rows 2y and 2y+1 of planes 2x and 2x+1 of the new grid are now finished */
+
+            for(dx=0;dx<2;dx++){
+                for(dy=0;dy<2;dy++){
+                    plane_row_start[dx][2*y+dy]=plane_total[dx];
+                    if(plane_total[dx]+2*new_row_count[dx][dy]>plane_size[dx]){
+                        plane_size[dx]=2*(plane_total[dx]+2*new_row_count[dx][dy]);
+                        plane_runs[dx]=(int*)checked_realloc(plane_runs[dx], plane_size[dx]*sizeof(int), "run-length engine");
+                    }
+                    memcpy(plane_runs[dx]+plane_total[dx], new_row[dx][dy], 2*new_row_count[dx][dy]*sizeof(int));
+                    plane_total[dx]=plane_total[dx]+2*new_row_count[dx][dy];
+                }
+            }
+        }
+
+        /* both planes are finished -- add them to the new grid */
+
+        for(dx=0;dx<2;dx++){
+            if(new_total+plane_total[dx]>new_size){
+                new_size=2*(new_total+plane_total[dx]);
+                new_runs=(int*)checked_realloc(new_runs, new_size*sizeof(int), "new grid (runs)");
+            }
+            memcpy(new_runs+new_total, plane_runs[dx], plane_total[dx]*sizeof(int));
+            for(row=0;row<(size_t)new_lattice_dim;row++){
+                new_row_start[(size_t)(2*x+dx)*new_lattice_dim+row]=new_total+plane_row_start[dx][row];
+            }
+            new_total=new_total+plane_total[dx];
+        }
+    }
+    new_row_start[(size_t)new_lattice_dim*new_lattice_dim]=new_total;
+
+    printf(" Run-length sweeps complete: %zu runs in the new grid (%.1f MB, compared to %.1f MB for the full grid).\n\n", new_total/2, (new_total*sizeof(int)+((size_t)new_lattice_dim*new_lattice_dim+1)*sizeof(size_t))/1.0e6, (double)new_lattice_dim*new_lattice_dim*new_lattice_dim*sizeof(int)/1.0e6);
+
+    free((void*)events);
+    for(dx=0;dx<2;dx++){
+        for(dy=0;dy<2;dy++){
+            free((void*)new_row[dx][dy]);
+        }
+        free((void*)plane_runs[dx]);
+        free((void*)plane_row_start[dx]);
+    }
+}
+
+/* fill runs[] with the (start z, end z) pairs of the runs of dipoles along row x-y of the original grid, and return how many runs there are. runs[] needs space for 2*original_lattice_dim+2 ints */
+
+static int original_row(int x, int y, int* runs)
+{
+    int n, z0;
+    size_t r;
+
+    n=0;
+    if(engine>=2){
+        r=(size_t)x*original_lattice_dim+y;
+        n=(original_row_start[r+1]-original_row_start[r])/2;
+        memcpy(runs, original_runs+original_row_start[r], 2*n*sizeof(int));
+    }
+    else{
+        for(z0=0;z0<original_lattice_dim;z0++){
+            if(*original_cell(x, y, z0)==1){
+                append_run(runs, &n, z0, z0+1);
+            }
+        }
+    }
+    return n;
+}
+
+/* row X-Y of the rebuilt grid. The removed cells are all in the upsampled row and the added ones all outside it, so the row is just the upsampled row with every cell between two changes flipped -- the positions where a run starts or ends in either list, except those in both */
+
+static int delta_refined_row(int x, int y, int* runs)
+{
+    size_t r, a, a_end, b, b_end;
+    int n, za, zb;
+
+    r=(size_t)(x/2)*original_lattice_dim+y/2;
+    a=original_row_start[r];
+    a_end=original_row_start[r+1];
+    r=(size_t)x*new_lattice_dim+y;
+    b=delta_row_start[r];
+    b_end=delta_row_start[r+1];
+
+    n=0;
+    while((a<a_end)||(b<b_end)){
+        za=(a<a_end) ? 2*original_runs[a] : INT32_MAX;
+        zb=(b<b_end) ? delta_toggles[b] : INT32_MAX;
+        if(za==zb){
+            a++;
+            b++;
+            continue;
+        }
+        runs[n]=(za<zb) ? za : zb;
+        n++;
+        if(za<zb){
+            a++;
+        }
+        else{
+            b++;
+        }
+    }
+    return n/2;
+}
+
+/* the same for row x-y of the new grid (any cell with a value > 0 is a dipole). runs[] needs space for 2*new_lattice_dim+2 ints */
+
+static int refined_row(int x, int y, int* runs)
+{
+    int n, z0;
+    size_t r;
+
+    n=0;
+    if(engine==2){
+        r=(size_t)x*new_lattice_dim+y;
+        n=(new_row_start[r+1]-new_row_start[r])/2;
+        memcpy(runs, new_runs+new_row_start[r], 2*n*sizeof(int));
+    }
+    else if(engine==4){
+        n=delta_refined_row(x, y, runs);
+    }
+    else if(engine==3){
+        if((x/2!=stream_x)||(y/2!=stream_y)){ //(rows are nearly always asked for in order, so each original row is only worked out twice: for planes 2x and 2x+1)
+            refine_row_runs(x/2, y/2, stream_events, stream_rows, stream_row_count);
+            stream_x=x/2;
+            stream_y=y/2;
+        }
+        n=stream_row_count[x%2][y%2];
+        memcpy(runs, stream_rows[x%2][y%2], 2*n*sizeof(int));
+    }
+    else{
+        for(z0=0;z0<new_lattice_dim;z0++){
+            if(*new_cell(x, y, z0)>0){
+                append_run(runs, &n, z0, z0+1);
+            }
+        }
+    }
+    return n;
+}
+
+/* COMPOSITIONS: each dipole of the new grid is made of the same materials as its parent cell in the original grid -- or, for a cell that spherify added (its parent is empty), as the nearest dipole around the parent: first across a face, then an edge, then a corner */
+
+static int compare_material_cells(const void* a, const void* b)
+{
+    const material_cell* p=(const material_cell*)a;
+    const material_cell* q=(const material_cell*)b;
+
+    if(p->cell!=q->cell){
+        return (p->cell<q->cell) ? -1 : 1;
+    }
+    return memcmp(p->comp, q->comp, 3);
+}
+
+static int compare_material_cell_keys(const void* a, const void* b)
+{
+    const material_cell* p=(const material_cell*)a;
+    const material_cell* q=(const material_cell*)b;
+
+    return (p->cell<q->cell) ? -1 : (p->cell>q->cell);
+}
+
+/* number the materials (from the whole table, so every process agrees), and sort the compositions of the cells this process will look up: its slab and the halo planes either side of it */
+
+static void materials_init(void)
+{
+    int a, n, x, same;
+    size_t m, kept;
+    uint64_t d;
+
+    memset(material_number, 0, sizeof(material_number));
+    for(n=0;n<original_N;n++){
+        material_number[dipole_comp[0][n]]=1;
+    }
+    material_count=0;
+    for(n=0;n<256;n++){
+        if(material_number[n]==1){
+            material_count++;
+            material_number[n]=(unsigned char)material_count;
+        }
+    }
+
+    same=1;
+    for(a=0;a<3;a++){
+        material_default[a]=(original_N>0) ? dipole_comp[a][0] : 1;
+        for(n=1;(n<original_N)&&(same==1);n++){
+            same=(dipole_comp[a][n]==material_default[a]);
+        }
+    }
+    material_cells=NULL;
+    material_cell_count=0;
+    if(same==1){
+        return; //(nothing to look up)
+    }
+
+    d=original_lattice_dim;
+    for(n=0;n<original_N;n++){
+        x=dipole_cell(n, 0);
+        material_cell_count=material_cell_count+((x>=slab_begin-1)&&(x<=slab_end));
+    }
+    material_cells=(material_cell*)checked_malloc(material_cell_count*sizeof(material_cell)+1, "compositions");
+    m=0;
+    for(n=0;n<original_N;n++){
+        x=dipole_cell(n, 0);
+        if((x>=slab_begin-1)&&(x<=slab_end)){
+            material_cells[m].cell=((uint64_t)x*d+dipole_cell(n, 1))*d+dipole_cell(n, 2);
+            for(a=0;a<3;a++){
+                material_cells[m].comp[a]=dipole_comp[a][n];
+            }
+            m++;
+        }
+    }
+    qsort(material_cells, material_cell_count, sizeof(material_cell), compare_material_cells);
+    kept=0;
+    for(m=0;m<material_cell_count;m++){ //(a cell listed more than once in shape.dat keeps one set of compositions)
+        if((kept==0)||(material_cells[m].cell!=material_cells[kept-1].cell)){
+            material_cells[kept++]=material_cells[m];
+        }
+    }
+    material_cell_count=kept;
+}
+
+/* the compositions (ICOMPX, ICOMPY, ICOMPZ) of a new dipole whose parent is cell px, py, pz of the original grid */
+
+static const unsigned char* dipole_material(int px, int py, int pz)
+{
+    int r, dx, dy, dz;
+    material_cell key;
+    const material_cell* found;
+
+    if(material_cells==NULL){
+        return material_default;
+    }
+    for(r=0;r<=3;r++){ //the parent itself, then the cells 1, 2 and 3 steps away (across a face, an edge and a corner)
+        for(dx=-1;dx<=1;dx++){
+            for(dy=-1;dy<=1;dy++){
+                for(dz=-1;dz<=1;dz++){
+                    if((abs(dx)+abs(dy)+abs(dz)!=r)||(px+dx<0)||(py+dy<0)||(pz+dz<0)||(px+dx>=original_lattice_dim)||(py+dy>=original_lattice_dim)||(pz+dz>=original_lattice_dim)){
+                        continue;
+                    }
+                    key.cell=((uint64_t)(px+dx)*original_lattice_dim+py+dy)*original_lattice_dim+pz+dz;
+                    found=(const material_cell*)bsearch(&key, material_cells, material_cell_count, sizeof(material_cell), compare_material_cell_keys);
+                    if(found!=NULL){
+                        return found->comp;
+                    }
+                }
+            }
+        }
+    }
+    return material_default;
+}
+
+/* MPI: once the slabs are decided, a process only needs the dipoles in its own slab (the halo planes are copied from the neighbouring slabs by exchange_halos()), so the rest of the dipole table is dropped and original_N becomes the number of dipoles in this slab. The columns of the table each shrink to the new length, and as every value moves to a lower address, this is done in place */
+
+static void trim_dipole_table(void)
+{
+    int a, n, kept, bytes;
+    unsigned char* table;
+
+    if(mpi_size==1){
+        return;
+    }
+
+    kept=0;
+    for(n=0;n<original_N;n++){
+        if((dipole_cell(n, 0)>=slab_begin)&&(dipole_cell(n, 0)<slab_end)){
+            for(a=0;a<3;a++){
+                if(dipole_bits==16){
+                    dipole_xyz16[a][kept]=dipole_xyz16[a][n];
+                }
+                else{
+                    dipole_xyz32[a][kept]=dipole_xyz32[a][n];
+                }
+                dipole_comp[a][kept]=dipole_comp[a][n];
+            }
+            kept++;
+        }
+    }
+
+    bytes=dipole_bits/8;
+    table=(unsigned char*)dipole_table;
+    for(a=0;a<3;a++){
+        memmove(table+(size_t)a*kept*bytes, (dipole_bits==16) ? (void*)dipole_xyz16[a] : (void*)dipole_xyz32[a], (size_t)kept*bytes);
+    }
+    for(a=0;a<3;a++){
+        memmove(table+(size_t)3*kept*bytes+(size_t)a*kept, dipole_comp[a], kept);
+    }
+    original_N=kept;
+    dipole_table=checked_realloc(dipole_table, (size_t)original_N*(3*bytes+3)+1, "dipole table");
+    for(a=0;a<3;a++){
+        dipole_xyz16[a]=(int16_t*)dipole_table+(size_t)a*original_N;
+        dipole_xyz32[a]=(int32_t*)dipole_table+(size_t)a*original_N;
+        dipole_comp[a]=(unsigned char*)dipole_table+(size_t)original_N*3*bytes+(size_t)a*original_N;
+    }
+}
+
+/* split the original grid into equal slabs along x, one for each process. Every cell of the new grid comes only from the 3x3x3 block of original cells around its parent, so a process can sweep its own slab once it also has the plane of cells either side of it (the "halos") */
+
+static void decompose_slabs(void)
+{
+    slab_begin=(int)((long long)original_lattice_dim*mpi_rank/mpi_size);
+    slab_end=(int)((long long)original_lattice_dim*(mpi_rank+1)/mpi_size);
+}
+
+#ifdef USE_MPI
+
+/* start MPI, and keep the settings to those that the slab decomposition supports */
+
+static void start_mpi(void)
+{
+    MPI_Init(NULL, NULL);
+    MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
+
+    if(mpi_rank>0){
+        freopen("/dev/null", "w", stdout); //only the first process prints progress
+    }
+    if((mpi_size>1)&&((engine!=0)||(layout!=0)||(benchmark!=0)||(diagnostics!=0)||(mesh_output!=0)||(connectivity!=0))){
+        printf("\n MPI run on %d processes: using the dense engine with the original layout (no benchmark, diagnostics, mesh or connectivity check).\n", mpi_size);
+        engine=0;
+        layout=0;
+        benchmark=0;
+        diagnostics=0;
+        mesh_output=0;
+        connectivity=0;
+    }
+    if((mpi_size>1)&&(batch==1)){
+        printf("\n\nError- batch mode shares out its targets between separate copies of spherify, so cannot be run with MPI!! \n\n\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if((mpi_size>1)&&((query_benchmark==1)||(query_input==1))){
+        printf("\n\nError- the query API reads the whole original grid, so its benchmark (query_benchmark = 1) and query mode (query_input = 1) run on one process only!! \n\n\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if((mpi_size>1)&&((material_test==1)||(large_test==1))){
+        printf("\n\nError- the self tests (material_test = 1 and large_test = 1) run on one process only!! \n\n\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if((mpi_size>1)&&(trace_query==1)){
+        printf("\n\nError- reading back a decision trace (trace_query = 1) runs on one process only!! \n\n\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if((mpi_size>1)&&(orientations==1)){
+        printf("\n\nError- the orientation ensemble runs its orientations as copies of one process, so cannot be run with MPI!! \n\n\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if((mpi_size>1)&&((smooth_iterations>0)||(ladder==1)||(rounding>0))){
+        printf("\n\nError- smoothing at the original resolution (smooth_iterations > 0), the resolution ladder and the rounding engine run on one process only!! \n\n\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if((mpi_size>1)&&(delta_output==2)){
+        printf("\n\nError- rebuilding a shape from delta.bin (delta_output = 2) runs on one process only!! \n\n\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+}
+
+/* copy plane x of the original grid to/from a buffer of original_lattice_dim^2 values */
+
+static void pack_plane(int x, int* plane, int unpack)
+{
+    int y;
+
+    for(y=0;y<original_lattice_dim;y++){
+        if(unpack==1){
+            memcpy(original_grid[x][y], plane+(size_t)y*original_lattice_dim, original_lattice_dim*sizeof(int));
+        }
+        else{
+            memcpy(plane+(size_t)y*original_lattice_dim, original_grid[x][y], original_lattice_dim*sizeof(int));
+        }
+    }
+}
+
+/* swap the first and last planes of each slab with the neighbouring processes, to fill in the halo planes at slab_begin-1 and slab_end */
+
+static void exchange_halos(void)
+{
+    int below, above;
+    int* send;
+    int* receive;
+
+    below=(mpi_rank>0) ? mpi_rank-1 : MPI_PROC_NULL;
+    above=(mpi_rank<mpi_size-1) ? mpi_rank+1 : MPI_PROC_NULL;
+    send=(int*)checked_malloc((size_t)original_lattice_dim*original_lattice_dim*sizeof(int), "halo exchange");
+    receive=(int*)checked_malloc((size_t)original_lattice_dim*original_lattice_dim*sizeof(int), "halo exchange");
+
+    /* first plane goes down, the halo above comes up */
+    pack_plane(slab_begin, send, 0);
+    MPI_Sendrecv(send, original_lattice_dim*original_lattice_dim, MPI_INT, below, 0, receive, original_lattice_dim*original_lattice_dim, MPI_INT, above, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    if(above!=MPI_PROC_NULL){
+        pack_plane(slab_end, receive, 1);
+    }
+
+    /* last plane goes up, the halo below comes down */
+    pack_plane(slab_end-1, send, 0);
+    MPI_Sendrecv(send, original_lattice_dim*original_lattice_dim, MPI_INT, above, 1, receive, original_lattice_dim*original_lattice_dim, MPI_INT, below, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    if(below!=MPI_PROC_NULL){
+        pack_plane(slab_begin-1, receive, 1);
+    }
+
+    free((void*)send);
+    free((void*)receive);
+}
+
+#endif
+
+/* add up a count over all processes. before (if not NULL) is set to the total on the processes before this one */
+
+static long long global_count(long long local, long long* before)
+{
+    long long total;
+
+    total=local;
+    if(before!=NULL){
+        *before=0;
+    }
+#ifdef USE_MPI
+    MPI_Allreduce(&local, &total, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+    if(before!=NULL){
+        MPI_Exscan(&local, before, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+        if(mpi_rank==0){
+            *before=0; //MPI_Exscan leaves this undefined on the first process
+        }
+    }
+#endif
+    return total;
+}
+
+#ifdef USE_ZLIB
+
+/* COMPRESSED OUTPUT: text written to a compressed file is collected in 1 MB blocks. Once there is one block for each thread, the blocks are compressed at the same time (each as a complete gzip "member") and written out in order. A gzip file may hold any number of members one after another, so the result is a single valid .gz file -- and the same goes for the parts written by each process in an MPI run */
+
+#define GZ_BLOCK (1<<20)
+
+typedef struct {
+    char* text;             //text waiting to be compressed: up to blocks*GZ_BLOCK bytes
+    size_t used;
+    int blocks;
+    unsigned char* packed;  //compressed blocks, packed_stride bytes apart
+    size_t packed_stride;
+    size_t* packed_size;
+    FILE* out;              //the .gz file -- or NULL in an MPI run, where the compressed part goes to part_buffer[slot]
+    int slot;
+    size_t capacity;        //(size of part_buffer[slot])
+    size_t text_total, packed_total;
+    double seconds;
+} gz_part;
+
+double gz_text_bytes, gz_packed_bytes, gz_seconds; //totals for the last compressed file, reported by close_part()
+
+static void gz_emit(gz_part* g, const unsigned char* data, size_t n)
+{
+    if(g->out!=NULL){
+        fwrite(data, 1, n, g->out);
+        return;
+    }
+    if(part_size[g->slot]+n>g->capacity){
+        g->capacity=2*(part_size[g->slot]+n);
+        part_buffer[g->slot]=(char*)checked_realloc(part_buffer[g->slot], g->capacity, "compressed output");
+    }
+    memcpy(part_buffer[g->slot]+part_size[g->slot], data, n);
+    part_size[g->slot]=part_size[g->slot]+n;
+}
+
+static void gz_compress(gz_part* g)
+{
+    int b, count;
+    double start;
+
+    start=omp_get_wtime();
+    count=(int)((g->used+GZ_BLOCK-1)/GZ_BLOCK);
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(b=0;b<count;b++){
+        z_stream zs;
+        size_t length;
+
+        length=(b==count-1) ? g->used-(size_t)b*GZ_BLOCK : GZ_BLOCK;
+        memset(&zs, 0, sizeof(zs));
+        deflateInit2(&zs, compress_output, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY); //15+16 = gzip header and trailer around the block
+        zs.next_in=(Bytef*)g->text+(size_t)b*GZ_BLOCK;
+        zs.avail_in=(uInt)length;
+        zs.next_out=g->packed+(size_t)b*g->packed_stride;
+        zs.avail_out=(uInt)g->packed_stride;
+        deflate(&zs, Z_FINISH);
+        g->packed_size[b]=zs.total_out;
+        deflateEnd(&zs);
+    }
+
+    for(b=0;b<count;b++){
+        gz_emit(g, g->packed+(size_t)b*g->packed_stride, g->packed_size[b]);
+        g->packed_total=g->packed_total+g->packed_size[b];
+    }
+    g->text_total=g->text_total+g->used;
+    g->used=0;
+    g->seconds=g->seconds+omp_get_wtime()-start;
+}
+
+static ssize_t gz_write(void* cookie, const char* data, size_t size)
+{
+    gz_part* g;
+    size_t done, n;
+
+    g=(gz_part*)cookie;
+    for(done=0;done<size;done=done+n){
+        n=(size-done<(size_t)g->blocks*GZ_BLOCK-g->used) ? size-done : (size_t)g->blocks*GZ_BLOCK-g->used;
+        memcpy(g->text+g->used, data+done, n);
+        g->used=g->used+n;
+        if(g->used==(size_t)g->blocks*GZ_BLOCK){
+            gz_compress(g);
+        }
+    }
+    return size;
+}
+
+static int gz_close(void* cookie)
+{
+    gz_part* g;
+
+    g=(gz_part*)cookie;
+    if(g->used>0){
+        gz_compress(g);
+    }
+    if(g->out!=NULL){
+        fclose(g->out);
+    }
+    gz_text_bytes=g->text_total;
+    gz_packed_bytes=g->packed_total;
+    gz_seconds=g->seconds;
+
+    free((void*)g->text);
+    free((void*)g->packed);
+    free((void*)g->packed_size);
+    free((void*)g);
+    return 0;
+}
+
+#ifdef __APPLE__
+static int gz_write_bsd(void* cookie, const char* data, int size)
+{
+    return (int)gz_write(cookie, data, size);
+}
+#endif
+
+/* open name.gz for writing as a normal FILE*, so that the usual fprintf() calls write compressed text */
+
+static FILE* gz_open_part(const char* name, int slot)
+{
+    gz_part* g;
+    char path[1000];
+
+    g=(gz_part*)checked_calloc(1, sizeof(gz_part), "compressed output");
+    g->blocks=omp_get_max_threads();
+    g->text=(char*)checked_malloc((size_t)g->blocks*GZ_BLOCK, "compressed output");
+    g->packed_stride=compressBound(GZ_BLOCK)+64; //room for the gzip header and trailer
+    g->packed=(unsigned char*)checked_malloc(g->blocks*g->packed_stride, "compressed output");
+    g->packed_size=(size_t*)checked_malloc(g->blocks*sizeof(size_t), "compressed output");
+
+    g->slot=slot;
+    if(mpi_size>1){
+        part_buffer[slot]=NULL;
+        part_size[slot]=0;
+    }
+    else{
+        snprintf(path, sizeof(path), "%s.gz", name);
+        g->out=fopen(path, "wb");
+    }
+
+#ifdef __APPLE__
+    return funopen(g, NULL, gz_write_bsd, NULL, gz_close);
+#else
+    cookie_io_functions_t io={NULL, gz_write, NULL, gz_close};
+    return fopencookie(g, "w", io);
+#endif
+}
+
+#endif
+
+/* open shape.dat for reading. With zlib, shape.dat can also be gzip-compressed (and may be called shape.dat.gz instead) -- it is then decompressed into a temporary file, which is read in exactly the same way */
+
+static FILE* open_shape_file(void)
+{
+#ifdef USE_ZLIB
+    FILE* shape;
+    FILE* text;
+    gzFile packed;
+    const char* name;
+    unsigned char magic[2];
+    char block[65536];
+    int n;
+    long packed_bytes;
+    size_t text_bytes;
+    double start;
+
+    name="shape.dat";
+    if((shape=fopen(name,"r"))==NULL){
+        name="shape.dat.gz";
+        if((shape=fopen(name,"r"))==NULL){
+            return NULL;
+        }
+    }
+    if((fread(magic, 1, 2, shape)!=2)||(magic[0]!=0x1f)||(magic[1]!=0x8b)){
+        rewind(shape); //plain text
+        return shape;
+    }
+    fseek(shape, 0, SEEK_END);
+    packed_bytes=ftell(shape);
+    fclose(shape);
+
+    start=omp_get_wtime();
+    packed=gzopen(name, "rb");
+    gzbuffer(packed, 1<<17);
+    text=tmpfile();
+    text_bytes=0;
+    while((n=gzread(packed, block, sizeof(block)))>0){
+        fwrite(block, 1, n, text);
+        text_bytes=text_bytes+n;
+    }
+    gzclose(packed);
+    rewind(text);
+
+    printf("\n Decompressed %s: %.1f MB -> %.1f MB (%.0f MB/s).", name, packed_bytes/1048576.0, text_bytes/1048576.0, text_bytes/1048576.0/(omp_get_wtime()-start+1e-9));
+    return text;
+#else
+    return fopen("shape.dat","r");
+#endif
+}
+
+#ifdef USE_MPI
+
+/* MPI: each process writes its part of an output file straight into place, PART_CHUNK bytes at a time. Where its part starts is worked out from how long the parts of the processes before it are, so every part has to be counted before it is written -- see stag_part_bytes() and writers_count() */
+
+typedef struct {
+    MPI_File file;
+    char* chunk;
+    size_t used;
+    long long offset, written, expected; //where this process's part starts in the file, how much of it has been written so far, and how long it should be
+    char name[110];
+} mpi_part;
+
+static void mpi_part_flush(mpi_part* m)
+{
+    if(m->used>0){
+        MPI_File_write_at(m->file, (MPI_Offset)(m->offset+m->written), m->chunk, (int)m->used, MPI_CHAR, MPI_STATUS_IGNORE);
+        m->written=m->written+m->used;
+        m->used=0;
+    }
+}
+
+static ssize_t mpi_part_write(void* cookie, const char* data, size_t size)
+{
+    mpi_part* m;
+    size_t done, n;
+
+    m=(mpi_part*)cookie;
+    for(done=0;done<size;done=done+n){
+        n=(size-done<PART_CHUNK-m->used) ? size-done : PART_CHUNK-m->used;
+        memcpy(m->chunk+m->used, data+done, n);
+        m->used=m->used+n;
+        if(m->used==PART_CHUNK){
+            mpi_part_flush(m);
+        }
+    }
+    return size;
+}
+
+static int mpi_part_close(void* cookie)
+{
+    mpi_part* m;
+
+    m=(mpi_part*)cookie;
+    mpi_part_flush(m);
+    MPI_File_close(&m->file);
+    if(m->written!=m->expected){
+        printf("\n\nError- process %d wrote %lld bytes of %s, but counted %lld beforehand -- the parts of the file overlap!! \n\n\n", mpi_rank, m->written, m->name, m->expected);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    free((void*)m->chunk);
+    free((void*)m);
+    return 0;
+}
+
+#ifdef __APPLE__
+static int mpi_part_write_bsd(void* cookie, const char* data, int size)
+{
+    return (int)mpi_part_write(cookie, data, size);
+}
+#endif
+
+static FILE* mpi_open_part(const char* name, long long bytes)
+{
+    mpi_part* m;
+
+    m=(mpi_part*)checked_calloc(1, sizeof(mpi_part), "output buffer");
+    m->chunk=(char*)checked_malloc(PART_CHUNK, "output buffer");
+    m->expected=bytes;
+    snprintf(m->name, sizeof(m->name), "%s", name);
+
+    /* the part starts after all of the parts from the processes before this one */
+    MPI_Exscan(&bytes, &m->offset, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+    if(mpi_rank==0){
+        m->offset=0;
+        remove(name); //MPI_File_open does not truncate an existing file
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+    MPI_File_open(MPI_COMM_WORLD, (char*)name, MPI_MODE_CREATE|MPI_MODE_WRONLY, MPI_INFO_NULL, &m->file);
+
+#ifdef __APPLE__
+    return funopen(m, NULL, mpi_part_write_bsd, NULL, mpi_part_close);
+#else
+    cookie_io_functions_t io={NULL, mpi_part_write, NULL, mpi_part_close};
+    return fopencookie(m, "w", io);
+#endif
+}
+
+#endif
+
+/* the number of characters in v, printed with %d or %lld */
+
+static int text_digits(long long v)
+{
+    int n;
+
+    n=1;
+    if(v<0){
+        n=2;
+        v=-v;
+    }
+    while(v>=10){
+        v=v/10;
+        n++;
+    }
+    return n;
+}
+
+/* open an output file. In an MPI run, each process writes its part of the file (from its own slab), which is bytes long, straight into place in the file -- or, compressed, to memory, and close_part() then writes all of the compressed parts into the file in order of rank. bytes is not used by a single process */
+
+static int part_slot(FILE* part)
+{
+    int s;
+
+    for(s=0;(s<PART_SLOTS-1)&&(part_file[s]!=part);s++);
+    return s;
+}
+
+static FILE* open_part(const char* name, long long bytes)
+{
+    int s;
+
+    (void)bytes;
+    s=part_slot(NULL); //(a free slot)
+#ifdef USE_ZLIB
+    if(compress_output>0){
+        part_file[s]=gz_open_part(name, s);
+        return part_file[s];
+    }
+#endif
+#ifdef USE_MPI
+    if(mpi_size>1){
+        part_file[s]=mpi_open_part(name, bytes);
+        return part_file[s];
+    }
+#endif
+    part_file[s]=fopen(name, "w");
+    return part_file[s];
+}
+
+static void close_part(FILE* part, const char* name)
+{
+#ifdef USE_ZLIB
+    char path[1000];
+#endif
+#ifdef USE_MPI
+    MPI_File file;
+    long long length, offset;
+    size_t done, chunk;
+#endif
+    int s;
+
+    (void)name;
+    s=part_slot(part);
+    part_file[s]=NULL;
+    fclose(part); //(writes the last chunk of this process's part, or the last compressed blocks)
+
+#ifdef USE_ZLIB
+    if(compress_output>0){
+        printf(" [%s.gz: %.1f MB -> %.1f MB, %.1fx smaller, compressed at %.0f MB/s on %d threads]", name, gz_text_bytes/1048576.0, gz_packed_bytes/1048576.0, gz_text_bytes/(gz_packed_bytes+1e-9), gz_text_bytes/1048576.0/(gz_seconds+1e-9), omp_get_max_threads());
+        snprintf(path, sizeof(path), "%s.gz", name);
+        name=path;
+    }
+#endif
+
+#ifdef USE_MPI
+    if((mpi_size>1)&&(compress_output>0)){ //(the length of a compressed part is only known once it has been compressed)
+
+        /* the part starts after all of the parts from the processes before this one */
+        length=part_size[s];
+        offset=0;
+        MPI_Exscan(&length, &offset, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+        if(mpi_rank==0){
+            offset=0;
+            remove(name); //MPI_File_open does not truncate an existing file
+        }
+        MPI_Barrier(MPI_COMM_WORLD);
+
+        MPI_File_open(MPI_COMM_WORLD, (char*)name, MPI_MODE_CREATE|MPI_MODE_WRONLY, MPI_INFO_NULL, &file);
+        for(done=0;done<part_size[s];done=done+chunk){
+            chunk=(part_size[s]-done<(1<<30)) ? part_size[s]-done : (1<<30);
+            MPI_File_write_at(file, (MPI_Offset)(offset+done), part_buffer[s]+done, (int)chunk, MPI_CHAR, MPI_STATUS_IGNORE);
+        }
+        MPI_File_close(&file);
+        free(part_buffer[s]);
+    }
+#endif
+}
+
+/* allocate the original grid (for the dense and surface engines) in the chosen layout, and set the value at every dipole position to 1 */
+
+static void build_original_grid(void)
+{
+    int first, last;
+    size_t plane;
+
+    if(layout==1){
+        original_tiles_per_side=(original_lattice_dim+TILE_SIZE-1)/TILE_SIZE;
+        original_tiles=grid_alloc((size_t)original_tiles_per_side*original_tiles_per_side*original_tiles_per_side*TILE_CELLS*sizeof(int), "original grid");
+        touch_grid(original_tiles, (size_t)original_tiles_per_side*original_tiles_per_side*TILE_CELLS, (size_t)original_tiles_per_side*original_tiles_per_side*original_tiles_per_side*TILE_CELLS); //all values start at 0 (one plane of tiles for each block of the sweeps)
+        original_tile_offsets=tile_offsets(original_lattice_dim, original_tiles_per_side);
+
+        for(i=0;i<original_N;i++){
+            *original_cell(dipole_cell(i, 0), dipole_cell(i, 1), dipole_cell(i, 2))=1;
+        }
+        return;
+    }
+
+    /* only the planes of this process's slab (and its halos) are allocated -- the whole grid in a single process */
+
+    plane=(size_t)original_lattice_dim*original_lattice_dim;
+    first=(slab_begin>0) ? slab_begin-1 : 0;
+    last=(slab_end<original_lattice_dim) ? slab_end+1 : original_lattice_dim;
+    original_block=grid_alloc((last-first)*plane*sizeof(int), "original grid");
+    original_grid = (int***)checked_calloc(original_lattice_dim, sizeof(int**), "original grid");
+    for (i=first;i<last;i++) {
+        original_grid[i] = (int**)checked_malloc(original_lattice_dim*sizeof(int*), "original grid");
+        for (j=0;j<original_lattice_dim;j++) {
+          original_grid[i][j] = original_block+(i-first)*plane+(size_t)j*original_lattice_dim;
+        }
+    }
+
+    /* initially, set values at all positions to 0 (the halo planes are filled in by exchange_halos()) */
+
+    touch_grid(original_grid[slab_begin][0], plane*sweep_block(), (slab_end-slab_begin)*plane);
+
+    /* then go through list of dipoles, saving their x-y-z coords, and adjust the value or in the original_grid array to 1 if there is a dipole at this position */
+
+    for(i=0;i<original_N;i++){
+        x=dipole_cell(i, 0);
+        y=dipole_cell(i, 1);
+        z=dipole_cell(i, 2);
+
+        //printf("\n x=%d y= %d z= %d",x,y,z);
+        if((x>=slab_begin)&&(x<slab_end)){
+            original_grid[x][y][z]=1; //set the value at this position to 1
+        }
+    }
+
+#ifdef USE_MPI
+    exchange_halos(); //the halo planes are copied from the neighbouring slabs
+#endif
+
+   /*for(x=0;x<original_lattice_dim;x++){
+        for(y=0;y<original_lattice_dim;y++){
+            for(z=0;z<original_lattice_dim;z++){
+                printf("\n ALTERED GRID: %d", original_grid[x][y][z]);
+            }
+        }
+    }*/
+}
+
+/* allocate the new grid in the chosen layout, with every value set to 0 */
+
+static void build_new_grid(void)
+{
+    size_t plane;
+
+    if(layout==1){
+        new_tiles_per_side=(new_lattice_dim+TILE_SIZE-1)/TILE_SIZE;
+        plane=(size_t)new_tiles_per_side*new_tiles_per_side*TILE_CELLS;
+        new_tiles=grid_alloc(new_tiles_per_side*plane*sizeof(int), "new grid");
+        touch_grid(new_tiles, 2*plane, new_tiles_per_side*plane); //(each tile of the original grid makes two planes of new tiles)
+        new_tile_offsets=tile_offsets(new_lattice_dim, new_tiles_per_side);
+        return;
+    }
+
+    plane=(size_t)new_lattice_dim*new_lattice_dim;
+    new_block=grid_alloc(2*(slab_end-slab_begin)*plane*sizeof(int), "new grid");
+    new_grid = (int***)checked_calloc(new_lattice_dim, sizeof(int**), "new grid"); //only the planes made from this process's slab are allocated
+    for (i=2*slab_begin;i<2*slab_end;i++) {
+        new_grid[i] = (int**)checked_malloc(new_lattice_dim*sizeof(int*), "new grid");
+        for (j=0;j<new_lattice_dim;j++) {
+          new_grid[i][j] = new_block+(i-2*slab_begin)*plane+(size_t)j*new_lattice_dim;
+        }
+    }
+
+    //set all values == 0
+
+    touch_grid(new_block, 2*plane*sweep_block(), 2*(slab_end-slab_begin)*plane);
+}
+
+static void free_grids(void)
+{
+    if(layout==1){
+        free((void*)original_tiles);
+        free((void*)new_tiles);
+        free((void*)original_tile_offsets);
+        free((void*)new_tile_offsets);
+        return;
+    }
+
+    for(i=0;i<original_lattice_dim;i++){
+        if(original_grid[i]==NULL){
+            continue; //outside this process's slab
+        }
+        free((void*)original_grid[i]);
+    }
+    free((void*)original_grid);
+    free((void*)original_block);
+
+    for(i=0;i<new_lattice_dim;i++){
+        if(new_grid[i]==NULL){
+            continue;
+        }
+        free((void*)new_grid[i]);
+    }
+    free((void*)new_grid);
+    free((void*)new_block);
+}
+
+/* MORPHOLOGY STATISTICS: worked out from the runs of each row while original.txt and high_res.txt are being written, so neither lattice has to be read again afterwards. Pairs of neighbouring dipoles are found by comparing the runs of each row with those of the row before it (y-1), and of the same row in the plane before it (x-1) -- only those two planes of runs are kept */
+
+typedef struct {
+    long long volume;        //number of dipoles
+    long long contacts;      //pairs of dipoles that share a face
+    long long sum[3];        //sums of x, y and z...
+    long long sum2;          //...and of x^2+y^2+z^2, for the radius of gyration
+    int dim;
+    int plane_x[2];          //the last two planes of runs: row y of plane p is plane_runs[p][plane_start[p][y]] -> plane_runs[p][plane_start[p][y+1]-1]
+    int* plane_start[2];
+    int* plane_runs[2];
+    int plane_size[2];
+    int current;             //plane (0 or 1) holding the plane being written
+    int* first_start;        //MPI: copy of the first plane of this slab, to count the contacts with the slab below
+    int* first_runs;
+    double seconds;          //time spent on the statistics
+} lattice_stats;
+
+lattice_stats original_stats, new_stats;
+
+static void stats_begin(lattice_stats* s, int dim)
+{
+    int p;
+
+    memset(s, 0, sizeof(lattice_stats));
+    s->dim=dim;
+    for(p=0;p<2;p++){
+        s->plane_x[p]=-2;
+        s->plane_start[p]=(int*)checked_calloc(dim+1, sizeof(int), "statistics");
+        s->plane_size[p]=2*dim+2;
+        s->plane_runs[p]=(int*)checked_malloc(s->plane_size[p]*sizeof(int), "statistics");
+    }
+}
+
+/* number of z positions covered by both of two lists of runs */
+
+static long long run_overlap(const int* a, int na, const int* b, int nb)
+{
+    int i, j, lo, hi;
+    long long shared;
+
+    shared=0;
+    i=0;
+    j=0;
+    while((i<na)&&(j<nb)){
+        lo=(a[2*i]>b[2*j]) ? a[2*i] : b[2*j];
+        hi=(a[2*i+1]<b[2*j+1]) ? a[2*i+1] : b[2*j+1];
+        if(hi>lo){
+            shared=shared+hi-lo;
+        }
+        if(a[2*i+1]<b[2*j+1]){
+            i++;
+        }
+        else{
+            j++;
+        }
+    }
+    return shared;
+}
+
+/* sum of z^2 for 0 <= z < n */
+
+static long long sum_squares(long long n)
+{
+    return n*(n-1)*(2*n-1)/6;
+}
+
+/* add row x-y (n runs) to the statistics. Every row of a plane must be added, in order of y */
+
+static void stats_row(lattice_stats* s, int x, int y, const int* runs, int n)
+{
+    int i, c, p, length;
+    int* start;
+    double t;
+
+    t=omp_get_wtime();
+
+    if(y==0){
+        s->current=1-s->current; //the plane before becomes the last plane
+        s->plane_x[s->current]=x;
+        s->plane_start[s->current][0]=0;
+    }
+    c=s->current;
+    p=1-c;
+    start=s->plane_start[c];
+
+    if(start[y]+2*n>s->plane_size[c]){
+        s->plane_size[c]=2*(start[y]+2*n);
+        s->plane_runs[c]=(int*)checked_realloc(s->plane_runs[c], s->plane_size[c]*sizeof(int), "statistics");
+    }
+    memcpy(s->plane_runs[c]+start[y], runs, 2*n*sizeof(int));
+    start[y+1]=start[y]+2*n;
+
+    for(i=0;i<n;i++){
+        length=runs[2*i+1]-runs[2*i];
+        s->volume=s->volume+length;
+        s->contacts=s->contacts+length-1; //neighbours along z, within the run
+        s->sum[0]=s->sum[0]+(long long)x*length;
+        s->sum[1]=s->sum[1]+(long long)y*length;
+        s->sum[2]=s->sum[2]+((long long)runs[2*i]+runs[2*i+1]-1)*length/2;
+        s->sum2=s->sum2+((long long)x*x+(long long)y*y)*length+sum_squares(runs[2*i+1])-sum_squares(runs[2*i]);
+    }
+    if(y>0){
+        s->contacts=s->contacts+run_overlap(runs, n, s->plane_runs[c]+start[y-1], (start[y]-start[y-1])/2); //neighbours along y
+    }
+    if(s->plane_x[p]==x-1){
+        s->contacts=s->contacts+run_overlap(runs, n, s->plane_runs[p]+s->plane_start[p][y], (s->plane_start[p][y+1]-s->plane_start[p][y])/2); //neighbours along x
+    }
+
+#ifdef USE_MPI
+    if((y==s->dim-1)&&(s->first_start==NULL)){
+        s->first_start=(int*)checked_malloc((s->dim+1)*sizeof(int), "statistics");
+        memcpy(s->first_start, start, (s->dim+1)*sizeof(int));
+        s->first_runs=(int*)checked_malloc((start[s->dim]+1)*sizeof(int), "statistics");
+        memcpy(s->first_runs, s->plane_runs[c], start[s->dim]*sizeof(int));
+    }
+#endif
+
+    s->seconds=s->seconds+omp_get_wtime()-t;
+}
+
+/* add up the statistics of every process (counting the contacts between the last plane of each slab and the first plane of the next), and free the planes */
+
+static void stats_finish(lattice_stats* s)
+{
+    int p;
+#ifdef USE_MPI
+    int below, above, count, y;
+    int* next_start;
+    int* next_runs;
+    long long totals[6];
+    double t;
+
+    t=omp_get_wtime();
+    if((mpi_size>1)&&(s->first_start!=NULL)){
+        below=(mpi_rank>0) ? mpi_rank-1 : MPI_PROC_NULL;
+        above=(mpi_rank<mpi_size-1) ? mpi_rank+1 : MPI_PROC_NULL;
+
+        /* the first plane of each slab goes to the process below */
+        count=0;
+        MPI_Sendrecv(&s->first_start[s->dim], 1, MPI_INT, below, 2, &count, 1, MPI_INT, above, 2, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        next_start=(int*)checked_malloc((s->dim+1)*sizeof(int), "statistics");
+        next_runs=(int*)checked_malloc((count+1)*sizeof(int), "statistics");
+        MPI_Sendrecv(s->first_start, s->dim+1, MPI_INT, below, 3, next_start, s->dim+1, MPI_INT, above, 3, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        MPI_Sendrecv(s->first_runs, s->first_start[s->dim], MPI_INT, below, 4, next_runs, count, MPI_INT, above, 4, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+        if(above!=MPI_PROC_NULL){
+            p=s->current;
+            for(y=0;y<s->dim;y++){
+                s->contacts=s->contacts+run_overlap(s->plane_runs[p]+s->plane_start[p][y], (s->plane_start[p][y+1]-s->plane_start[p][y])/2, next_runs+next_start[y], (next_start[y+1]-next_start[y])/2);
+            }
+        }
+        free((void*)next_start);
+        free((void*)next_runs);
+
+        totals[0]=s->volume;
+        totals[1]=s->contacts;
+        totals[2]=s->sum[0];
+        totals[3]=s->sum[1];
+        totals[4]=s->sum[2];
+        totals[5]=s->sum2;
+        MPI_Allreduce(MPI_IN_PLACE, totals, 6, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+        s->volume=totals[0];
+        s->contacts=totals[1];
+        s->sum[0]=totals[2];
+        s->sum[1]=totals[3];
+        s->sum[2]=totals[4];
+        s->sum2=totals[5];
+    }
+    free((void*)s->first_start);
+    free((void*)s->first_runs);
+    s->seconds=s->seconds+omp_get_wtime()-t;
+#endif
+
+    for(p=0;p<2;p++){
+        free((void*)s->plane_start[p]);
+        free((void*)s->plane_runs[p]);
+    }
+}
+
+/* print one line of the morphology table. spacing is the dipole spacing of the lattice, in units of the original dipole spacing d (1 for the original lattice, 1/2 for the new one) */
+
+static void print_stats(const char* name, lattice_stats* s, double spacing)
+{
+    double volume, area, centre[3], gyration, radius, sphericity;
+    int a;
+
+    if(s->volume==0){
+        printf("\n   %-18s (no dipoles)", name);
+        return;
+    }
+
+    volume=s->volume*spacing*spacing*spacing;
+    area=(6.0*s->volume-2.0*s->contacts)*spacing*spacing; //faces not shared with another dipole
+    gyration=(double)s->sum2/s->volume;
+    for(a=0;a<3;a++){
+        centre[a]=(double)s->sum[a]/s->volume;
+        gyration=gyration-centre[a]*centre[a];
+    }
+    gyration=sqrt((gyration>0) ? gyration : 0)*spacing;
+    radius=cbrt(3.0*volume/(4.0*M_PI)); //radius of a sphere with the same volume
+    sphericity=cbrt(M_PI)*pow(6.0*volume, 2.0/3.0)/area; //surface area of that sphere / surface area of the particle (1 for a sphere)
+
+    printf("\n   %-18s %14.1f %14.1f %14.3f %14.3f %12.4f", name, volume, area, gyration, radius, sphericity);
+}
+
+/* CONNECTED PIECES: rule 2 and the final "> 0" threshold can cut a thin neck between monomers, splitting the particle into pieces. The pieces (dipoles joined by a face) of each lattice are found with a union-find over its runs rather than its cells: every run is joined to the runs it overlaps in the row before it (y-1) and in the same row of the plane before it (x-1). The planes are shared between threads, which join runs without locks -- a root is only ever changed (by compare-and-swap) to point at a smaller run, so the trees can never form a loop */
+
+typedef struct {
+    long long dipoles;
+    long long pieces;
+    long long single;     //pieces of a single dipole
+    long long largest[5]; //sizes of the five largest pieces (0 if there are fewer)
+} lattice_pieces;
+
+static size_t find_piece(size_t* parent, size_t r)
+{
+    size_t p, q;
+
+    while((p=__atomic_load_n(&parent[r], __ATOMIC_RELAXED))!=r){
+        q=__atomic_load_n(&parent[p], __ATOMIC_RELAXED);
+        if(q!=p){
+            __sync_bool_compare_and_swap(&parent[r], p, q); //path halving (harmless if another thread got there first)
+        }
+        r=p;
+    }
+    return r;
+}
+
+static void join_pieces(size_t* parent, size_t a, size_t b)
+{
+    size_t t;
+
+    while(1){
+        a=find_piece(parent, a);
+        b=find_piece(parent, b);
+        if(a==b){
+            return;
+        }
+        if(a<b){
+            t=a;
+            a=b;
+            b=t;
+        }
+        if(__sync_bool_compare_and_swap(&parent[a], a, b)){ //fails if a stopped being a root in the meantime -- then try again
+            return;
+        }
+    }
+}
+
+/* join every run of row r to the runs it overlaps in row q (both are runs[row_start[]] lists as in the run-length engine, numbered by their position in runs[] / 2) */
+
+static void join_rows(size_t* parent, const size_t* row_start, const int* runs, size_t r, size_t q)
+{
+    size_t a, b;
+
+    a=row_start[r];
+    b=row_start[q];
+    while((a<row_start[r+1])&&(b<row_start[q+1])){
+        if((runs[a]<runs[b+1])&&(runs[b]<runs[a+1])){
+            join_pieces(parent, a/2, b/2);
+        }
+        if(runs[a+1]<runs[b+1]){
+            a=a+2;
+        }
+        else{
+            b=b+2;
+        }
+    }
+}
+
+/* the runs of every row of a lattice, in the same form as the run-length engine's. For the streaming engine, each original row makes four new rows at once, so the rows are gathered by original row */
+
+static void gather_rows(int refined, size_t** row_start_out, int** runs_out)
+{
+    int dim, parents, pass, px, py, dx, dy, n;
+    int* buffer;
+    int* events;
+    int* rows[2][2];
+    int counts[2][2];
+    size_t r, rows_total;
+    size_t* row_start;
+    int* runs;
+
+    dim=(refined==1) ? new_lattice_dim : original_lattice_dim;
+    parents=((refined==1)&&(engine==3)) ? original_lattice_dim : dim;
+    rows_total=(size_t)dim*dim;
+    row_start=(size_t*)checked_malloc((rows_total+1)*sizeof(size_t), "connectivity check");
+    runs=NULL;
+
+    for(pass=0;pass<2;pass++){ //count the runs of each row, then copy them
+        #pragma omp parallel private(buffer, events, rows, counts, px, py, dx, dy, n, r)
+        {
+            buffer=(int*)checked_malloc((2*dim+2)*sizeof(int), "connectivity check");
+            events=(int*)checked_malloc((54*original_lattice_dim+1)*sizeof(int), "connectivity check");
+            for(n=0;n<4;n++){
+                rows[n/2][n%2]=(int*)checked_malloc((2*new_lattice_dim+2)*sizeof(int), "connectivity check");
+            }
+
+            #pragma omp for schedule(dynamic, 1)
+            for(px=0;px<parents;px++){
+                for(py=0;py<parents;py++){
+                    if(parents!=dim){
+                        refine_row_runs(px, py, events, rows, counts);
+                        for(n=0;n<4;n++){
+                            dx=n/2;
+                            dy=n%2;
+                            r=(size_t)(2*px+dx)*dim+2*py+dy;
+                            if(pass==0){
+                                row_start[r+1]=2*counts[dx][dy];
+                            }
+                            else{
+                                memcpy(runs+row_start[r], rows[dx][dy], 2*counts[dx][dy]*sizeof(int));
+                            }
+                        }
+                        continue;
+                    }
+                    n=(refined==1) ? refined_row(px, py, buffer) : original_row(px, py, buffer);
+                    r=(size_t)px*dim+py;
+                    if(pass==0){
+                        row_start[r+1]=2*n;
+                    }
+                    else{
+                        memcpy(runs+row_start[r], buffer, 2*n*sizeof(int));
+                    }
+                }
+            }
+
+            free((void*)buffer);
+            free((void*)events);
+            for(n=0;n<4;n++){
+                free((void*)rows[n/2][n%2]);
+            }
+        }
+
+        if(pass==0){
+            row_start[0]=0;
+            for(r=0;r<rows_total;r++){
+                row_start[r+1]=row_start[r+1]+row_start[r];
+            }
+            runs=(int*)checked_malloc((row_start[rows_total]+1)*sizeof(int), "connectivity check");
+        }
+    }
+
+    *row_start_out=row_start;
+    *runs_out=runs;
+}
+
+/* find the pieces of one lattice (refined = 0 for the original, 1 for the new one) */
+
+static void find_pieces(int refined, lattice_pieces* p)
+{
+    int dim, x, y, n;
+    size_t r, run_total, root;
+    size_t* row_start;
+    int* runs;
+    size_t* parent;
+    long long* size;
+
+    dim=(refined==1) ? new_lattice_dim : original_lattice_dim;
+    if((engine==2)||((engine==3)&&(refined==0))){
+        row_start=(refined==1) ? new_row_start : original_row_start; //already stored as runs
+        runs=(refined==1) ? new_runs : original_runs;
+    }
+    else{
+        gather_rows(refined, &row_start, &runs);
+    }
+    run_total=row_start[(size_t)dim*dim]/2;
+
+    parent=(size_t*)checked_malloc((run_total+1)*sizeof(size_t), "connectivity check");
+    #pragma omp parallel for
+    for(r=0;r<run_total;r++){
+        parent[r]=r;
+    }
+
+    #pragma omp parallel for schedule(dynamic, 1) private(y)
+    for(x=0;x<dim;x++){
+        for(y=0;y<dim;y++){
+            if(y>0){
+                join_rows(parent, row_start, runs, (size_t)x*dim+y, (size_t)x*dim+y-1);
+            }
+            if(x>0){
+                join_rows(parent, row_start, runs, (size_t)x*dim+y, (size_t)(x-1)*dim+y);
+            }
+        }
+    }
+
+    /* add up the dipoles in each piece (at its root), then pick out the largest pieces */
+
+    size=(long long*)checked_calloc(run_total+1, sizeof(long long), "connectivity check");
+    #pragma omp parallel for private(root)
+    for(r=0;r<run_total;r++){
+        root=find_piece(parent, r);
+        #pragma omp atomic
+        size[root]+=runs[2*r+1]-runs[2*r];
+    }
+
+    memset(p, 0, sizeof(lattice_pieces));
+    for(r=0;r<run_total;r++){
+        if(parent[r]!=r){
+            continue;
+        }
+        p->dipoles=p->dipoles+size[r];
+        p->pieces++;
+        if(size[r]==1){
+            p->single++;
+        }
+        for(n=0;n<5;n++){
+            if(size[r]>p->largest[n]){
+                memmove(p->largest+n+1, p->largest+n, (4-n)*sizeof(long long));
+                p->largest[n]=size[r];
+                break;
+            }
+        }
+    }
+
+    free((void*)size);
+    free((void*)parent);
+    if(row_start!=((refined==1) ? new_row_start : original_row_start)){
+        free((void*)row_start);
+        free((void*)runs);
+    }
+}
+
+static void print_pieces(const char* name, lattice_pieces* p)
+{
+    int n;
+
+    if(p->dipoles==0){
+        printf("\n   %-18s (no dipoles)", name);
+        return;
+    }
+    printf("\n   %-18s %10lld %12lld %12lld %10.3f%%   ", name, p->pieces, p->single, p->largest[0], 100.0*p->largest[0]/p->dipoles);
+    for(n=1;(n<5)&&(p->largest[n]>0);n++){
+        printf(" %lld", p->largest[n]);
+    }
+}
+
+/* connectivity check: report the pieces of both lattices, and (connectivity == 2) stop before the new shape is saved if spherify has split the particle or joined pieces of it together */
+
+static void check_connectivity(void)
+{
+    lattice_pieces pieces[2];
+    double start;
+
+    start=omp_get_wtime();
+    find_pieces(0, &pieces[0]);
+    find_pieces(1, &pieces[1]);
+
+    printf(" Connected pieces (dipoles joined by a face), found in %.3f s:\n", omp_get_wtime()-start);
+    printf("\n   %-18s %10s %12s %12s %11s    %s", "lattice", "pieces", "single", "largest", "(of all)", "next largest");
+    print_pieces("original", &pieces[0]);
+    print_pieces("high-resolution", &pieces[1]);
+    printf("\n\n");
+
+    if(pieces[0].pieces!=pieces[1].pieces){
+        printf(" Warning- spherify has changed the connectivity of the particle (%lld piece%s before, %lld after)!\n\n", pieces[0].pieces, (pieces[0].pieces==1) ? "" : "s", pieces[1].pieces);
+        if(connectivity==2){
+            printf("\n\nError- stopping before the new shape is saved, as the connectivity has changed (set connectivity = 1 to save it anyway)!! \n\n\n");
+            exit(1);
+        }
+    }
+}
+
+/* IMAGES: greyscale pictures of both lattices for computers without a display -- a slice through each axis (at image_slice of the way across the grid) and a projection along each axis, where the brightness of each pixel shows how many dipoles are behind it. Like the morphology statistics, they are built from the runs of each row while original.txt and high_res.txt are being written. The projections along x and y are kept as differences (+1 where a run starts, -1 where it ends), so each run costs the same however long it is. The three views follow the slices of the sweeps: y-z (top == y, right == z), z-x (top == z, right == x) and x-y (top == x, right == y) */
+
+typedef struct {
+    int dim;
+    int slice_at;            //cell at which the three slices are taken, along each axis
+    int* depth[3];           //projection along x ([y][z], as differences along z), y ([z][x], as differences along z) and z ([x][y])
+    unsigned char* slice[3]; //slices across x ([y][z]), y ([z][x]) and z ([x][y])
+    double seconds;
+} lattice_images;
+
+lattice_images original_images, new_images;
+
+static void images_begin(lattice_images* m, int dim)
+{
+    int a;
+
+    if(image_output==0){
+        return;
+    }
+    m->dim=dim;
+    m->slice_at=(int)(image_slice*dim);
+    m->slice_at=(m->slice_at<0) ? 0 : ((m->slice_at>=dim) ? dim-1 : m->slice_at);
+    for(a=0;a<3;a++){
+        m->depth[a]=(int*)checked_calloc((size_t)(dim+1)*dim, sizeof(int), "images");
+        m->slice[a]=(unsigned char*)checked_calloc((size_t)dim*dim, sizeof(unsigned char), "images");
+    }
+    m->seconds=0;
+}
+
+static void images_row(lattice_images* m, int x, int y, const int* runs, int n)
+{
+    int i, z, d;
+    double start;
+
+    start=omp_get_wtime();
+    d=m->dim;
+    for(i=0;i<n;i++){
+        m->depth[0][(size_t)y*(d+1)+runs[2*i]]++;
+        m->depth[0][(size_t)y*(d+1)+runs[2*i+1]]--;
+        m->depth[1][(size_t)runs[2*i]*d+x]++;
+        m->depth[1][(size_t)runs[2*i+1]*d+x]--;
+        m->depth[2][(size_t)x*d+y]=m->depth[2][(size_t)x*d+y]+runs[2*i+1]-runs[2*i];
+
+        if(x==m->slice_at){
+            memset(m->slice[0]+(size_t)y*d+runs[2*i], 255, runs[2*i+1]-runs[2*i]);
+        }
+        if(y==m->slice_at){
+            for(z=runs[2*i];z<runs[2*i+1];z++){
+                m->slice[1][(size_t)z*d+x]=255;
+            }
+        }
+        if((runs[2*i]<=m->slice_at)&&(m->slice_at<runs[2*i+1])){
+            m->slice[2][(size_t)x*d+y]=255;
+        }
+    }
+    m->seconds=m->seconds+omp_get_wtime()-start;
+}
+
+#ifdef USE_ZLIB
+static void png_chunk(FILE* out, const char* type, const unsigned char* data, size_t size)
+{
+    unsigned char word[4];
+    uLong crc;
+
+    word[0]=size>>24; word[1]=size>>16; word[2]=size>>8; word[3]=size;
+    fwrite(word, 1, 4, out);
+    fwrite(type, 1, 4, out);
+    crc=crc32(0L, (const Bytef*)type, 4); //(over the type and the data)
+    if(size>0){
+        fwrite(data, 1, size, out);
+        crc=crc32(crc, data, size);
+    }
+    word[0]=crc>>24; word[1]=crc>>16; word[2]=crc>>8; word[3]=crc;
+    fwrite(word, 1, 4, out);
+}
+#endif
+
+/* save one picture: PNG if compiled with zlib, otherwise binary PGM. pixels[] runs along each row from the left, with the rows from the bottom of the picture up */
+
+static void write_image(const char* name, int width, int height, const unsigned char* pixels)
+{
+    char file[200];
+    FILE* out;
+    int row;
+#ifdef USE_ZLIB
+    unsigned char* raw;
+    unsigned char* packed;
+    unsigned char head[13];
+    uLongf packed_size;
+    static const unsigned char signature[8]={137, 80, 78, 71, 13, 10, 26, 10};
+
+    snprintf(file, sizeof(file), "%s.png", name);
+    out=fopen(file, "wb");
+    raw=(unsigned char*)checked_malloc((size_t)(width+1)*height, "images");
+    for(row=0;row<height;row++){
+        raw[(size_t)row*(width+1)]=0; //(no filter)
+        memcpy(raw+(size_t)row*(width+1)+1, pixels+(size_t)(height-1-row)*width, width); //(PNG rows go from the top down)
+    }
+    packed_size=compressBound((uLong)(width+1)*height);
+    packed=(unsigned char*)checked_malloc(packed_size, "images");
+    compress2(packed, &packed_size, raw, (uLong)(width+1)*height, 6);
+
+    head[0]=width>>24; head[1]=width>>16; head[2]=width>>8; head[3]=width;
+    head[4]=height>>24; head[5]=height>>16; head[6]=height>>8; head[7]=height;
+    head[8]=8;  //bits per pixel
+    head[9]=0;  //greyscale
+    head[10]=0; //(compression, filter and interlace methods)
+    head[11]=0;
+    head[12]=0;
+    fwrite(signature, 1, 8, out);
+    png_chunk(out, "IHDR", head, 13);
+    png_chunk(out, "IDAT", packed, packed_size);
+    png_chunk(out, "IEND", NULL, 0);
+    free((void*)raw);
+    free((void*)packed);
+#else
+    snprintf(file, sizeof(file), "%s.pgm", name);
+    out=fopen(file, "wb");
+    fprintf(out, "P5\n%d %d\n255\n", width, height);
+    for(row=height-1;row>=0;row--){
+        fwrite(pixels+(size_t)row*width, 1, width, out);
+    }
+#endif
+    fclose(out);
+}
+
+/* add up the projections (and, in an MPI run, the parts of every view from each process), then save the six pictures as <name>_yz_projection, <name>_yz_slice etc. */
+
+static void images_finish(lattice_images* m, const char* name)
+{
+    static const char* views[3]={"yz", "zx", "xy"};
+    char file[200];
+    int a, d, u, v, most;
+    size_t c;
+    unsigned char* pixels;
+    double start;
+
+    if(image_output==0){
+        return;
+    }
+    start=omp_get_wtime();
+    d=m->dim;
+#ifdef USE_MPI
+    if(mpi_size>1){
+        for(a=0;a<3;a++){
+            MPI_Reduce((mpi_rank==0) ? MPI_IN_PLACE : m->depth[a], m->depth[a], (d+1)*d, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+            MPI_Reduce((mpi_rank==0) ? MPI_IN_PLACE : m->slice[a], m->slice[a], d*d, MPI_UNSIGNED_CHAR, MPI_MAX, 0, MPI_COMM_WORLD);
+        }
+    }
+#endif
+
+    if(mpi_rank==0){
+        for(u=0;u<d;u++){ //turn the differences into numbers of dipoles
+            for(v=1;v<d;v++){
+                m->depth[0][(size_t)u*(d+1)+v]=m->depth[0][(size_t)u*(d+1)+v]+m->depth[0][(size_t)u*(d+1)+v-1];
+            }
+            memmove(m->depth[0]+(size_t)u*d, m->depth[0]+(size_t)u*(d+1), d*sizeof(int)); //(rows of d, like the other views)
+        }
+        for(u=1;u<d;u++){
+            for(v=0;v<d;v++){
+                m->depth[1][(size_t)u*d+v]=m->depth[1][(size_t)u*d+v]+m->depth[1][(size_t)(u-1)*d+v];
+            }
+        }
+
+        pixels=(unsigned char*)checked_malloc((size_t)d*d, "images");
+        for(a=0;a<3;a++){
+            most=1;
+            for(c=0;c<(size_t)d*d;c++){
+                most=(m->depth[a][c]>most) ? m->depth[a][c] : most;
+            }
+            for(c=0;c<(size_t)d*d;c++){
+                pixels[c]=(m->depth[a][c]==0) ? 0 : (unsigned char)(55+(200LL*m->depth[a][c])/most); //(even a single dipole shows up)
+            }
+            snprintf(file, sizeof(file), "%s_%s_projection", name, views[a]);
+            write_image(file, d, d, pixels);
+            snprintf(file, sizeof(file), "%s_%s_slice", name, views[a]);
+            write_image(file, d, d, m->slice[a]);
+        }
+        free((void*)pixels);
+    }
+
+    for(a=0;a<3;a++){
+        free((void*)m->depth[a]);
+        free((void*)m->slice[a]);
+    }
+    m->seconds=m->seconds+omp_get_wtime()-start;
+}
+
+/* SURFACE MESH: the exposed faces of the dipoles (faces with no dipole on the other side) are joined into rectangles and saved as a binary PLY file, which any mesh viewer can open far faster than the voxel plots in STAG_spherify.py.
+
+The faces fall into six families (-x, +x, -y, +y, -z, +z). Within a family, the faces in each slice (e.g. the plane x = 5 for the -x family) are found one row at a time, as intervals along the row. An interval that is exactly the same as one in the row before becomes part of the same rectangle ("greedy meshing"), so only the rectangles still open in the last row of each slice are kept while the grid is read one plane at a time */
+
+typedef struct {
+    int b0, b1;     //the rectangle covers b0 <= b < b1 along the rows...
+    int a0;         //...and rows a0 onwards
+} mesh_rect;
+
+typedef struct {
+    int axis, sign;     //faces facing -axis (sign 0) or +axis (sign 1)
+    mesh_rect** open;   //rectangles still open in each slice (sorted by b0)
+    int* open_count;
+} mesh_family;
+
+typedef struct {
+    int* start;         //one plane of runs: row y runs from runs[start[y]] -> runs[start[y+1]-1]
+    int* runs;
+    int size;
+} run_plane;
+
+float* mesh_vertices;
+size_t mesh_quads, mesh_quads_size;
+long long mesh_faces; //unit faces before merging
+double mesh_spacing;
+
+/* save a rectangle covering rows a0 -> a1 (inclusive) and b0 <= b < b1 of the slice at position s along the axis of the family. The four corners go anticlockwise, seen from outside the particle */
+
+static void mesh_quad(mesh_family* f, int s, int a0, int a1, int b0, int b1)
+{
+    int u, v, c, corner;
+    float lo[3], hi[3];
+    float* p;
+    static const int order[2][4][2]={{{0,0},{0,1},{1,1},{1,0}}, {{0,0},{1,0},{1,1},{0,1}}};
+
+    u=(f->axis+1)%3; //the two axes of the slice, with u x v pointing along +axis
+    v=(f->axis+2)%3;
+    if(f->axis==1){ //(rows along x, intervals along z)
+        lo[u]=b0;
+        hi[u]=b1;
+        lo[v]=a0;
+        hi[v]=a1+1;
+    }
+    else{ //(rows along y and intervals along z for the x slices; rows along x and intervals along y for the z slices)
+        lo[u]=a0;
+        hi[u]=a1+1;
+        lo[v]=b0;
+        hi[v]=b1;
+    }
+
+    if(mesh_quads==mesh_quads_size){
+        mesh_quads_size=2*mesh_quads_size+1024;
+        mesh_vertices=(float*)checked_realloc(mesh_vertices, mesh_quads_size*12*sizeof(float), "mesh");
+    }
+    p=mesh_vertices+mesh_quads*12;
+    for(corner=0;corner<4;corner++){
+        p[3*corner+f->axis]=s*mesh_spacing;
+        c=order[f->sign][corner][0];
+        p[3*corner+u]=(c==0 ? lo[u] : hi[u])*mesh_spacing;
+        c=order[f->sign][corner][1];
+        p[3*corner+v]=(c==0 ? lo[v] : hi[v])*mesh_spacing;
+    }
+    mesh_quads++;
+}
+
+/* add row a of slice s: n intervals of exposed faces, iv[] = (b0, b1) pairs. Every row of a slice must be added, in order */
+
+static void mesh_row(mesh_family* f, int s, int a, const int* iv, int n)
+{
+    int i, j, count, size;
+    mesh_rect* old;
+    mesh_rect* now;
+
+    old=f->open[s];
+    count=f->open_count[s];
+    size=count+n;
+    now=(mesh_rect*)checked_malloc((size>0 ? size : 1)*sizeof(mesh_rect), "mesh");
+
+    i=0;
+    j=0;
+    size=0;
+    while((i<count)||(j<n)){
+        if((i<count)&&(j<n)&&(old[i].b0==iv[2*j])&&(old[i].b1==iv[2*j+1])){
+            now[size++]=old[i]; //the same interval as the row before -- the rectangle grows by one row
+            i++;
+            j++;
+        }
+        else if((j>=n)||((i<count)&&(old[i].b0<=iv[2*j]))){
+            mesh_quad(f, s, old[i].a0, a-1, old[i].b0, old[i].b1); //the rectangle ended with the row before
+            i++;
+        }
+        else{
+            now[size].b0=iv[2*j];
+            now[size].b1=iv[2*j+1];
+            now[size].a0=a;
+            size++;
+            j++;
+        }
+    }
+    for(j=0;j<n;j++){
+        mesh_faces=mesh_faces+iv[2*j+1]-iv[2*j];
+    }
+    free((void*)old);
+    f->open[s]=now;
+    f->open_count[s]=size;
+}
+
+/* finish every rectangle still open in slice s, whose last row was a */
+
+static void mesh_close(mesh_family* f, int s, int a)
+{
+    int i;
+
+    for(i=0;i<f->open_count[s];i++){
+        mesh_quad(f, s, f->open[s][i].a0, a, f->open[s][i].b0, f->open[s][i].b1);
+    }
+    f->open_count[s]=0;
+}
+
+/* runs[] = the parts of runs a[] that are not in runs b[], returning the number of runs */
+
+static int run_difference(const int* a, int na, const int* b, int nb, int* runs)
+{
+    int i, j, n, z0, z1;
+
+    n=0;
+    j=0;
+    for(i=0;i<na;i++){
+        z0=a[2*i];
+        z1=a[2*i+1];
+        while((j<nb)&&(b[2*j+1]<=z0)){
+            j++;
+        }
+        while((j<nb)&&(b[2*j]<z1)){
+            if(b[2*j]>z0){
+                runs[2*n]=z0;
+                runs[2*n+1]=b[2*j];
+                n++;
+            }
+            if(b[2*j+1]>=z1){
+                z0=z1;
+                break;
+            }
+            z0=b[2*j+1];
+            j++;
+        }
+        if(z1>z0){
+            runs[2*n]=z0;
+            runs[2*n+1]=z1;
+            n++;
+        }
+    }
+    return n;
+}
+
+/* read plane x (all rows y) of a grid with the given row function -- planes outside the grid are empty */
+
+static void load_plane(run_plane* plane, int (*row)(int, int, int*), int x, int dim, int* buffer)
+{
+    int y, n;
+
+    plane->start[0]=0;
+    for(y=0;y<dim;y++){
+        n=0;
+        if((x>=0)&&(x<dim)){
+            n=row(x, y, buffer);
+        }
+        if(plane->start[y]+2*n>plane->size){
+            plane->size=2*(plane->start[y]+2*n);
+            plane->runs=(int*)checked_realloc(plane->runs, plane->size*sizeof(int), "mesh");
+        }
+        memcpy(plane->runs+plane->start[y], buffer, 2*n*sizeof(int));
+        plane->start[y+1]=plane->start[y]+2*n;
+    }
+}
+
+/* write the greedy-meshed surface of a grid (dim cells along each side, read with the given row function) to a binary PLY file. spacing scales the lattice to units of the original dipole spacing, so both meshes line up */
+
+static void export_mesh(const char* name, int (*row)(int, int, int*), int dim, double spacing)
+{
+    mesh_family family[6];
+    run_plane plane[3], spare;
+    int f, s, x, y, n, a, count, *buffer, *exposed, *bucket_start, *bucket_y, *iv;
+    const int* r;
+    size_t q;
+    double start;
+    FILE* ply;
+    unsigned char three;
+    unsigned int triangle[3];
+
+    start=omp_get_wtime();
+    mesh_spacing=spacing;
+    mesh_quads=0;
+    mesh_faces=0;
+
+    for(f=0;f<6;f++){
+        family[f].axis=f/2;
+        family[f].sign=f%2;
+        family[f].open=(mesh_rect**)checked_calloc(dim+1, sizeof(mesh_rect*), "mesh");
+        family[f].open_count=(int*)checked_calloc(dim+1, sizeof(int), "mesh");
+    }
+    for(f=0;f<3;f++){
+        plane[f].start=(int*)checked_malloc((dim+1)*sizeof(int), "mesh");
+        plane[f].size=2*dim+2;
+        plane[f].runs=(int*)checked_malloc(plane[f].size*sizeof(int), "mesh");
+    }
+    buffer=(int*)checked_malloc((2*dim+2)*sizeof(int), "mesh");
+    exposed=(int*)checked_malloc((2*dim+2)*sizeof(int), "mesh");
+    iv=(int*)checked_malloc((2*dim+2)*sizeof(int), "mesh");
+    bucket_start=(int*)checked_malloc((dim+3)*sizeof(int), "mesh");
+    bucket_y=(int*)checked_malloc(2*((size_t)dim*dim+dim)*sizeof(int), "mesh");
+
+    load_plane(&plane[0], row, -1, dim, buffer); //plane x-1
+    load_plane(&plane[1], row, 0, dim, buffer);  //plane x
+    for(x=0;x<dim;x++){
+        load_plane(&plane[2], row, x+1, dim, buffer); //plane x+1
+
+        for(y=0;y<dim;y++){
+            r=plane[1].runs+plane[1].start[y];
+            n=(plane[1].start[y+1]-plane[1].start[y])/2;
+
+            /* x faces: slice x (-x) or x+1 (+x), rows along y */
+            count=run_difference(r, n, plane[0].runs+plane[0].start[y], (plane[0].start[y+1]-plane[0].start[y])/2, exposed);
+            mesh_row(&family[0], x, y, exposed, count);
+            count=run_difference(r, n, plane[2].runs+plane[2].start[y], (plane[2].start[y+1]-plane[2].start[y])/2, exposed);
+            mesh_row(&family[1], x+1, y, exposed, count);
+
+            /* y faces: slice y (-y) or y+1 (+y), rows along x */
+            if(y>0){
+                count=run_difference(r, n, plane[1].runs+plane[1].start[y-1], (plane[1].start[y]-plane[1].start[y-1])/2, exposed);
+            }
+            else{
+                count=run_difference(r, n, NULL, 0, exposed);
+            }
+            mesh_row(&family[2], y, x, exposed, count);
+            if(y<dim-1){
+                count=run_difference(r, n, plane[1].runs+plane[1].start[y+1], (plane[1].start[y+2]-plane[1].start[y+1])/2, exposed);
+            }
+            else{
+                count=run_difference(r, n, NULL, 0, exposed);
+            }
+            mesh_row(&family[3], y+1, x, exposed, count);
+        }
+        mesh_close(&family[0], x, dim-1);
+        mesh_close(&family[1], x+1, dim-1);
+
+        /* z faces: every run starts with a -z face and ends with a +z face. The rows of the slices at each z run along x, with intervals along y, so the y's of the faces in this plane are sorted into slices first */
+        for(f=0;f<2;f++){
+            memset(bucket_start, 0, (dim+3)*sizeof(int));
+            for(y=0;y<dim;y++){
+                for(a=plane[1].start[y]+f;a<plane[1].start[y+1];a=a+2){
+                    bucket_start[plane[1].runs[a]+2]++;
+                }
+            }
+            for(s=0;s<=dim;s++){
+                bucket_start[s+2]=bucket_start[s+2]+bucket_start[s+1];
+            }
+            for(y=0;y<dim;y++){
+                for(a=plane[1].start[y]+f;a<plane[1].start[y+1];a=a+2){
+                    bucket_y[bucket_start[plane[1].runs[a]+1]++]=y;
+                }
+            }
+            for(s=0;s<=dim;s++){ //(bucket_start[s] -> bucket_start[s+1]-1 now hold the sorted y's at z = s)
+                count=0;
+                for(a=bucket_start[s];a<bucket_start[s+1];a++){
+                    if((count>0)&&(iv[2*count-1]==bucket_y[a])){
+                        iv[2*count-1]++;
+                    }
+                    else{
+                        iv[2*count]=bucket_y[a];
+                        iv[2*count+1]=bucket_y[a]+1;
+                        count++;
+                    }
+                }
+                mesh_row(&family[4+f], s, x, iv, count);
+            }
+        }
+
+        spare=plane[0]; //move on a plane
+        plane[0]=plane[1];
+        plane[1]=plane[2];
+        plane[2]=spare;
+    }
+    for(s=0;s<=dim;s++){
+        mesh_close(&family[2], s, dim-1);
+        mesh_close(&family[3], s, dim-1);
+        mesh_close(&family[4], s, dim-1);
+        mesh_close(&family[5], s, dim-1);
+    }
+
+    /* binary PLY: 4 vertices and 2 triangles for each rectangle (little-endian floats and ints, as written by x86 and ARM computers) */
+    ply=fopen(name, "wb");
+    fprintf(ply, "ply\nformat binary_little_endian 1.0\ncomment spherify surface mesh (exposed dipole faces, greedy-meshed)\n");
+    fprintf(ply, "element vertex %zu\nproperty float x\nproperty float y\nproperty float z\n", 4*mesh_quads);
+    fprintf(ply, "element face %zu\nproperty list uchar uint vertex_indices\nend_header\n", 2*mesh_quads); //(unsigned, for meshes of up to 2^32 vertices)
+    fwrite(mesh_vertices, sizeof(float), 12*mesh_quads, ply);
+    three=3;
+    for(q=0;q<mesh_quads;q++){
+        triangle[0]=(unsigned int)(4*q);
+        triangle[1]=(unsigned int)(4*q+1);
+        triangle[2]=(unsigned int)(4*q+2);
+        fwrite(&three, 1, 1, ply);
+        fwrite(triangle, sizeof(unsigned int), 3, ply);
+        triangle[1]=(unsigned int)(4*q+2);
+        triangle[2]=(unsigned int)(4*q+3);
+        fwrite(&three, 1, 1, ply);
+        fwrite(triangle, sizeof(unsigned int), 3, ply);
+    }
+    fclose(ply);
+
+    printf("\n Mesh written to %s: %lld exposed faces merged into %zu rectangles (%zu triangles) in %.3f s.", name, mesh_faces, mesh_quads, 2*mesh_quads, omp_get_wtime()-start);
+
+    for(f=0;f<6;f++){
+        for(s=0;s<=dim;s++){
+            free((void*)family[f].open[s]);
+        }
+        free((void*)family[f].open);
+        free((void*)family[f].open_count);
+    }
+    for(f=0;f<3;f++){
+        free((void*)plane[f].start);
+        free((void*)plane[f].runs);
+    }
+    free((void*)buffer);
+    free((void*)exposed);
+    free((void*)iv);
+    free((void*)bucket_start);
+    free((void*)bucket_y);
+    free((void*)mesh_vertices);
+    mesh_vertices=NULL;
+    mesh_quads_size=0;
+}
+
+/* DELTA OUTPUT: the cells where the new grid differs from a plain 2x upsample of the original one -- those filled by rule 1 and those emptied by rule 2 -- saved as runs along z in delta.bin, so the new shape can be rebuilt from shape.dat without running spherify again (delta_output = 2). For smooth, mostly solid particles this is a tiny fraction of shape2.dat.
+
+delta.bin is little-endian binary: "SPHDELTA", then the version, original grid size and new grid size (32-bit ints), then STAG_offset (3 doubles, to check that shape.dat is placed in the same grid), followed by one record of five 32-bit ints for each run: X, Y, z0, z1, change. change is +1 if cells z0 <= z < z1 of new row X-Y were added, or -1 if they were removed. The records are sorted by X, then Y, with the added runs of each row before its removed runs */
+
+#define DELTA_VERSION 1
+
+int* delta_records; //the records of this process's slab, kept until high_res.txt is closed (see save_delta())
+size_t delta_record_count, delta_record_capacity;
+long long delta_cells[2]; //cells added and removed
+int* delta_buffer[3];
+#define DELTA_HEADER 44 //bytes before the first record
+#define DELTA_RECORD 20 //bytes in each record
+#define DELTA_BLOCK 8192 //records packed at a time by save_delta()
+
+/* 32-bit values in delta.bin are packed byte by byte, little-endian, whatever this computer uses (like shape2.raw) */
+
+static void delta_pack(unsigned char* bytes, uint32_t value)
+{
+    bytes[0]=value&255;
+    bytes[1]=(value>>8)&255;
+    bytes[2]=(value>>16)&255;
+    bytes[3]=(value>>24)&255;
+}
+
+static uint32_t delta_unpack(const unsigned char* bytes)
+{
+    return (uint32_t)bytes[0]|((uint32_t)bytes[1]<<8)|((uint32_t)bytes[2]<<16)|((uint32_t)bytes[3]<<24);
+}
+
+static void delta_begin(void)
+{
+    int n;
+
+    delta_records=NULL;
+    delta_record_count=0;
+    delta_record_capacity=0;
+    delta_cells[0]=0;
+    delta_cells[1]=0;
+    for(n=0;n<3;n++){
+        delta_buffer[n]=(int*)checked_malloc((2*new_lattice_dim+2)*sizeof(int), "delta");
+    }
+}
+
+/* the runs of new row X-Y that a plain upsample of the original grid would have */
+
+static int upsampled_row(int x, int y, int* runs)
+{
+    int i, n;
+
+    n=original_row(x/2, y/2, runs);
+    for(i=0;i<2*n;i++){
+        runs[i]=2*runs[i];
+    }
+    return n;
+}
+
+static void delta_row(int x, int y, const int* runs, int n)
+{
+    int i, c, u, m;
+    int* r;
+
+    u=upsampled_row(x, y, delta_buffer[0]);
+    for(c=0;c<2;c++){
+        m=(c==0) ? run_difference(runs, n, delta_buffer[0], u, delta_buffer[1]) : run_difference(delta_buffer[0], u, runs, n, delta_buffer[1]); //added, then removed
+        for(i=0;i<m;i++){
+            if(delta_record_count==delta_record_capacity){
+                delta_record_capacity=2*delta_record_capacity+4096;
+                delta_records=(int*)checked_realloc(delta_records, delta_record_capacity*5*sizeof(int), "delta");
+            }
+            r=delta_records+5*delta_record_count;
+            r[0]=x;
+            r[1]=y;
+            r[2]=delta_buffer[1][2*i];
+            r[3]=delta_buffer[1][2*i+1];
+            r[4]=(c==0) ? 1 : -1;
+            delta_cells[c]=delta_cells[c]+r[3]-r[2];
+            delta_record_count++;
+        }
+    }
+}
+
+static void save_delta(void)
+{
+    FILE* out;
+    unsigned char head[DELTA_HEADER];
+    unsigned char* packed;
+    uint64_t bits;
+    long long totals[3];
+    size_t r, block;
+    int a;
+
+    out=open_part("delta.bin", ((mpi_rank==0) ? DELTA_HEADER : 0)+(long long)delta_record_count*DELTA_RECORD);
+    if(mpi_rank==0){
+        memcpy(head, "SPHDELTA", 8);
+        delta_pack(head+8, DELTA_VERSION);
+        delta_pack(head+12, (uint32_t)original_lattice_dim);
+        delta_pack(head+16, (uint32_t)new_lattice_dim);
+        for(a=0;a<3;a++){
+            memcpy(&bits, &STAG_offset[a], sizeof(bits)); //(the bits of the double, low word first)
+            delta_pack(head+20+8*a, (uint32_t)bits);
+            delta_pack(head+24+8*a, (uint32_t)(bits>>32));
+        }
+        fwrite(head, 1, DELTA_HEADER, out);
+    }
+    packed=(unsigned char*)checked_malloc(DELTA_BLOCK*DELTA_RECORD, "delta");
+    for(r=0;r<delta_record_count;r=r+block){ //(packed a block of records at a time)
+        block=(delta_record_count-r<DELTA_BLOCK) ? delta_record_count-r : DELTA_BLOCK;
+        for(a=0;a<5*(int)block;a++){
+            delta_pack(packed+4*a, (uint32_t)delta_records[5*r+a]);
+        }
+        fwrite(packed, DELTA_RECORD, block, out);
+    }
+    free((void*)packed);
+    close_part(out, "delta.bin");
+
+    totals[0]=delta_cells[0];
+    totals[1]=delta_cells[1];
+    totals[2]=delta_record_count;
+#ifdef USE_MPI
+    MPI_Allreduce(MPI_IN_PLACE, totals, 3, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+#endif
+    printf("\n Delta saved to delta.bin: %lld dipoles added and %lld removed by spherify, in %lld runs (%.1f KB).\n", totals[0], totals[1], totals[2], (44+20.0*totals[2])/1024.0);
+
+    free((void*)delta_records);
+    free((void*)delta_buffer[0]);
+    free((void*)delta_buffer[1]);
+    free((void*)delta_buffer[2]);
+}
+
+/* delta_output = 2: read delta.bin (or delta.bin.gz) in place of running the sweeps. The added and removed runs of each row are turned into one sorted list of positions where the row changes, so refined_row() can rebuild the row by merging it with the upsampled original row (see delta_refined_row()) */
+
+static int load_delta(void)
+{
+#ifdef USE_ZLIB
+    gzFile in;
+#else
+    FILE* in;
+#endif
+    unsigned char head[DELTA_HEADER], bytes[DELTA_RECORD];
+    int32_t record[5];
+    double offset[3];
+    uint64_t bits;
+    int a, ok, n, row_count, got, bad;
+    size_t r, row, next, total, capacity;
+
+#ifdef USE_ZLIB
+    if(((in=gzopen("delta.bin", "rb"))==NULL)&&((in=gzopen("delta.bin.gz", "rb"))==NULL)){ //(gzopen reads plain files too)
+#else
+    if((in=fopen("delta.bin", "rb"))==NULL){
+#endif
+        printf("\n\nError- delta_output = 2, but delta.bin cannot be found!! \n\n\n");
+        return 0;
+    }
+#ifdef USE_ZLIB
+    ok=(gzread(in, head, DELTA_HEADER)==DELTA_HEADER);
+#else
+    ok=(fread(head, 1, DELTA_HEADER, in)==DELTA_HEADER);
+#endif
+    if((ok==0)||(memcmp(head, "SPHDELTA", 8)!=0)||(delta_unpack(head+8)!=DELTA_VERSION)){
+        printf("\n\nError- delta.bin is not a spherify delta file!! \n\n\n");
+#ifdef USE_ZLIB
+        gzclose(in);
+#else
+        fclose(in);
+#endif
+        return 0;
+    }
+    for(a=0;a<3;a++){
+        bits=(uint64_t)delta_unpack(head+20+8*a)|((uint64_t)delta_unpack(head+24+8*a)<<32);
+        memcpy(&offset[a], &bits, sizeof(bits));
+        ok=ok&&(fabs(offset[a]-STAG_offset[a])<1e-9);
+    }
+    if(((int)delta_unpack(head+12)!=original_lattice_dim)||((int)delta_unpack(head+16)!=new_lattice_dim)||(ok==0)){
+        printf("\n\nError- delta.bin was made from a different shape (a %d x %d x %d grid, rather than %d x %d x %d)!! \n\n\n", (int)delta_unpack(head+12), (int)delta_unpack(head+12), (int)delta_unpack(head+12), original_lattice_dim, original_lattice_dim, original_lattice_dim);
+#ifdef USE_ZLIB
+        gzclose(in);
+#else
+        fclose(in);
+#endif
+        return 0;
+    }
+
+    delta_row_start=(size_t*)checked_calloc((size_t)new_lattice_dim*new_lattice_dim+1, sizeof(size_t), "delta");
+    capacity=4096;
+    delta_toggles=(int*)checked_malloc(capacity*sizeof(int), "delta");
+    total=0;
+    row=0;
+    row_count=0;
+    delta_cells[0]=0;
+    delta_cells[1]=0;
+    bad=0;
+    while(1){
+#ifdef USE_ZLIB
+        got=gzread(in, bytes, DELTA_RECORD);
+#else
+        got=(int)fread(bytes, 1, DELTA_RECORD, in);
+#endif
+        ok=(got==DELTA_RECORD);
+        if((got>0)&&(ok==0)){
+            printf("\n\nError- delta.bin ends part way through a record (%d of %d bytes) -- it is cut short!! \n\n\n", got, DELTA_RECORD);
+            bad=1;
+            break;
+        }
+        if(ok){ //(check the record before it is used: a row out of the grid, or before the last one, would be written outside delta_row_start)
+            for(a=0;a<5;a++){
+                record[a]=(int32_t)delta_unpack(bytes+4*a);
+            }
+            if((record[0]<0)||(record[0]>=new_lattice_dim)||(record[1]<0)||(record[1]>=new_lattice_dim)||(record[2]<0)||(record[2]>=record[3])||(record[3]>new_lattice_dim)||((record[4]!=1)&&(record[4]!=-1))){
+                printf("\n\nError- delta.bin holds a record that doesn't fit the %d x %d x %d grid (X %d, Y %d, z %d to %d, change %d)!! \n\n\n", new_lattice_dim, new_lattice_dim, new_lattice_dim, record[0], record[1], record[2], record[3], record[4]);
+                bad=1;
+                break;
+            }
+        }
+        next=ok ? (size_t)record[0]*new_lattice_dim+record[1] : (size_t)new_lattice_dim*new_lattice_dim;
+        if(ok&&(next<row)){
+            printf("\n\nError- the records in delta.bin are out of order (row %d-%d comes after row %zu-%zu)!! \n\n\n", record[0], record[1], row/new_lattice_dim, row%new_lattice_dim);
+            bad=1;
+            break;
+        }
+        if(next!=row){ //the row before is complete: sort its starts and ends, and drop any position that appears twice (a run added right where a removed one ends, or vice versa, makes no change there)
+            qsort(delta_toggles+total-row_count, row_count, sizeof(int), compare_ints);
+            n=0;
+            for(a=0;a<row_count;a++){
+                if((n>0)&&(delta_toggles[total-row_count+n-1]==delta_toggles[total-row_count+a])){
+                    n--;
+                }
+                else{
+                    delta_toggles[total-row_count+n]=delta_toggles[total-row_count+a];
+                    n++;
+                }
+            }
+            total=total-row_count+n;
+            for(r=row+1;r<=next;r++){
+                delta_row_start[r]=total;
+            }
+            row=next;
+            row_count=0;
+        }
+        if(ok==0){
+            break;
+        }
+        if(total+2>capacity){
+            capacity=2*capacity;
+            delta_toggles=(int*)checked_realloc(delta_toggles, capacity*sizeof(int), "delta");
+        }
+        delta_toggles[total]=record[2];
+        delta_toggles[total+1]=record[3];
+        total=total+2;
+        row_count=row_count+2;
+        delta_cells[(record[4]>0) ? 0 : 1]=delta_cells[(record[4]>0) ? 0 : 1]+record[3]-record[2];
+    }
+#ifdef USE_ZLIB
+    gzclose(in);
+#else
+    fclose(in);
+#endif
+    if(bad==1){
+        free((void*)delta_row_start);
+        free((void*)delta_toggles);
+        return 0;
+    }
+    delta_row_start[(size_t)new_lattice_dim*new_lattice_dim]=total;
+
+    printf(" Rebuilding the high-resolution grid from delta.bin: %lld dipoles added and %lld removed by spherify.\n\n", delta_cells[0], delta_cells[1]);
+    return 1;
+}
+
+
+/* find the size of the grid (STAG_lattice_dim) and the offsets that move every dipole into it (STAG_offset), from the smallest and largest coordinates in the dipole table */
+
+static void place_dipoles(void)
+{
+    dipole_bounds();
+
+    STAG_lattice_dim=0;
+    if((max[0]-min[0])>STAG_lattice_dim){
+        STAG_lattice_dim = ceil(max[0]-min[0]); //if the x-coord has the biggest variation, use this as our lattice size in S.T.A.G
+    }
+    if((max[1]-min[1])>STAG_lattice_dim){
+        STAG_lattice_dim = ceil(max[1]-min[1]); //if the y-coord has the biggest variation, use this as our lattice size in S.T.A.G
+    }
+    if((max[2]-min[2])>STAG_lattice_dim){
+        STAG_lattice_dim = ceil(max[2]-min[2]); //if the z-coord has the biggest variation, use this as our lattice size in S.T.A.G
+    }
+    STAG_lattice_dim= STAG_lattice_dim + 1; //then add 1 to make the lattice large enough to hold the final values
+    original_lattice_dim=STAG_lattice_dim; //save this value for the original grid
+
+    //printf("\n\n\n\n min_x= %f \n min_y= %f \n min_z= %f \n max_x= %f \n max_y= %f \n max_z= %f \n\n STAG_lattice_dim = %d \n", min[0], min[1], min[2], max[0], max[1], max[2], STAG_lattice_dim);
+
+    /* calculate how much the non-"controller" axes will be moved by in STAG (this basically finds the "middle" square of the lattice, which depends if the lattice is odd or even. See comments below for examples */
+    if((STAG_lattice_dim%2)==0){ //if STAG_lattice is even
+        STAG_odd_even_offset= STAG_lattice_dim/2.0;    //e.g. If the lattice is 16 x 16 x 16, the "middle" square is 8 (either 7 or 8 are the middle numbers between squares 0,1,2,3,4,5,6,7,!!8!!,9,10,11,12,13,14,15, and it doesn't matter which we pick -- you can't center a coordinate on an even lattice. Here we pick "8" and shift it slightly up, but it's barely noticeable for large N). We calculate it using 16/2 = 8.
+    }
+    else{ //if STAG_lattice is odd
+        STAG_odd_even_offset= (STAG_lattice_dim-1)/2.0;   //e.g. If the lattice is 15 x 15 x 15, the "middle" square is "7" (because it's the middle number between squares 0,1,2,3,4,5,6,!!7!!,8,9,10,11,12,13,14). We find this by calculating (15-1)/2 =7.
+    }
+
+    /* find which axes is the "controller" of the grid size - this the the axis that is most negative, and thus needs the biggest shift to make it positive (whichever holds the smallest minimum value) */
+    // These all work in the same way -- once we have the "controller", we base the shift for that axis on it's min[] value, and then simply "center" the other two axes using the offset calculated above (which finds the distance to the "middle" square of the odd or even STAG lattice)
+
+    if(min[1]<min[0]){
+        if(min[2]<min[1]){ //z axes is the controller
+            if(ceil(min[0])==ceil(min[2])){
+                STAG_offset[0]= -1.0*min[0]; //if the x-axis has the same minimum as the controller, also translate it by the same amount.
+            }
+            else{
+                STAG_offset[0]= STAG_odd_even_offset - ceil((max[0]+min[0])/2.0); //otherwise center it in the lattice
+            }
+
+            if(ceil(min[1])==ceil(min[2])){
+                STAG_offset[1]= -1.0*min[1]; //if the y-axis has the same minimum as the controller, also translate it by the same amount.
+            }
+            else{
+                STAG_offset[1]= STAG_odd_even_offset - ceil((max[1]+min[1])/2.0); //otherwise center it in the lattice
+            }
+
+            STAG_offset[2]= -1.0*min[2]; //move the z-axis to get it's smallest value increased up to zero
+
+            //printf("\n The z-axis is the controller (switch 1).");
+            //printf("\n\n STAG_offset[0] = %f \n STAG_offset[1] = %f \n STAG_offset[2] = %f (controller) \n ", STAG_offset[0], STAG_offset[1], STAG_offset[2]);
+        }
+        else{ //y axis is the controller
+
+            if(ceil(min[0])==ceil(min[1])){
+                STAG_offset[0]= -1.0*min[0]; //if the x-axis has the same minimum as the controller, also translate it by the same amount.
+            }
+            else{
+                STAG_offset[0]= STAG_odd_even_offset - ceil((max[0]+min[0])/2.0); //otherwise center it in the lattice
+            }
+
+            STAG_offset[1]= -1.0*min[1]; //move the y-axis to get it's smallest value increased up to zero
+
+            if(ceil(min[2])==ceil(min[1])){
+                STAG_offset[2]= -1.0*min[2]; //if the z-axis has the same minimum as the controller, also translate it by the same amount.
+            }
+            else{
+                STAG_offset[2]= STAG_odd_even_offset - ceil((max[2]+min[2])/2.0); //otherwise center it in the lattice
+            }
+
+            //printf("\n The y-axis is the controller.");
+            //printf("\n\n STAG_offset[0] = %f \n STAG_offset[1] = %f (controller) \n STAG_offset[2] = %f \n ", STAG_offset[0], STAG_offset[1], STAG_offset[2]);
+        }
+    }
+    else if (min[2]<min[0]){ //z axis is the controller
+        if(ceil(min[0])==ceil(min[2])){
+            STAG_offset[0]= -1.0*min[0]; //if the x-axis has the same minimum as the controller, also translate it by the same amount.
+        }
+        else{
+            STAG_offset[0]= STAG_odd_even_offset - ceil((max[0]+min[0])/2.0); //otherwise center it in the lattice
+        }
+
+        if(ceil(min[1])==ceil(min[2])){
+            STAG_offset[1]= -1.0*min[1]; //if the y-axis has the same minimum as the controller, also translate it by the same amount.
+        }
+        else{
+            STAG_offset[1]= STAG_odd_even_offset - ceil((max[1]+min[1])/2.0); //otherwise center it in the lattice
+        }
+
+        STAG_offset[2]= -1.0*min[2]; //move the z-axis to get it's smallest value increased up to zero
+
+        //printf("\n The z-axis is the controller (switch 2).");
+        //printf("\n\n STAG_offset[0] = %f \n STAG_offset[1] = %f \n STAG_offset[2] = %f (controller) \n ", STAG_offset[0], STAG_offset[1], STAG_offset[2]);
+    }
+    else{ //x axis is the controller
+        STAG_offset[0]= -1.0*min[0]; //move the x-axis to get it's smallest value increased up to zero
+
+        if(ceil(min[1])==ceil(min[0])){
+            STAG_offset[1]= -1.0*min[1]; //if the y-axis has the same minimum as the controller, also translate it by the same amount.
+        }
+        else{
+            STAG_offset[1]= STAG_odd_even_offset - ceil((max[1]+min[1])/2.0); //otherwise center it in the lattice
+        }
+
+        if(ceil(min[2])==ceil(min[0])){
+            STAG_offset[2]= -1.0*min[2]; //if the z-axis has the same minimum as the controller, also translate it by the same amount.
+        }
+        else{
+            STAG_offset[2]= STAG_odd_even_offset - ceil((max[2]+min[2])/2.0); //otherwise center it in the lattice
+        }
+
+        //printf("\n The x-axes is the controller.");
+        //printf("\n\n STAG_offset[0] = %f (controller) \n STAG_offset[1] = %f \n STAG_offset[2] = %f \n ", STAG_offset[0], STAG_offset[1], STAG_offset[2]);
+    }
+
+    //printf(" \n\n STAG_lattice_dim = %d \n STAG_odd_even_offset = %f     (this is the value that the 'non controller' axes will shift by in STAG coords. It is the 'middle square' of the STAG lattice (depends if STAG lattice is odd or even).\n\n", STAG_lattice_dim, STAG_odd_even_offset);
+
+    /* Adjust the dipole positions by the offsets found above and same them as positive values for STAG */
+
+    //printf("\n Dipole position \t\t\t STAG position\n ");
+    for(i=0;i<3;i++){
+        grid_offset[i]=(int)STAG_offset[i]; //the offsets are whole numbers - dipole_cell() adds them on when each dipole is placed in the grid, so no translated copy of the table is needed
+    }
+}
+
+/* COUNT-ONLY PASS: the number of dipoles in the new grid, worked out row by row from the runs of the original grid exactly as the run-length engine does -- but the new runs are only counted, never kept. The rows are independent, so the planes are shared between threads */
+
+static long long count_refined(void)
+{
+    long long total;
+    int px;
+
+    new_lattice_dim=2*original_lattice_dim;
+    build_original_runs(0);
+    total=0;
+
+    #pragma omp parallel reduction(+:total)
+    {
+        int py, dx, dy, n;
+        int* events;
+        int* new_row[2][2];
+        int new_row_count[2][2];
+
+        events=(int*)checked_malloc((54*original_lattice_dim+1)*sizeof(int), "count pass");
+        for(dx=0;dx<2;dx++){
+            for(dy=0;dy<2;dy++){
+                new_row[dx][dy]=(int*)checked_malloc((2*new_lattice_dim+2)*sizeof(int), "count pass");
+            }
+        }
+
+        #pragma omp for schedule(dynamic, 1)
+        for(px=0;px<original_lattice_dim;px++){
+            for(py=0;py<original_lattice_dim;py++){
+                refine_row_runs(px, py, events, new_row, new_row_count);
+                for(dx=0;dx<2;dx++){
+                    for(dy=0;dy<2;dy++){
+                        for(n=0;n<new_row_count[dx][dy];n++){
+                            total=total+new_row[dx][dy][2*n+1]-new_row[dx][dy][2*n];
+                        }
+                    }
+                }
+            }
+        }
+
+        free((void*)events);
+        for(dx=0;dx<2;dx++){
+            for(dy=0;dy<2;dy++){
+                free((void*)new_row[dx][dy]);
+            }
+        }
+    }
+
+    free((void*)original_row_start);
+    free((void*)original_runs);
+    return total;
+}
+
+/* DIPOLE BUDGET: the input shape is resampled at a few different scales, and each is put through the count-only pass, to find the scale that spherifies to the number of dipoles closest to dipole_budget. Only that shape is then spherified and saved.
+
+Resampling is nearest-neighbour: cell X of the scaled lattice takes the dipole (if any) at floor((X+0.5)/scale), so each dipole becomes the block of cells from ceil(x*scale-0.5) up to ceil((x+1)*scale-0.5) along each axis (which is empty for some dipoles when scale < 1) */
+
+typedef struct {
+    void* table;
+    int bits, N;
+    int16_t* xyz16[3];
+    int32_t* xyz32[3];
+    unsigned char* comp[3];
+} dipole_set;
+
+static void save_dipoles(dipole_set* d)
+{
+    int a;
+
+    d->table=dipole_table;
+    d->bits=dipole_bits;
+    d->N=original_N;
+    for(a=0;a<3;a++){
+        d->xyz16[a]=dipole_xyz16[a];
+        d->xyz32[a]=dipole_xyz32[a];
+        d->comp[a]=dipole_comp[a];
+    }
+}
+
+static void restore_dipoles(const dipole_set* d)
+{
+    int a;
+
+    dipole_table=d->table;
+    dipole_bits=d->bits;
+    original_N=d->N;
+    for(a=0;a<3;a++){
+        dipole_xyz16[a]=d->xyz16[a];
+        dipole_xyz32[a]=d->xyz32[a];
+        dipole_comp[a]=d->comp[a];
+    }
+}
+
+/* range of scaled cells [lo, hi) made from cell c */
+
+static void scaled_range(int c, double scale, int* lo, int* hi)
+{
+    *lo=(int)ceil(c*scale-0.5);
+    *hi=(int)ceil((c+1)*scale-0.5);
+}
+
+/* replace the dipole table with the dipoles of source at the given scale, returning the number of dipoles (or 0 if there would be none, or too many) */
+
+static int scale_dipoles(const dipole_set* source, double scale)
+{
+    int n, a, cx, cy, cz, lo[3], hi[3], c;
+    long long count;
+    size_t m;
+
+    count=0;
+    for(n=0;n<source->N;n++){
+        c=1;
+        for(a=0;a<3;a++){
+            scaled_range((source->bits==16) ? source->xyz16[a][n] : source->xyz32[a][n], scale, &lo[a], &hi[a]);
+            c=c*(hi[a]-lo[a]);
+        }
+        count=count+c;
+    }
+    if((count==0)||(count>2147483647LL)){
+        return 0;
+    }
+
+    dipole_table_init((int)count);
+    m=0;
+    for(n=0;n<source->N;n++){
+        for(a=0;a<3;a++){
+            scaled_range((source->bits==16) ? source->xyz16[a][n] : source->xyz32[a][n], scale, &lo[a], &hi[a]);
+        }
+        for(cx=lo[0];cx<hi[0];cx++){
+            for(cy=lo[1];cy<hi[1];cy++){
+                for(cz=lo[2];cz<hi[2];cz++){
+                    dipole_xyz32[0][m]=cx;
+                    dipole_xyz32[1][m]=cy;
+                    dipole_xyz32[2][m]=cz;
+                    for(a=0;a<3;a++){
+                        dipole_comp[a][m]=source->comp[a][n];
+                    }
+                    m++;
+                }
+            }
+        }
+    }
+    original_N=(int)count;
+    dipole_bounds();
+    compact_dipole_table();
+    return original_N;
+}
+
+static void dipole_budget_mode(void)
+{
+    dipole_set source;
+    double scale[8], best_scale, estimate;
+    long long count[8], best_count;
+    int s, candidates, dipoles;
+    static const double step[7]={0.85, 0.9, 0.95, 1.0, 1.05, 1.1, 1.15};
+
+    save_dipoles(&source);
+
+    /* the number of dipoles goes roughly as scale^3, so the first count (at the original scale) gives a good idea of where to look */
+    scale[0]=1.0;
+    place_dipoles();
+    count[0]=count_refined();
+    estimate=cbrt((double)dipole_budget/(count[0]>0 ? count[0] : 1));
+    candidates=1;
+    for(s=0;s<7;s++){
+        scale[candidates++]=estimate*step[s];
+    }
+
+    printf("\n\n Dipole budget: looking for the scale closest to NAT = %d after spherify.\n", dipole_budget);
+    printf("\n \t    scale     dipoles in     grid     dipoles out");
+    printf("\n \t %8.4f   %12d   %6d   %13lld", scale[0], source.N, original_lattice_dim, count[0]);
+
+    best_scale=scale[0];
+    best_count=count[0];
+    for(s=1;s<candidates;s++){
+        dipoles=scale_dipoles(&source, scale[s]);
+        if(dipoles==0){
+            count[s]=-1;
+            restore_dipoles(&source);
+            continue;
+        }
+        place_dipoles();
+        count[s]=count_refined();
+        printf("\n \t %8.4f   %12d   %6d   %13lld", scale[s], dipoles, original_lattice_dim, count[s]);
+        if(llabs(count[s]-dipole_budget)<llabs(best_count-dipole_budget)){
+            best_scale=scale[s];
+            best_count=count[s];
+        }
+        free(dipole_table);
+        restore_dipoles(&source);
+    }
+
+    printf("\n\n Using scale %.4f: %lld dipoles after spherify (budget %d).\n", best_scale, best_count, dipole_budget);
+    if(best_scale!=1.0){
+        scale_dipoles(&source, best_scale);
+        free(source.table);
+    }
+}
+
+/* STREAMING ENGINE: like the run-length engine, but the new grid is never stored at all -- each row of it is worked out from the original runs whenever it is needed (see refined_row()). This is the leanest engine, at the cost of working out every row twice for each file written */
+
+static void streaming_engine(void)
+{
+    int dx, dy;
+
+    stream_events=(int*)checked_malloc((54*original_lattice_dim+1)*sizeof(int), "streaming buffers");
+    for(dx=0;dx<2;dx++){
+        for(dy=0;dy<2;dy++){
+            stream_rows[dx][dy]=(int*)checked_malloc((2*new_lattice_dim+2)*sizeof(int), "streaming buffers");
+        }
+    }
+    stream_x=-1;
+    stream_y=-1;
+
+    if(trace_file!=NULL){ //(the rows are worked out again each time they are saved, so trace each of them once here)
+        for(x=0;x<original_lattice_dim;x++){
+            for(y=0;y<original_lattice_dim;y++){
+                refine_row_runs(x, y, stream_events, stream_rows, stream_row_count);
+            }
+        }
+    }
+
+    printf(" Streaming engine: the new grid will be worked out one row at a time as it is saved.\n\n");
+}
+
+/* MEMORY PLANNER: before any grid is allocated, estimate the peak memory each engine would need for this grid, and if the chosen engine needs more than memory_limit, switch to one that fits */
+
+static double memory_limit_bytes(void)
+{
+    if(memory_limit>0){
+        return memory_limit*1048576.0;
+    }
+    return (double)sysconf(_SC_PHYS_PAGES)*(double)sysconf(_SC_PAGESIZE); //the physical memory of this computer
+}
+
+static double peak_memory(void);
+
+/* memory (bytes) for the buffers of the output files open at the same time: shape2.dat, shape2.geom and shape2.raw */
+
+static double writer_memory(void)
+{
+    double files;
+
+    files=PART_SLOTS-1;
+#ifdef USE_ZLIB
+    if(compress_output>0){
+        return files*omp_get_max_threads()*(GZ_BLOCK+compressBound(GZ_BLOCK)+64.0+sizeof(size_t)); //text and compressed blocks for each thread (see gz_open_part())
+    }
+#endif
+    return files*BUFSIZ;
+}
+
+/* memory (bytes) for the query API while the grids are still held: the bit grid of the original lattice, and the buffers of the query benchmark (query_benchmark = 1) or of the cells read from query.txt (query_input = 1 -- each line is at least 6 characters, and the list can be up to twice as long as needed while it grows) */
+
+static double query_memory(void)
+{
+    double d, bytes;
+    FILE* in;
+
+    if((query_benchmark==0)&&(query_input==0)){
+        return 0;
+    }
+    d=original_lattice_dim;
+    bytes=(d*d*d+63)/64*sizeof(uint64_t);
+    if(query_benchmark==1){
+        bytes=bytes+QUERY_SAMPLES*(3*sizeof(int)+1.0)+(2*(2*d)+2)*sizeof(int)+2*d;
+    }
+    if((query_input==1)&&((in=fopen("query.txt", "r"))!=NULL)){
+        fseek(in, 0, SEEK_END);
+        bytes=bytes+(2*3*sizeof(int)+1.0)*(ftell(in)/6.0+1024);
+        fclose(in);
+    }
+    return bytes;
+}
+
+/* peak memory (bytes) that engine e would need for this process's part of the grid: what the process holds already (the program itself, its libraries and the dipole table -- measured), the output buffers, the original grid and the new grid, all of which are held at the same time while the new grid is saved (or queried) */
+
+static double engine_memory(int e)
+{
+    double d, n, base, planes, slab, tiles, grids, runs, keys;
+
+    d=original_lattice_dim;
+    n=original_N;
+    base=peak_memory()*1048576.0+writer_memory()+query_memory(); //(the dipole table is already read in, so this includes it)
+    planes=slab_end-slab_begin+(slab_begin>0)+(slab_end<original_lattice_dim); //planes of the original grid held (including halos)
+    slab=slab_end-slab_begin;
+
+    if(e<=1){
+        if(layout==1){
+            tiles=ceil(d/TILE_SIZE);
+            grids=(tiles*tiles*tiles+8*tiles*tiles*tiles)*TILE_CELLS*sizeof(int)+9*d*sizeof(size_t);
+        }
+        else{
+            grids=planes*d*(sizeof(int*)+d*sizeof(int)) + 2*slab*2*d*(sizeof(int*)+2*d*sizeof(int)) + 3*d*sizeof(int**);
+        }
+        if(e==1){
+            grids=grids+2*sizeof(size_t)*fmin(19*n, d*d*d); //the work list, which can be up to twice as long as the boundary cells in it while it grows
+        }
+        return base+grids+((mpi_size>1) ? ((compress_output>0) ? 8*n*100/5 : PART_SLOTS*(double)PART_CHUNK) : 0); //(an MPI run writes each output file in chunks -- or, compressed, keeps its part of the file in memory)
+    }
+
+    runs=(d*d+1)*sizeof(size_t)+2*n*sizeof(int); //original runs
+    keys=n*sizeof(size_t); //sorted dipole list, freed once the runs are made
+    if(e==2){
+        grids=(4*d*d+1)*sizeof(size_t)+16*fmin(n, 2*d*d)*sizeof(int)+2*(2*d+1)*sizeof(size_t); //new runs: each original row (which rarely holds more than two runs) becomes four new rows, and the list can be up to twice as long as needed while it grows
+    }
+    else{
+        grids=(54*d+1)*sizeof(int)+4*(4*d+2)*sizeof(int);
+    }
+    return base+runs+fmax(keys, grids);
+}
+
+static void plan_memory(void)
+{
+    double limit, need[4];
+    int e, chosen;
+    static const char* names[4]={"dense", "surface", "run-length", "streaming"};
+    static const int fallback[3]={0, 2, 3}; //fastest first
+
+    limit=memory_limit_bytes();
+    printf("\n\n Memory plan for a %d x %d x %d grid (limit %.0f MB):\n", original_lattice_dim, original_lattice_dim, original_lattice_dim, limit/1048576.0);
+    for(e=0;e<4;e++){
+        need[e]=engine_memory(e);
+        printf("\n \t %-11s %12.1f MB %s", names[e], need[e]/1048576.0, (e==engine) ? "  <-- chosen" : "");
+    }
+
+    if(need[engine]>limit){
+        if(mpi_size>1){
+            printf("\n\n Warning- the dense engine needs more than the limit on each process (MPI runs always use it) -- try more processes.");
+        }
+        else{
+            chosen=-1;
+            for(e=0;e<3;e++){
+                if((fallback[e]!=engine)&&(need[fallback[e]]<=limit)){
+                    chosen=fallback[e];
+                    break;
+                }
+            }
+            if(chosen==-1){
+                printf("\n\nError- even the streaming engine needs more than the %.0f MB limit!! \n\n\n", limit/1048576.0);
+                exit(1);
+            }
+            printf("\n\n The %s engine would need more than the limit -- switching to the %s engine.", names[engine], names[chosen]);
+            engine=chosen;
+        }
+    }
+    planned_memory=need[engine];
+    printf("\n");
+}
+
+/* the most memory this process has used so far (MB) */
+
+static double peak_memory(void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss/1048576.0; //(bytes on mac...)
+#else
+    return usage.ru_maxrss/1024.0; //(...kB on linux)
+#endif
+}
+
+/* compare the measured peak memory with the plan made before the grid was allocated */
+
+static void check_memory_plan(void)
+{
+    double peak, planned;
+
+    peak=peak_memory();
+    planned=planned_memory/1048576.0;
+    printf(" Peak memory use: %.1f MB (planned %.1f MB, %.0f%% of the plan).\n\n", peak, planned, 100*peak/planned);
+    if(peak>planned*(1+PLAN_TOLERANCE)+1){
+        printf(" Warning- the peak memory use is more than %.0f%% over the plan!! The memory limit may not be kept for grids like this one.\n\n", 100*PLAN_TOLERANCE);
+    }
+}
+
+/* BENCHMARK: run the dense sweeps with both layouts of the grid and compare how long each sweep takes */
+
+static void benchmark_layouts(int placement)
+{
+    int l, n, saved_layout, saved_engine, saved_diagnostics, saved_first_touch;
+    long long dipoles[2];
+    int*** saved_original_grid;
+    int*** saved_new_grid;
+    int* saved_original_block;
+    int* saved_new_block;
+    int* saved_original_tiles;
+    int* saved_new_tiles;
+    size_t* saved_original_tile_offsets;
+    size_t* saved_new_tile_offsets;
+    double sweep_time[2][3];
+
+    saved_layout=layout;
+    saved_first_touch=first_touch;
+    saved_engine=engine;
+    saved_diagnostics=diagnostics;
+    saved_original_grid=original_grid;
+    saved_new_grid=new_grid;
+    saved_original_block=original_block;
+    saved_new_block=new_block;
+    saved_original_tiles=original_tiles;
+    saved_new_tiles=new_tiles;
+    saved_original_tile_offsets=original_tile_offsets;
+    saved_new_tile_offsets=new_tile_offsets;
+    engine=0;
+    diagnostics=0;
+
+    if(placement==1){
+        printf("\n Benchmarking grid placement on %d threads...", omp_get_max_threads());
+    }
+    else{
+        printf("\n Benchmarking grid layouts...");
+    }
+
+    for(l=0;l<2;l++){
+        if(placement==1){
+            first_touch=l; //0 = every page zeroed (and so placed) by one thread, 1 = each block of planes zeroed by the thread that sweeps it
+        }
+        else{
+            layout=l;
+        }
+        build_original_grid();
+        build_new_grid();
+        for(n=0;n<3;n++){
+            sweep_time[l][n]=sweep_pass(n);
+        }
+
+        row_runs=(int*)checked_malloc((2*new_lattice_dim+2)*sizeof(int), "benchmark");
+        dipoles[l]=0;
+        for(x=0;x<new_lattice_dim;x++){
+            for(y=0;y<new_lattice_dim;y++){
+                run_count=refined_row(x, y, row_runs);
+                for(n=0;n<run_count;n++){
+                    dipoles[l]=dipoles[l]+row_runs[2*n+1]-row_runs[2*n];
+                }
+            }
+        }
+        free((void*)row_runs);
+        free_grids();
+    }
+
+    if(placement==1){
+        printf("\n\n \t sweep         one thread        first touch         speed-up");
+    }
+    else{
+        printf("\n\n \t sweep         row pointers      tiled (%dx%dx%d)      speed-up", TILE_SIZE, TILE_SIZE, TILE_SIZE);
+    }
+    printf("\n \t y-z       %12.4f s     %12.4f s       %6.2fx", sweep_time[0][0], sweep_time[1][0], sweep_time[0][0]/sweep_time[1][0]);
+    printf("\n \t z-x       %12.4f s     %12.4f s       %6.2fx", sweep_time[0][1], sweep_time[1][1], sweep_time[0][1]/sweep_time[1][1]);
+    printf("\n \t x-y       %12.4f s     %12.4f s       %6.2fx", sweep_time[0][2], sweep_time[1][2], sweep_time[0][2]/sweep_time[1][2]);
+    printf("\n \t dipoles   %12lld       %12lld\n\n", dipoles[0], dipoles[1]);
+
+    layout=saved_layout;
+    first_touch=saved_first_touch;
+    engine=saved_engine;
+    diagnostics=saved_diagnostics;
+    original_grid=saved_original_grid;
+    new_grid=saved_new_grid;
+    original_block=saved_original_block;
+    new_block=saved_new_block;
+    original_tiles=saved_original_tiles;
+    new_tiles=saved_new_tiles;
+    original_tile_offsets=saved_original_tile_offsets;
+    new_tile_offsets=saved_new_tile_offsets;
+}
+
+/* QUERY API: whether cell X-Y-Z of the new grid is a dipole, worked out on demand from the original grid. A new cell only depends on the 3x3x3 block of original cells around its parent, so each query is one spherify_cell() on 27 bits -- the same cost for any size of grid, and the new grid is never built (or read back from shape2.dat). query_begin() packs the original grid into one bit per cell, so the queries work with every engine, and call query_end() when done */
+
+static void query_begin(void)
+{
+    int x, y, z, n;
+    int* runs;
+    size_t cell;
+
+    query_bits=(uint64_t*)checked_calloc(((size_t)original_lattice_dim*original_lattice_dim*original_lattice_dim+63)/64, sizeof(uint64_t), "query API");
+    runs=(int*)checked_malloc((2*original_lattice_dim+2)*sizeof(int), "query API");
+    for(x=0;x<original_lattice_dim;x++){
+        for(y=0;y<original_lattice_dim;y++){
+            for(n=original_row(x, y, runs)-1;n>=0;n--){
+                for(z=runs[2*n];z<runs[2*n+1];z++){
+                    cell=((size_t)x*original_lattice_dim+y)*original_lattice_dim+z;
+                    query_bits[cell>>6]=query_bits[cell>>6]|((uint64_t)1<<(cell&63));
+                }
+            }
+        }
+    }
+    free((void*)runs);
+}
+
+static void query_end(void)
+{
+    free((void*)query_bits);
+    query_bits=NULL;
+}
+
+static int query_bit(int x, int y, int z)
+{
+    size_t cell;
+
+    if((x<0)||(y<0)||(z<0)||(x>=original_lattice_dim)||(y>=original_lattice_dim)||(z>=original_lattice_dim)){
+        return 0;
+    }
+    cell=((size_t)x*original_lattice_dim+y)*original_lattice_dim+z;
+    return (int)((query_bits[cell>>6]>>(cell&63))&1);
+}
+
+/* the 8 new cells made from parent px-py-pz, as block[dx][dy][dz] holds them after the three sweeps (> 0 for a dipole) */
+
+static void query_parent(int px, int py, int pz, int block[2][2][2])
+{
+    int nb[3][3][3], dx, dy, dz, nonzero;
+
+    nonzero=0;
+    for(dx=0;dx<3;dx++){
+        for(dy=0;dy<3;dy++){
+            for(dz=0;dz<3;dz++){
+                nb[dx][dy][dz]=query_bit(px+dx-1, py+dy-1, pz+dz-1);
+                nonzero=nonzero|nb[dx][dy][dz];
+            }
+        }
+    }
+    if(nonzero==0){
+        memset(block, 0, 8*sizeof(int)); //empty space -- "filling with 0's"
+        return;
+    }
+    spherify_cell(nb, query_bit(px+1, py, 1), px, py, pz, block); //(see sweep_xy() for the cell checked instead of the top edge)
+}
+
+/* 1 if cell X-Y-Z of the new grid is a dipole (anything outside the grid is not) */
+
+static int query_occupied(int X, int Y, int Z)
+{
+    int block[2][2][2];
+
+    if((X<0)||(Y<0)||(Z<0)||(X>=2*original_lattice_dim)||(Y>=2*original_lattice_dim)||(Z>=2*original_lattice_dim)){
+        return 0;
+    }
+    query_parent(X/2, Y/2, Z/2, block);
+    return block[X%2][Y%2][Z%2]>0;
+}
+
+/* batched queries, shared between the threads: occupied[n] for cell xyz[3n], xyz[3n+1], xyz[3n+2], for n < count (e.g. the cells along a line of sight) */
+
+static void query_cells(long long count, const int* xyz, unsigned char* occupied)
+{
+    long long n;
+
+    #pragma omp parallel for schedule(static)
+    for(n=0;n<count;n++){
+        occupied[n]=(unsigned char)query_occupied(xyz[3*n], xyz[3*n+1], xyz[3*n+2]);
+    }
+}
+
+/* range query: occupied[Z-Z0] for cells X-Y-Z0 to X-Y-(Z1-1) of the new grid. Each pair of cells along z comes from the same parent, so it is only worked out once */
+
+static void query_row(int X, int Y, int Z0, int Z1, unsigned char* occupied)
+{
+    int Z, block[2][2][2];
+
+    for(Z=Z0;Z<Z1;Z++){
+        if((X<0)||(Y<0)||(Z<0)||(X>=2*original_lattice_dim)||(Y>=2*original_lattice_dim)||(Z>=2*original_lattice_dim)){
+            occupied[Z-Z0]=0;
+            continue;
+        }
+        if((Z==Z0)||(Z%2==0)){
+            query_parent(X/2, Y/2, Z/2, block);
+        }
+        occupied[Z-Z0]=(unsigned char)(block[X%2][Y%2][Z%2]>0);
+    }
+}
+
+/* query_benchmark = 1: check every row of the new grid against the query API, then time random queries (one at a time on one thread, and batched on all of them) */
+
+static void benchmark_queries(void)
+{
+    int X, Y, Z, n, run_count;
+    int* runs;
+    int* xyz;
+    unsigned char* row;
+    unsigned char* occupied;
+    long long cells, mismatches, hits;
+    uint64_t seed;
+    double start, pack_time, row_time, single_time, batch_time;
+
+    printf("\n Benchmarking the query API...");
+
+    start=omp_get_wtime();
+    query_begin();
+    pack_time=omp_get_wtime()-start;
+
+    /* every row of the new grid, against the one the engine made */
+
+    runs=(int*)checked_malloc((2*new_lattice_dim+2)*sizeof(int), "query benchmark");
+    row=(unsigned char*)checked_malloc(new_lattice_dim*sizeof(unsigned char), "query benchmark");
+    mismatches=0;
+    row_time=0;
+    for(X=0;X<new_lattice_dim;X++){
+        for(Y=0;Y<new_lattice_dim;Y++){
+            start=omp_get_wtime();
+            query_row(X, Y, 0, new_lattice_dim, row);
+            row_time=row_time+omp_get_wtime()-start;
+
+            run_count=refined_row(X, Y, runs);
+            Z=0;
+            for(n=0;n<=run_count;n++){
+                for(;Z<((n<run_count) ? runs[2*n] : new_lattice_dim);Z++){
+                    mismatches=mismatches+(row[Z]!=0);
+                }
+                if(n<run_count){
+                    for(;Z<runs[2*n+1];Z++){
+                        mismatches=mismatches+(row[Z]!=1);
+                    }
+                }
+            }
+        }
+    }
+    free((void*)runs);
+    free((void*)row);
+    cells=(long long)new_lattice_dim*new_lattice_dim*new_lattice_dim;
+
+    /* random cells anywhere in the new grid */
+
+    xyz=(int*)checked_malloc(3*QUERY_SAMPLES*sizeof(int), "query benchmark");
+    occupied=(unsigned char*)checked_malloc(QUERY_SAMPLES*sizeof(unsigned char), "query benchmark");
+    seed=88172645463325252ULL;
+    for(n=0;n<3*QUERY_SAMPLES;n++){
+        seed^=seed<<13; //(xorshift -- the same cells every run)
+        seed^=seed>>7;
+        seed^=seed<<17;
+        xyz[n]=(int)(seed%(uint64_t)new_lattice_dim);
+    }
+
+    hits=0;
+    start=omp_get_wtime();
+    for(n=0;n<QUERY_SAMPLES;n++){
+        hits=hits+query_occupied(xyz[3*n], xyz[3*n+1], xyz[3*n+2]);
+    }
+    single_time=omp_get_wtime()-start;
+
+    start=omp_get_wtime();
+    query_cells(QUERY_SAMPLES, xyz, occupied);
+    batch_time=omp_get_wtime()-start;
+    for(n=0;n<QUERY_SAMPLES;n++){
+        hits=hits-occupied[n];
+    }
+
+    printf("\n\n \t bit grid of the original lattice: %.1f MB, packed in %.4f s", ((double)original_lattice_dim*original_lattice_dim*original_lattice_dim+63)/64*sizeof(uint64_t)/1.0e6, pack_time);
+    printf("\n \t every row (%lld cells):       %12.4f s   %8.1f M cells/s   %lld cells differ from the new grid", cells, row_time, cells/row_time/1.0e6, mismatches);
+    printf("\n \t random cells, one at a time:  %12.4f s   %8.1f M queries/s (%.0f ns each)", single_time, QUERY_SAMPLES/single_time/1.0e6, single_time/QUERY_SAMPLES*1.0e9);
+    printf("\n \t random cells, batched:        %12.4f s   %8.1f M queries/s on %d threads%s\n\n", batch_time, QUERY_SAMPLES/batch_time/1.0e6, omp_get_max_threads(), (hits!=0) ? " -- BATCHED RESULTS DIFFER!" : "");
+
+    free((void*)xyz);
+    free((void*)occupied);
+    query_end();
+}
+
+/* query_input = 1: answer queries from query.txt (or, without it, from stdin) -- one cell of the new grid per line, as "X Y Z" -- with a line "X Y Z 1" for a dipole or "X Y Z 0" for an empty cell, in the same order */
+
+static void answer_queries(void)
+{
+    FILE* in;
+    int* xyz;
+    unsigned char* occupied;
+    long long count, capacity, n;
+    double start;
+
+    if((in=fopen("query.txt", "r"))==NULL){
+        in=stdin;
+        printf("\n Query mode: no query.txt -- reading cells of the new grid (X Y Z, one per line) from stdin until it ends...\n");
+        fflush(stdout);
+    }
+    capacity=1024;
+    xyz=(int*)checked_malloc(3*capacity*sizeof(int), "queries");
+    count=0;
+    while(fscanf(in, " %d %d %d", &xyz[3*count], &xyz[3*count+1], &xyz[3*count+2])==3){
+        count++;
+        if(count==capacity){
+            capacity=2*capacity;
+            xyz=(int*)checked_realloc(xyz, 3*capacity*sizeof(int), "queries");
+        }
+    }
+    if(in!=stdin){
+        fclose(in);
+    }
+
+    start=omp_get_wtime();
+    query_begin();
+    occupied=(unsigned char*)checked_malloc(count*sizeof(unsigned char)+1, "queries");
+    query_cells(count, xyz, occupied); //(all of them at once, shared between the threads)
+    query_end();
+
+    printf("\n Query mode: %lld cells of the %d x %d x %d new grid (cell X Y Z is at X-%g, Y-%g, Z-%g in shape2.dat), answered in %.4f s:\n\n", count, new_lattice_dim, new_lattice_dim, new_lattice_dim, 2*STAG_offset[0], 2*STAG_offset[1], 2*STAG_offset[2], omp_get_wtime()-start);
+    for(n=0;n<count;n++){
+        printf("%d %d %d %d\n", xyz[3*n], xyz[3*n+1], xyz[3*n+2], occupied[n]);
+    }
+    printf("\n");
+
+    free((void*)xyz);
+    free((void*)occupied);
+}
+
+/* MESH INPUT: instead of reading shape.dat, a closed triangle mesh (shape.obj or shape.stl) can be voxelised straight into the dipole table at a spacing of voxel_spacing (in the units of the mesh). A cell is a dipole if its centre is inside the mesh: a ray is cast along z through the centres of each column of cells, and the cells between the 1st and 2nd crossings of the surface, the 3rd and 4th, and so on, are inside ("ray parity"). The triangles are first sorted into the rows of columns (x) they span, so that the rows can be worked out in parallel, each looking only at its own triangles */
+
+typedef struct {
+    int y, z0, z1; //cells z0 <= z < z1 of column x-y are inside the mesh
+} voxel_run;
+
+double* mesh_triangles; //the three corners (x, y, z) of each triangle, one triangle after another
+int mesh_triangle_count, mesh_triangle_capacity;
+
+static void add_triangle(const double* a, const double* b, const double* c)
+{
+    double* t;
+
+    if(mesh_triangle_count==mesh_triangle_capacity){
+        mesh_triangle_capacity=(mesh_triangle_capacity>0) ? 2*mesh_triangle_capacity : 4096;
+        mesh_triangles=(double*)checked_realloc(mesh_triangles, (size_t)mesh_triangle_capacity*9*sizeof(double), "mesh triangles");
+    }
+    t=mesh_triangles+9*(size_t)mesh_triangle_count;
+    memcpy(t, a, 3*sizeof(double));
+    memcpy(t+3, b, 3*sizeof(double));
+    memcpy(t+6, c, 3*sizeof(double));
+    mesh_triangle_count++;
+}
+
+/* OBJ: "v x y z" lines are corners and "f a b c ..." lines are faces (a polygon is split into a fan of triangles). Corners are numbered from 1, or back from the latest corner if negative, and may be followed by "/texture/normal" numbers, which are not needed */
+
+static int read_obj(FILE* in)
+{
+    char line[4096];
+    char* p;
+    char* end;
+    double* v;
+    int count, capacity, n, first, previous, index;
+
+    v=NULL;
+    count=0;
+    capacity=0;
+    while(fgets(line, sizeof(line), in)!=NULL){
+        if((line[0]=='v')&&(line[1]==' ')){
+            if(count==capacity){
+                capacity=(capacity>0) ? 2*capacity : 4096;
+                v=(double*)checked_realloc(v, (size_t)capacity*3*sizeof(double), "mesh corners");
+            }
+            if(sscanf(line+2, "%lf %lf %lf", &v[3*(size_t)count], &v[3*(size_t)count+1], &v[3*(size_t)count+2])==3){
+                count++;
+            }
+        }
+        else if((line[0]=='f')&&(line[1]==' ')){
+            p=line+2;
+            n=0;
+            first=0;
+            previous=0;
+            while(1){
+                index=(int)strtol(p, &end, 10);
+                if(end==p){
+                    break;
+                }
+                for(p=end;(*p!='\0')&&(*p!=' ')&&(*p!='\t');p++){
+                } //skip "/texture/normal"
+                index=(index<0) ? count+index : index-1;
+                if((index<0)||(index>=count)){
+                    printf("\n\nError- shape.obj has a face with a corner that does not exist!! \n\n\n");
+                    free((void*)v);
+                    return 0;
+                }
+                if(n==0){
+                    first=index;
+                }
+                else if(n>=2){
+                    add_triangle(v+3*(size_t)first, v+3*(size_t)previous, v+3*(size_t)index);
+                }
+                previous=index;
+                n++;
+            }
+        }
+    }
+    free((void*)v);
+    return 1;
+}
+
+/* STL: binary (an 80-byte header, the number of triangles, then 50 bytes for each triangle), or text ("vertex x y z" lines, three for each facet) */
+
+static int read_stl(FILE* in)
+{
+    unsigned char header[84], record[50];
+    float corner[9];
+    double c[9];
+    char line[1000];
+    long bytes;
+    uint32_t count, t;
+    int n;
+
+    fseek(in, 0, SEEK_END);
+    bytes=ftell(in);
+    rewind(in);
+    if(fread(header, 1, 84, in)==84){
+        count=header[80]|(header[81]<<8)|(header[82]<<16)|((uint32_t)header[83]<<24);
+        if(bytes==84+50*(long)count){
+            for(t=0;t<count;t++){
+                if(fread(record, 1, 50, in)!=50){
+                    return 0;
+                }
+                memcpy(corner, record+12, sizeof(corner)); //the corners come after the normal (little-endian floats, as on every computer spherify runs on)
+                for(n=0;n<9;n++){
+                    c[n]=corner[n];
+                }
+                add_triangle(c, c+3, c+6);
+            }
+            return 1;
+        }
+    }
+
+    rewind(in);
+    n=0;
+    while(fgets(line, sizeof(line), in)!=NULL){
+        if((strstr(line, "vertex")!=NULL)&&(sscanf(strstr(line, "vertex")+6, "%lf %lf %lf", &c[3*n], &c[3*n+1], &c[3*n+2])==3)){
+            n++;
+            if(n==3){
+                add_triangle(c, c+3, c+6);
+                n=0;
+            }
+        }
+    }
+    return 1;
+}
+
+static int compare_hits(const void* a, const void* b)
+{
+    const double* p=(const double*)a;
+    const double* q=(const double*)b;
+
+    if(p[0]!=q[0]){
+        return (p[0]<q[0]) ? -1 : 1;
+    }
+    return (p[1]>q[1])-(p[1]<q[1]);
+}
+
+/* the runs of inside cells along the columns of row x, given the triangles tris[] that span the row. The crossings of every column are found as (y, height) pairs in *hits, sorted, and paired up. Columns with an odd number of crossings (a hole in the mesh) are counted in *leaks, and their last crossing ignored */
+
+static int voxel_row(int x, const int* tris, size_t tri_count, const double* lo, const int* dim, voxel_run** runs, int* run_capacity, double** hits, size_t* hit_capacity, int* leaks)
+{
+    int y, y0, y1, z0, z1, n, m, run_count;
+    size_t t, hit_count;
+    const double* v;
+    double h, px, py, ax, ay, bx, by, cx, cy, w0, w1, w2, area;
+
+    h=voxel_spacing;
+    px=lo[0]+(x+0.5)*h+h*1.23456789e-7; //(the rays are nudged, so that they never pass exactly through an edge or a corner)
+    hit_count=0;
+    for(t=0;t<tri_count;t++){
+        v=mesh_triangles+9*(size_t)tris[t];
+        y0=(int)ceil((fmin(v[1], fmin(v[4], v[7]))-lo[1])/h-0.5);
+        y1=(int)floor((fmax(v[1], fmax(v[4], v[7]))-lo[1])/h-0.5);
+        y0=(y0<0) ? 0 : y0;
+        y1=(y1>=dim[1]) ? dim[1]-1 : y1;
+        ax=v[0]-px;
+        bx=v[3]-px;
+        cx=v[6]-px;
+        for(y=y0;y<=y1;y++){
+            py=lo[1]+(y+0.5)*h+h*2.71828183e-7;
+            ay=v[1]-py;
+            by=v[4]-py;
+            cy=v[7]-py;
+            w0=bx*cy-by*cx; //(twice) the signed areas of the triangles the ray makes with each edge -- all the same sign if the ray goes through the triangle
+            w1=cx*ay-cy*ax;
+            w2=ax*by-ay*bx;
+            area=w0+w1+w2;
+            if((area==0)||(((w0<0)||(w1<0)||(w2<0))&&((w0>0)||(w1>0)||(w2>0)))){
+                continue;
+            }
+            if(hit_count+2>*hit_capacity){
+                *hit_capacity=2*(*hit_capacity)+1024;
+                *hits=(double*)checked_realloc(*hits, *hit_capacity*sizeof(double), "mesh voxelisation");
+            }
+            (*hits)[hit_count]=y;
+            (*hits)[hit_count+1]=(w0*v[2]+w1*v[5]+w2*v[8])/area; //height of the crossing
+            hit_count=hit_count+2;
+        }
+    }
+    qsort(*hits, hit_count/2, 2*sizeof(double), compare_hits);
+
+    run_count=0;
+    for(t=0;t<hit_count;t=t+2*n){
+        y=(int)(*hits)[t];
+        for(n=1;(t+2*n<hit_count)&&((int)(*hits)[t+2*n]==y);n++){
+        } //n crossings in column x-y
+        for(m=0;m+1<n;m=m+2){
+            z0=(int)ceil(((*hits)[t+2*m+1]-lo[2])/h-0.5); //cells whose centres lie between the two crossings
+            z1=(int)ceil(((*hits)[t+2*m+3]-lo[2])/h-0.5);
+            z0=(z0<0) ? 0 : z0;
+            z1=(z1>dim[2]) ? dim[2] : z1;
+            if(z1<=z0){
+                continue;
+            }
+            if(run_count==*run_capacity){
+                *run_capacity=2*(*run_capacity)+256;
+                *runs=(voxel_run*)checked_realloc(*runs, (size_t)*run_capacity*sizeof(voxel_run), "mesh voxelisation");
+            }
+            (*runs)[run_count].y=y;
+            (*runs)[run_count].z0=z0;
+            (*runs)[run_count].z1=z1;
+            run_count++;
+        }
+        if(n%2==1){
+            (*leaks)++;
+        }
+    }
+    return run_count;
+}
+
+/* voxelise shape.obj (or shape.stl) into the dipole table, in place of read_shape_file(). Returns 0 if there is a problem */
+
+static int voxelise_mesh(void)
+{
+    FILE* in;
+    const char* name;
+    int a, t, n, ok, x, x0, x1, leaks, dim[3], run_count, run_capacity;
+    double lo[3], hi[3], start, cells;
+    double* hits;
+    size_t hit_capacity, m, total;
+    size_t* row_start;
+    size_t* cursor;
+    int* row_tris;
+    int* row_count;
+    voxel_run** rows;
+    voxel_run* runs;
+
+    name="shape.obj";
+    if((in=fopen(name, "r"))==NULL){
+        name="shape.stl";
+        if((in=fopen(name, "rb"))==NULL){
+            printf("\n\nError- voxel_spacing is set, but neither shape.obj nor shape.stl can be found!! \n\n\n");
+            return 0;
+        }
+    }
+    start=omp_get_wtime();
+    mesh_triangles=NULL;
+    mesh_triangle_count=0;
+    mesh_triangle_capacity=0;
+    ok=(strcmp(name, "shape.obj")==0) ? read_obj(in) : read_stl(in);
+    fclose(in);
+    if((ok==0)||(mesh_triangle_count==0)){
+        printf("\n\nError- no triangles could be read from %s!! \n\n\n", name);
+        free((void*)mesh_triangles);
+        return 0;
+    }
+
+    /* the grid covers the bounding box of the mesh */
+
+    for(a=0;a<3;a++){
+        lo[a]=mesh_triangles[a];
+        hi[a]=mesh_triangles[a];
+    }
+    for(m=0;m<9*(size_t)mesh_triangle_count;m++){
+        lo[m%3]=fmin(lo[m%3], mesh_triangles[m]);
+        hi[m%3]=fmax(hi[m%3], mesh_triangles[m]);
+    }
+    cells=1;
+    for(a=0;a<3;a++){
+        dim[a]=(int)ceil((hi[a]-lo[a])/voxel_spacing);
+        dim[a]=(dim[a]<1) ? 1 : dim[a];
+        cells=cells*dim[a];
+    }
+    printf("\n Mesh %s opened: %d triangles. Voxelising into a %d x %d x %d grid (spacing %g)...", name, mesh_triangle_count, dim[0], dim[1], dim[2], voxel_spacing);
+
+    /* sort the triangles into the rows x whose centres they span */
+
+    row_start=(size_t*)checked_calloc(dim[0]+1, sizeof(size_t), "mesh voxelisation");
+    row_tris=NULL;
+    cursor=NULL;
+    for(n=0;n<2;n++){ //count, then fill
+        if(n==1){
+            for(x=0;x<dim[0];x++){
+                row_start[x+1]=row_start[x+1]+row_start[x];
+            }
+            row_tris=(int*)checked_malloc((row_start[dim[0]]+1)*sizeof(int), "mesh voxelisation");
+            cursor=(size_t*)checked_malloc((dim[0]+1)*sizeof(size_t), "mesh voxelisation");
+            memcpy(cursor, row_start, (dim[0]+1)*sizeof(size_t));
+        }
+        for(t=0;t<mesh_triangle_count;t++){
+            x0=(int)ceil((fmin(mesh_triangles[9*(size_t)t], fmin(mesh_triangles[9*(size_t)t+3], mesh_triangles[9*(size_t)t+6]))-lo[0])/voxel_spacing-0.5);
+            x1=(int)floor((fmax(mesh_triangles[9*(size_t)t], fmax(mesh_triangles[9*(size_t)t+3], mesh_triangles[9*(size_t)t+6]))-lo[0])/voxel_spacing-0.5);
+            for(x=(x0<0) ? 0 : x0;(x<=x1)&&(x<dim[0]);x++){
+                if(n==0){
+                    row_start[x+1]++;
+                }
+                else{
+                    row_tris[cursor[x]++]=t;
+                }
+            }
+        }
+    }
+    free((void*)cursor);
+
+    /* cast the rays, a row at a time */
+
+    rows=(voxel_run**)checked_calloc(dim[0], sizeof(voxel_run*), "mesh voxelisation");
+    row_count=(int*)checked_calloc(dim[0], sizeof(int), "mesh voxelisation");
+    leaks=0;
+    #pragma omp parallel private(runs, run_capacity, run_count, hits, hit_capacity)
+    {
+        runs=NULL;
+        run_capacity=0;
+        hits=NULL;
+        hit_capacity=0;
+
+        #pragma omp for schedule(dynamic, 1) reduction(+:leaks)
+        for(x=0;x<dim[0];x++){
+            run_count=voxel_row(x, row_tris+row_start[x], row_start[x+1]-row_start[x], lo, dim, &runs, &run_capacity, &hits, &hit_capacity, &leaks);
+            rows[x]=(voxel_run*)checked_malloc(run_count*sizeof(voxel_run)+1, "mesh voxelisation");
+            memcpy(rows[x], runs, run_count*sizeof(voxel_run));
+            row_count[x]=run_count;
+        }
+
+        free((void*)runs);
+        free((void*)hits);
+    }
+
+    /* copy the inside cells into the dipole table (composition 1) */
+
+    total=0;
+    for(x=0;x<dim[0];x++){
+        for(n=0;n<row_count[x];n++){
+            total=total+rows[x][n].z1-rows[x][n].z0;
+        }
+    }
+    if((total==0)||(total>INT32_MAX)){
+        printf("\n\nError- voxelising %s gave %s dipoles!! \n\n\n", name, (total==0) ? "no" : "too many");
+        return 0;
+    }
+    original_N=(int)total;
+    dipole_table_init(original_N);
+    m=0;
+    for(x=0;x<dim[0];x++){
+        for(n=0;n<row_count[x];n++){
+            for(a=rows[x][n].z0;a<rows[x][n].z1;a++){
+                dipole_xyz32[0][m]=x;
+                dipole_xyz32[1][m]=rows[x][n].y;
+                dipole_xyz32[2][m]=a;
+                m++;
+            }
+        }
+        free((void*)rows[x]);
+    }
+    memset(dipole_comp[0], 1, 3*(size_t)original_N); //(the three composition columns follow one another)
+    ICOMPX=1;
+    ICOMPY=1;
+    ICOMPZ=1;
+
+    free((void*)rows);
+    free((void*)row_count);
+    free((void*)row_tris);
+    free((void*)row_start);
+    free((void*)mesh_triangles);
+
+    printf("\n\n %d dipoles voxelised (%.1f%% of the grid) in %.3f s.", original_N, 100.0*original_N/cells, omp_get_wtime()-start);
+    if(leaks>0){
+        printf("\n Warning- %d columns crossed the surface an odd number of times -- %s may not be closed.", leaks, name);
+    }
+    return 1;
+}
+
+/* a DDSCAT header for shape2.dat, when the shape came from a mesh rather than shape.dat (copied in the same way -- see main()) */
+
+static FILE* voxel_header(void)
+{
+    FILE* header;
+
+    header=tmpfile();
+    fprintf(header, " >SPHERIFY: shape voxelised from a triangle mesh at a spacing of %g, then spherified\n", voxel_spacing);
+    fprintf(header, "   %d   = NAT\n", original_N);
+    fprintf(header, "  1.000000  0.000000  0.000000 = A_1 vector\n");
+    fprintf(header, "  0.000000  1.000000  0.000000 = A_2 vector\n");
+    fprintf(header, "  1.000000  1.000000  1.000000 = lattice spacings (d_x,d_y,d_z)/d\n");
+    fprintf(header, "  0.000000  0.000000  0.000000 = lattice offset x0(1-3) = (x_TF,y_TF,z_TF)/d for dipole 0 0 0\n");
+    fprintf(header, "     JA  IX  IY  IZ ICOMP(x,y,z)\n");
+    rewind(header);
+    return header;
+}
+
+/* read in shape.dat file: the header, then up to NAT dipoles into the dipole table. Returns 0 if there is a problem */
+
+static int read_shape_file(void)
+{
+    if((DDSCAT_infile=open_shape_file()) == NULL){
+        printf("\n\nError- the shape file cannot be found!! \n\n\n");
+        system("pause");
+        return 0;
+    }
+
+    printf("\n Shape data file opened successfully. Analysing data:\n");
+
+    /* read the information from the header of the DDSCAT file and find where the data starts (these header sections can be flexible and have different numbers of lines before the data starts -- so we just find where line containing JA, IX, IY, IZ is and assume the data begins underneath)*/
+
+    while (fgets(buf,LINE_LENGTH, DDSCAT_infile)!=NULL){ //if something is read
+
+        if(strstr(buf,"NAT") != NULL){ //check if "NAT" is in the string for this line
+            if(1==sscanf(buf,"%*[^0123456789]%lld", &JA)){ //record the number of dipoles (the first instance where any of the numbers 0->9 appear in this line)
+                printf("\n \t NAT found: %lld dipoles are in the original data file.", JA);
+                if(JA>2147483647LL){
+                    printf("\n\nError- shape.dat can hold at most 2147483647 dipoles (the new shape can have many more)!! \n\n\n");
+                    return 0;
+                }
+                original_N=(int)JA;
+            }
+        }
+
+        if(strstr(buf,"JA") != NULL){
+            if(strstr(buf,"IX") != NULL){       //check if the current line contains the strings "JA", "IX", "IY" and "IZ" (seperately in case the spacing is changed by the user).
+                if(strstr(buf,"IY") != NULL){
+                    if(strstr(buf,"IZ") != NULL){
+                        break;		//then exit the loop -- data is about to start
+                    }
+                }
+            }
+        }
+    }
+
+    /* initialise table to store dipoles, now that we know how many there were originally */
+    if(15.0*original_N>memory_limit_bytes()){
+        printf("\n\nError- %d dipoles need more than the %.0f MB memory limit!! \n\n\n", original_N, memory_limit_bytes()/1048576.0);
+        return 0;
+    }
+    dipole_table_init(original_N);   //table will record each of the values for "IX IY IZ ICOMPX ICOMPY ICOMPZ"
+
+    /* begin recording values and saving only the required composition (default ==1, for soot) */
+
+    k=0; //counts the number of dipoles with composition 1
+
+    while(k<original_N && fscanf(DDSCAT_infile, " %lld  %d  %d  %d  %d  %d  %d", &JA, &IX, &IY, &IZ, &ICOMPX, &ICOMPY, &ICOMPZ)>0){ //scan each line of data after this point (up to NAT lines) and record the values as individual buffers JA, IX etc...
+
+        if((ICOMPX<0)||(ICOMPX>255)||(ICOMPY<0)||(ICOMPY>255)||(ICOMPZ<0)||(ICOMPZ>255)){
+            printf("\n\nError- dipole %lld has composition %d %d %d, but spherify can only store compositions 0-255!! \n\n\n", JA, ICOMPX, ICOMPY, ICOMPZ);
+            return 0;
+        }
+        dipole_xyz32[0][k]=IX;
+        dipole_xyz32[1][k]=IY;
+        dipole_xyz32[2][k]=IZ;            //save info for all dipoles
+        dipole_comp[0][k]=ICOMPX;
+        dipole_comp[1][k]=ICOMPY;         //composition IDs are stored as 8-bit values
+        dipole_comp[2][k]=ICOMPZ;
+        k++; //we found a dipole - keep track of total number
+    }
+
+    if(k==0){
+        printf("\n\nError- no dipoles were found!! \n\n\n");
+        system("pause");
+        return 0;
+    }
+    else{
+        printf("\n\n %d dipoles successfully imported.", k);
+    }
+
+    fclose(DDSCAT_infile);
+    original_N=k; //in case shape.dat holds fewer dipoles than NAT
+    return 1;
+}
+
+/* BATCH MODE: work through the targets listed in manifest.txt (one folder holding a shape.dat per line), sharing them with any number of other copies of spherify started in the same folder -- on one computer, or on several sharing the disk. A copy claims a target by creating batch_claims/<line> (with O_EXCL, so only one copy can ever create it), then spherifies it in a copy of itself (fork()) that carries on through main() in the target's folder, just like an orientation. Every finished target is added to batch_journal.txt, which is only ever appended to (one write() per line), so a batch that was stopped can be started again and only the targets not yet done are run. A claim left behind by a copy that died (on this computer) is taken over */
+
+typedef struct {
+    char** target;      //folder of each line of the manifest (NULL for blank lines and comments)
+    int count;          //lines in the manifest
+    int targets;        //(not counting blank lines and comments)
+    unsigned char* done;   //1 for each line of the manifest recorded as done in the journal...
+    unsigned char* failed; //...or as failed, and not done since
+    int done_count, failed_count; //(targets, not journal lines -- a target that failed twice counts once)
+    double seconds;     //totals over the targets done (from the journal -- all copies)
+    long long dipoles_in, dipoles_out;
+    long journal_read;  //bytes of the journal read so far
+} batch_state;
+
+static int load_manifest(batch_state* b)
+{
+    FILE* in;
+    size_t length;
+
+    if((in=fopen("manifest.txt", "r"))==NULL){
+        return 0;
+    }
+    b->count=0;
+    b->targets=0;
+    b->target=NULL;
+    while(fgets(buf, LINE_LENGTH, in)!=NULL){
+        b->target=(char**)checked_realloc(b->target, (b->count+1)*sizeof(char*), "batch");
+        length=strcspn(buf, "\r\n");
+        buf[length]=0;
+        b->target[b->count]=((length==0)||(buf[0]=='#')) ? NULL : strdup(buf);
+        b->targets=b->targets+((b->target[b->count]!=NULL) ? 1 : 0);
+        b->count++;
+    }
+    fclose(in);
+    b->done=(unsigned char*)checked_calloc(b->count+1, 1, "batch");
+    b->failed=(unsigned char*)checked_calloc(b->count+1, 1, "batch");
+    return b->count;
+}
+
+/* read any lines added to the journal since the last call (by this copy or any other): line  status  seconds  dipoles in  dipoles out  host:pid  folder */
+
+static void read_journal(batch_state* b)
+{
+    FILE* in;
+    int line;
+    char status[16];
+    double seconds;
+    long long in_count, out_count;
+
+    if((in=fopen("batch_journal.txt", "r"))==NULL){
+        return;
+    }
+    fseek(in, b->journal_read, SEEK_SET);
+    while(fgets(buf, LINE_LENGTH, in)!=NULL){
+        if(buf[strlen(buf)-1]!='\n'){
+            break; //(a line still being written -- read it next time)
+        }
+        b->journal_read=ftell(in);
+        if((sscanf(buf, "%d %15s %lf %lld %lld", &line, status, &seconds, &in_count, &out_count)==5)&&(line>=1)&&(line<=b->count)){
+            if((strcmp(status, "done")==0)&&(b->done[line]==0)){
+                b->done[line]=1;
+                b->done_count++;
+                if(b->failed[line]==1){ //(it failed before, but has been done since)
+                    b->failed[line]=0;
+                    b->failed_count--;
+                }
+                b->seconds=b->seconds+seconds;
+                b->dipoles_in=b->dipoles_in+in_count;
+                b->dipoles_out=b->dipoles_out+out_count;
+            }
+            else if((strcmp(status, "failed")==0)&&(b->done[line]==0)&&(b->failed[line]==0)){
+                b->failed[line]=1;
+                b->failed_count++;
+            }
+        }
+    }
+    fclose(in);
+}
+
+/* claim line n of the manifest for this copy: 1 if it is now ours, 0 if another copy has it */
+
+static int claim_target(int n)
+{
+    int file, pid, tries;
+    char claim[100], stale[120], host[256], owner[256], record[300];
+    FILE* in;
+
+    mkdir("batch_claims", 0777);
+    snprintf(claim, sizeof(claim), "batch_claims/%d", n);
+    gethostname(host, sizeof(host));
+    host[sizeof(host)-1]=0;
+
+    for(tries=0;tries<2;tries++){
+        file=open(claim, O_WRONLY|O_CREAT|O_EXCL, 0666);
+        if(file>=0){
+            snprintf(record, sizeof(record), "%s %d\n", host, (int)getpid());
+            if(write(file, record, strlen(record))<0){
+                close(file);
+                return 0;
+            }
+            close(file);
+            return 1;
+        }
+
+        /* already claimed -- take it over only if the copy that claimed it was on this computer, and has died */
+        pid=0;
+        owner[0]=0;
+        if((in=fopen(claim, "r"))!=NULL){
+            if(fscanf(in, "%255s %d", owner, &pid)!=2){
+                pid=0;
+            }
+            fclose(in);
+        }
+        if((pid<=0)||(strcmp(owner, host)!=0)||(kill(pid, 0)==0)||(errno!=ESRCH)){
+            return 0;
+        }
+        snprintf(stale, sizeof(stale), "%s.stale.%d", claim, (int)getpid());
+        if(rename(claim, stale)!=0){
+            return 0; //(another copy took it over first)
+        }
+        unlink(stale);
+    }
+    return 0;
+}
 
-    //printf("\n\n\n                 SPHERE POSITION                   LOCATIONS                      TRANSLATED POSITION          FINAL STAG POSITION \n\n");
-    //for(i=0;i<number_of_spheres;i++){
-    //    for(j=0;j<sphere_N;j++){
-    //        //printf(" %4d %4d     %5.2f %5.2f %5.2f       +       %5.2f %5.2f %5.2f     -->           %5.2f %5.2f %5.2f            %5.2f %5.2f %5.2f \n", i, j, sphere_dipole_positions[j][0], sphere_dipole_positions[j][1], sphere_dipole_positions[j][2], sphere_locations[i][0]+sphere_odd_even_offset, sphere_locations[i][1]+sphere_odd_even_offset, sphere_locations[i][2]+sphere_odd_even_offset, dipole_positions[i*sphere_N+j][0], dipole_positions[i*sphere_N+j][1], dipole_positions[i*sphere_N+j][2], STAG_dipole_positions[i*sphere_N+j][0], STAG_dipole_positions[i*sphere_N+j][1], STAG_dipole_positions[i*sphere_N+j][2]);
-    //    }
-    //}
+/* NAT from the header of folder/name (or folder/name.gz), or -1 */
 
-    printf("\n\n\n             IMPORTED POSITION      ( + %.1f %.1f %.1f )       FINAL STAG POSITION \n\n", STAG_offset[0], STAG_offset[1], STAG_offset[2]);
-    for(i=0;i<original_N;i++){
-        printf(" %4d      %6.2f %6.2f %6.2f             -->              %6.2f %6.2f %6.2f            \n", i, dipole_info[i][0], dipole_info[i][1], dipole_info[i][2], STAG_dipole_positions[i][0], STAG_dipole_positions[i][1], STAG_dipole_positions[i][2]);
+static long long header_nat(const char* folder, const char* name)
+{
+    char path[LINE_LENGTH+120];
+    long long nat;
+    int gz;
+#ifdef USE_ZLIB
+    gzFile in;
+#else
+    FILE* in;
+#endif
+
+    nat= -1;
+    for(gz=0;(gz<2)&&(nat<0);gz++){
+        snprintf(path, sizeof(path), "%s/%s%s", folder, name, (gz==1) ? ".gz" : "");
+#ifdef USE_ZLIB
+        if((in=gzopen(path, "rb"))==NULL){ //(also reads uncompressed files)
+            continue;
+        }
+        while((nat<0)&&(gzgets(in, buf, LINE_LENGTH)!=NULL)){
+            if((strstr(buf,"NAT")!=NULL)&&(sscanf(buf,"%*[^0123456789]%lld", &nat)!=1)){
+                nat= -1;
+            }
+        }
+        gzclose(in);
+#else
+        if((in=fopen(path, "r"))==NULL){
+            continue;
+        }
+        while((nat<0)&&(fgets(buf, LINE_LENGTH, in)!=NULL)){
+            if((strstr(buf,"NAT")!=NULL)&&(sscanf(buf,"%*[^0123456789]%lld", &nat)!=1)){
+                nat= -1;
+            }
+        }
+        fclose(in);
+#endif
     }
+    return nat;
+}
 
+static int run_batch(void)
+{
+    batch_state b;
+    int n, status, journal, mine, mine_failed, skipped;
+    char host[256], record[LINE_LENGTH+400];
+    pid_t child;
+    double start, target_start, seconds;
+    long long in_count, out_count, mine_out;
+
+    memset(&b, 0, sizeof(b));
+    if((load_manifest(&b)==0)||(b.targets==0)){
+        printf("\n\nError- manifest.txt is missing or empty (it should list one folder per line, each holding a shape.dat)!! \n\n\n");
+        exit(1);
+    }
+    read_journal(&b);
+    skipped=b.done_count;
+    gethostname(host, sizeof(host));
+    host[sizeof(host)-1]=0;
+
+    printf("\n\n Batch mode: %d targets in manifest.txt, %d already done (batch_journal.txt). Worker %s:%d.\n", b.targets, b.done_count, host, (int)getpid());
+    fflush(stdout);
+
+    start=omp_get_wtime();
+    mine=0;
+    mine_failed=0;
+    mine_out=0;
+    for(n=1;n<=b.count;n++){
+        read_journal(&b); //(targets finished by other copies since the last one)
+        if((b.target[n-1]==NULL)||(b.done[n]==1)||(claim_target(n)==0)){
+            continue;
+        }
 
-    /* initialise original grid array */
+        target_start=omp_get_wtime();
+        fflush(stdout);
+        child=fork();
+        if(child==0){ /* this copy: carry on through main() in the target's folder */
+            if((chdir(b.target[n-1])!=0)||(freopen("spherify_log.txt", "w", stdout)==NULL)){
+                exit(1);
+            }
+            for(n=0;n<b.count;n++){
+                free((void*)b.target[n]);
+            }
+            free((void*)b.target);
+            free((void*)b.done);
+            free((void*)b.failed);
+            return 0;
+        }
+        status=1;
+        if((child<0)||(waitpid(child, &status, 0)!=child)){
+            status=1;
+        }
+        seconds=omp_get_wtime()-target_start;
+        status=(WIFEXITED(status)&&(WEXITSTATUS(status)==0)) ? 0 : 1;
+
+        in_count=header_nat(b.target[n-1], "shape.dat");
+        out_count=(status==0) ? header_nat(b.target[n-1], "shape2.dat") : -1;
+        snprintf(record, sizeof(record), "%d\t%s\t%.3f\t%lld\t%lld\t%s:%d\t%s\n", n, (status==0) ? "done" : "failed", seconds, in_count, out_count, host, (int)getpid(), b.target[n-1]);
+        journal=open("batch_journal.txt", O_WRONLY|O_CREAT|O_APPEND, 0666);
+        if((journal<0)||(write(journal, record, strlen(record))<0)){
+            printf("\n\nError- could not add to batch_journal.txt!! \n\n\n");
+            exit(1);
+        }
+        close(journal);
 
-    original_grid = (int***)malloc(original_lattice_dim*sizeof(int**));
-    for (i=0;i<original_lattice_dim;i++) {
-        original_grid[i] = (int**)malloc(original_lattice_dim*sizeof(int*));
-        for (j=0;j<original_lattice_dim;j++) {
-          original_grid[i][j] = (int*)malloc(original_lattice_dim*sizeof(int));
+        mine++;
+        if(status==0){
+            mine_out=mine_out+((out_count>0) ? out_count : 0);
+        }
+        else{
+            mine_failed++;
+        }
+        printf("\n \t %-40s %s (%.1f s, %lld -> %lld dipoles)", b.target[n-1], (status==0) ? "done" : "FAILED -- see its spherify_log.txt", seconds, in_count, out_count);
+        fflush(stdout);
+    }
+
+    /* throughput: this copy, then the whole batch so far (every copy, from the journal) */
+
+    read_journal(&b);
+    seconds=omp_get_wtime()-start;
+    printf("\n\n Batch worker finished: %d targets run (%d failed) in %.1f s -- %.1f targets/hour, %.3g dipoles saved per second.", mine, mine_failed, seconds, 3600.0*(mine-mine_failed)/(seconds+1e-9), mine_out/(seconds+1e-9));
+    printf("\n Whole batch: %d of %d targets done (%d skipped as already done when this copy started), %d failed (and not done since). %.1f s of spherify in all (%.2f s per target), %lld dipoles in, %lld out.\n\n", b.done_count, b.targets, skipped, b.failed_count, b.seconds, b.seconds/((b.done_count>0) ? b.done_count : 1), b.dipoles_in, b.dipoles_out);
+
+    for(n=0;n<b.count;n++){
+        free((void*)b.target[n]);
+    }
+    free((void*)b.target);
+    free((void*)b.done);
+    free((void*)b.failed);
+    return (mine_failed>0) ? 2 : 1;
+}
+
+/* ORIENTATION ENSEMBLE: spherify the same shape in many orientations, each saved in its own folder (orientation_001, orientation_002 ...). The rotations are read from orientations.txt -- three Euler angles per line, in degrees, for rotations about z, then y, then z -- or, without that file, are the 24 right-angle rotations of the lattice. Each orientation is run by a copy of this process (fork()), which rotates the dipoles and then carries on through the rest of main() as a normal run with its own grids. The shape they are all rotated from is read once, before the copies are made, and is shared between them without being copied */
+
+char* orientation_header; //the header of shape.dat, for the shape2.dat of every orientation
+double* orientation_matrices; //the rotation matrix of each orientation (9 numbers, row by row)
+
+/* rotation matrix r for Euler angles a[] (degrees): Rz(a[0]) Ry(a[1]) Rz(a[2]) */
+
+static void rotation_matrix(const double* a, double* r)
+{
+    double c[3], s[3], m[3][3][3], t[9];
+    int n, i, j, k;
+
+    memset(m, 0, sizeof(m));
+    for(n=0;n<3;n++){
+        c[n]=cos(a[n]*M_PI/180.0);
+        s[n]=sin(a[n]*M_PI/180.0);
+        c[n]=(fabs(c[n])<1e-12) ? 0 : c[n]; //(right angles then give an exact lattice rotation)
+        s[n]=(fabs(s[n])<1e-12) ? 0 : s[n];
+        i=(n==1) ? 2 : 0; //the two axes that turn: x and y for the rotations about z, z and x for the rotation about y
+        j=(n==1) ? 0 : 1;
+        k=3-i-j;
+        m[n][i][i]=c[n];
+        m[n][i][j]=-s[n];
+        m[n][j][i]=s[n];
+        m[n][j][j]=c[n];
+        m[n][k][k]=1;
+    }
+    for(i=0;i<3;i++){
+        for(j=0;j<3;j++){
+            t[3*i+j]=0;
+            for(k=0;k<3;k++){
+                t[3*i+j]=t[3*i+j]+m[1][i][k]*m[2][k][j];
+            }
+        }
+    }
+    for(i=0;i<3;i++){
+        for(j=0;j<3;j++){
+            r[3*i+j]=0;
+            for(k=0;k<3;k++){
+                r[3*i+j]=r[3*i+j]+m[0][i][k]*t[3*k+j];
+            }
+        }
+    }
+}
+
+/* the rotations to run, from orientations.txt, or else every matrix that only swaps axes and flips their signs without mirroring the shape (the 24 right-angle rotations of the lattice). Returns the number of rotations */
+
+static int load_orientations(void)
+{
+    FILE* in;
+    char line[1000];
+    int n, capacity, p, sign, a;
+    double angles[3];
+    static const int axes[6][3]={{0, 1, 2}, {1, 2, 0}, {2, 0, 1}, {0, 2, 1}, {2, 1, 0}, {1, 0, 2}}; //(the last three swap two axes, so need an odd number of sign flips)
+
+    n=0;
+    capacity=0;
+    orientation_matrices=NULL;
+    if((in=fopen("orientations.txt", "r"))!=NULL){
+        while(fgets(line, sizeof(line), in)!=NULL){
+            if(sscanf(line, "%lf %lf %lf", &angles[0], &angles[1], &angles[2])!=3){
+                continue; //(blank lines and comments)
+            }
+            if(n==capacity){
+                capacity=2*capacity+64;
+                orientation_matrices=(double*)checked_realloc(orientation_matrices, capacity*9*sizeof(double), "orientations");
+            }
+            rotation_matrix(angles, orientation_matrices+9*n);
+            n++;
+        }
+        fclose(in);
+        return n;
+    }
+
+    orientation_matrices=(double*)checked_calloc(24*9, sizeof(double), "orientations");
+    for(p=0;p<6;p++){
+        for(sign=0;sign<8;sign++){
+            if((((sign&1)+((sign>>1)&1)+((sign>>2)&1))%2)!=((p<3) ? 0 : 1)){
+                continue;
+            }
+            for(a=0;a<3;a++){
+                orientation_matrices[9*n+3*a+axes[p][a]]=((sign>>a)&1) ? -1 : 1;
+            }
+            n++;
+        }
+    }
+    return n;
+}
+
+/* fill the dipole table with the shape turned by rotation r. The rotated shape is sampled back onto the lattice: each cell of the rotated bounding box is a dipole if turning its position back (about the centre cell of the shape) lands nearest to a cell that was occupied, and takes the compositions of that cell. occupied[] holds the original shape over its bounding box lo[] -> lo[]+size[]-1, as 0 for an empty cell or 1 + the cell's entry in palette[] (its ICOMPX, ICOMPY and ICOMPZ). The identity rotation keeps the shape where it is, so that its orientation is the same as a normal run */
+
+static void rotate_dipoles(const double* r, const unsigned char* occupied, const unsigned char* palette, const int* lo, const int* size)
+{
+    int a, b, pass, q[3], from[3], qlo[3], qhi[3], centre[3], inside, identity;
+    double corner, extent;
+    long long count;
+    unsigned char cell;
+
+    identity=1;
+    for(a=0;a<9;a++){
+        identity=identity&&(r[a]==((a%4==0) ? 1 : 0));
+    }
+    for(a=0;a<3;a++){
+        centre[a]=(identity==1) ? 0 : lo[a]+size[a]/2;
+    }
+    for(a=0;a<3;a++){ //the rotated bounding box (the box around the rotated corners of the original one)
+        if(identity==1){
+            qlo[a]=lo[a];
+            qhi[a]=lo[a]+size[a]-1;
+            continue;
+        }
+        extent=0;
+        for(b=0;b<3;b++){
+            corner=fmax(fabs((double)(lo[b]-centre[b])), fabs((double)(lo[b]+size[b]-1-centre[b])));
+            extent=extent+fabs(r[3*a+b])*corner;
+        }
+        qlo[a]=-(int)ceil(extent)-1;
+        qhi[a]=(int)ceil(extent)+1;
+    }
+
+    count=0;
+    for(pass=0;pass<2;pass++){ //count the dipoles, then save them
+        if(pass==1){
+            free(dipole_table);
+            original_N=(int)count;
+            dipole_table_init(original_N);
+            count=0;
+        }
+        for(q[0]=qlo[0];q[0]<=qhi[0];q[0]++){
+            for(q[1]=qlo[1];q[1]<=qhi[1];q[1]++){
+                for(q[2]=qlo[2];q[2]<=qhi[2];q[2]++){
+                    inside=1;
+                    for(a=0;a<3;a++){
+                        from[a]=centre[a]+(int)floor(r[a]*q[0]+r[3+a]*q[1]+r[6+a]*q[2]+0.5)-lo[a]; //(turned back by the transpose of r)
+                        inside=inside&&(from[a]>=0)&&(from[a]<size[a]);
+                    }
+                    if((inside==0)||((cell=occupied[((size_t)from[0]*size[1]+from[1])*size[2]+from[2]])==0)){
+                        continue;
+                    }
+                    if(pass==1){
+                        for(a=0;a<3;a++){
+                            dipole_xyz32[a][count]=q[a];
+                            dipole_comp[a][count]=palette[3*(cell-1)+a];
+                        }
+                    }
+                    count++;
+                }
+            }
+        }
+    }
+}
+
+/* run every orientation, orientation_jobs at a time. Returns 0 in each copy (which then carries on through main() in its own folder), and in this process once all of the copies have finished, 1 if they all succeeded or 2 if any failed */
+
+static int run_orientations(void)
+{
+    int n, total, running, jobs, status, failed, a, lo[3], hi[3], size[3], colours, c;
+    unsigned char* occupied;
+    unsigned char palette[3*255];
+    pid_t* child;
+    pid_t done;
+    char folder[100];
+    FILE* in;
+    double start;
+    size_t length;
+
+    total=load_orientations();
+    if(total==0){
+        printf("\n\nError- orientations.txt does not hold any rotations!! \n\n\n");
+        exit(1);
+    }
+    jobs=(orientation_jobs>0) ? orientation_jobs : omp_get_max_threads();
+    jobs=(jobs>total) ? total : jobs;
+
+    /* the original shape, as occupied cells over its bounding box -- read (not written) by every copy. Each cell holds 1 + its entry in palette[], the different sets of compositions in the shape */
+
+    for(a=0;a<3;a++){
+        lo[a]=dipole_xyz32[a][0];
+        hi[a]=dipole_xyz32[a][0];
+    }
+    for(n=0;n<original_N;n++){
+        for(a=0;a<3;a++){
+            lo[a]=(dipole_xyz32[a][n]<lo[a]) ? dipole_xyz32[a][n] : lo[a];
+            hi[a]=(dipole_xyz32[a][n]>hi[a]) ? dipole_xyz32[a][n] : hi[a];
+        }
+    }
+    for(a=0;a<3;a++){
+        size[a]=hi[a]-lo[a]+1;
+    }
+    occupied=(unsigned char*)checked_calloc((size_t)size[0]*size[1]*size[2], 1, "orientations");
+    colours=0;
+    for(n=0;n<original_N;n++){
+        for(c=0;(c<colours)&&((palette[3*c]!=dipole_comp[0][n])||(palette[3*c+1]!=dipole_comp[1][n])||(palette[3*c+2]!=dipole_comp[2][n]));c++){
+        }
+        if(c==colours){
+            if(colours==255){
+                printf("\n\nError- the shape has more than 255 different sets of compositions, which the orientation ensemble cannot carry!! \n\n\n");
+                exit(1);
+            }
+            for(a=0;a<3;a++){
+                palette[3*c+a]=dipole_comp[a][n];
+            }
+            colours++;
+        }
+        occupied[((size_t)(dipole_xyz32[0][n]-lo[0])*size[1]+dipole_xyz32[1][n]-lo[1])*size[2]+dipole_xyz32[2][n]-lo[2]]=(unsigned char)(c+1);
+    }
+
+    /* keep the header of shape.dat for the copies */
+
+    orientation_header=NULL;
+    if((voxel_spacing<=0)&&((in=open_shape_file())!=NULL)){
+        orientation_header=(char*)checked_calloc(1, 1, "orientations");
+        length=0;
+        while(fgets(buf, LINE_LENGTH, in)!=NULL){
+            orientation_header=(char*)checked_realloc(orientation_header, length+strlen(buf)+1, "orientations");
+            strcpy(orientation_header+length, buf);
+            length=length+strlen(buf);
+            if((strstr(buf,"JA")!=NULL)&&(strstr(buf,"IX")!=NULL)&&(strstr(buf,"IY")!=NULL)&&(strstr(buf,"IZ")!=NULL)){
+                break;
+            }
+        }
+        fclose(in);
+    }
+
+    printf("\n\n Orientation ensemble: %d orientations, %d at a time (%d threads each).\n", total, jobs, (omp_get_max_threads()/jobs>0) ? omp_get_max_threads()/jobs : 1);
+    fflush(stdout);
+
+    start=omp_get_wtime();
+    child=(pid_t*)checked_calloc(total, sizeof(pid_t), "orientations");
+    running=0;
+    failed=0;
+    for(n=0;n<=total;n++){
+        while((running==jobs)||((n==total)&&(running>0))){ //wait for a copy to finish
+            done=wait(&status);
+            for(a=0;(a<total)&&(child[a]!=done);a++){
+            }
+            running--;
+            if(!WIFEXITED(status)||(WEXITSTATUS(status)!=0)){
+                failed++;
+            }
+            printf("\n \t orientation_%03d %s (%.1f s)", a+1, (WIFEXITED(status)&&(WEXITSTATUS(status)==0)) ? "done" : "FAILED -- see its spherify_log.txt", omp_get_wtime()-start);
+            fflush(stdout);
+        }
+        if(n==total){
+            break;
+        }
+
+        snprintf(folder, sizeof(folder), "orientation_%03d", n+1);
+        mkdir(folder, 0777);
+        child[n]=fork();
+        if(child[n]==0){ /* this copy: rotate, then carry on in the folder */
+            if((chdir(folder)!=0)||(freopen("spherify_log.txt", "w", stdout)==NULL)){
+                exit(1);
+            }
+            omp_set_num_threads((omp_get_max_threads()/jobs>0) ? omp_get_max_threads()/jobs : 1);
+            printf("\n Orientation %d of %d: rotation matrix (%g %g %g / %g %g %g / %g %g %g)\n", n+1, total, orientation_matrices[9*n], orientation_matrices[9*n+1], orientation_matrices[9*n+2], orientation_matrices[9*n+3], orientation_matrices[9*n+4], orientation_matrices[9*n+5], orientation_matrices[9*n+6], orientation_matrices[9*n+7], orientation_matrices[9*n+8]);
+            rotate_dipoles(orientation_matrices+9*n, occupied, palette, lo, size);
+            printf("\n %d dipoles after rotating onto the lattice.", original_N);
+            free((void*)occupied);
+            free((void*)child);
+            return 0;
+        }
+        if(child[n]<0){
+            printf("\n\nError- could not start orientation %d!! \n\n\n", n+1);
+            failed++;
+            continue;
+        }
+        running++;
+    }
+
+    printf("\n\n Orientation ensemble complete: %d of %d orientations saved (orientation_001/shape2.dat ...) in %.1f s.\n\n", total-failed, total, omp_get_wtime()-start);
+    free((void*)occupied);
+    free((void*)child);
+    free((void*)orientation_matrices);
+    free((void*)orientation_header);
+    free(dipole_table);
+    return (failed>0) ? 2 : 1;
+}
+
+/* the header for shape2.dat: copied from shape.dat (see main()), or made up if the shape came from a mesh */
+
+static FILE* open_header(void)
+{
+    FILE* header;
+
+    if(voxel_spacing>0){
+        return voxel_header();
+    }
+    if(orientation_header!=NULL){ //(an orientation copy -- shape.dat is in the folder above)
+        header=tmpfile();
+        fputs(orientation_header, header);
+        rewind(header);
+        return header;
+    }
+    return open_shape_file();
+}
+
+/* MPI: the length of this process's part of original.txt (or of high_res.txt, refined = 1) -- a line "x, y, z" for each dipole in its slab, and the final row from the last process -- counted before it is written (see open_part()) */
+
+static long long stag_part_bytes(int refined)
+{
+    int px, py, n, z, dim, count;
+    int* runs;
+    long long bytes, dipoles;
+
+    dim=(refined==1) ? new_lattice_dim : original_lattice_dim;
+    runs=(int*)checked_malloc((2*dim+2)*sizeof(int), "output");
+    bytes=0;
+    dipoles=0;
+    for(px=(refined+1)*slab_begin;px<(refined+1)*slab_end;px++){
+        for(py=0;py<dim;py++){
+            count=(refined==1) ? refined_row(px, py, runs) : original_row(px, py, runs);
+            for(n=0;n<count;n++){
+                for(z=runs[2*n];z<runs[2*n+1];z++){
+                    bytes=bytes+text_digits(px)+text_digits(py)+text_digits(z)+5;
+                }
+                dipoles=dipoles+runs[2*n+1]-runs[2*n];
+            }
+        }
+    }
+    free((void*)runs);
+
+    dipoles=global_count(dipoles, NULL);
+    if(mpi_rank==mpi_size-1){
+        bytes=bytes+text_digits(dim)+text_digits(dipoles)+text_digits(dim)+5;
+    }
+    return bytes;
+}
+
+/* SHAPE WRITERS: the new shape can be saved in several formats at once (see output_formats) -- every file is opened before the grid is read out, and each dipole is written to all of them in the same pass over the grid */
+
+#define FORMAT_DDSCAT 1
+#define FORMAT_ADDA 2
+#define FORMAT_RAW 4
+
+typedef struct {
+    FILE* dat;   //shape2.dat: DDSCAT format
+    FILE* geom;  //shape2.geom: ADDA format
+    FILE* raw;   //shape2.raw: the x, y and z of each dipole as little-endian 32-bit integers, with no header
+    char name[3][110]; //(the file names: stem.dat, stem.geom and stem.raw)
+    long long bytes[3]; //MPI: the length of this process's part of each file, without the headers (see writers_count())
+} shape_writers;
+
+/* copy the header of shape.dat, with the new NAT, to out -- and return how long it is (out = NULL just counts it) */
+
+static long long copy_header(FILE* out, long long dipoles)
+{
+    FILE* infile;
+    long long bytes;
+    char line[64];
+
+    infile=open_header();
+    bytes=0;
+
+    /* duplicate the information from the header of the DDSCAT file */
+
+    while (fgets(buf,LINE_LENGTH, infile)!=NULL){
+
+        if(strstr(buf,"NAT") != NULL){ //check if "NAT" is in the string for this line
+            snprintf(line, sizeof(line), "   %lld   = NAT\n", dipoles); // is so, print a special line for the new dipole number
+            bytes=bytes+strlen(line);
+            if(out!=NULL){
+                fputs(line, out);
+            }
+        }
+        else if(strstr(buf,"JA") != NULL){
+            if(strstr(buf,"IX") != NULL){       //check if the current line contains the strings "JA", "IX", "IY" and "IZ" (seperately in case the spacing is changed by the user).
+                if(strstr(buf,"IY") != NULL){
+                    if(strstr(buf,"IZ") != NULL){
+                        bytes=bytes+strlen(buf);
+                        if(out!=NULL){
+                            fputs(buf, out); //print this final line and then...
+                        }
+                        break;		// ...we have finished the header section -- exit the loop to start writing data
+                    }
+                }
+            }
+        }
+        else{
+            bytes=bytes+strlen(buf);
+            if(out!=NULL){
+                fputs(buf, out); //otherwise, copy and paste the line exactly "as is" from the old file to the new one
+            }
+        }
+    }
+    fclose(infile);
+    return bytes;
+}
+
+/* open the chosen files -- stem.dat, stem.geom and stem.raw -- and write their headers (the DDSCAT header is copied from shape.dat, with the new NAT) */
+
+static void writers_open(shape_writers* w, long long dipoles, const char* stem)
+{
+    char line[200];
+    long long header;
+
+    w->dat=NULL;
+    w->geom=NULL;
+    w->raw=NULL;
+    snprintf(w->name[0], sizeof(w->name[0]), "%s.dat", stem);
+    snprintf(w->name[1], sizeof(w->name[1]), "%s.geom", stem);
+    snprintf(w->name[2], sizeof(w->name[2]), "%s.raw", stem);
+
+    if((output_formats&FORMAT_DDSCAT)!=0){
+        header=(mpi_rank==0) ? copy_header(NULL, dipoles) : 0; //(in an MPI run, the header is part of the first process's part of the file)
+        w->dat=open_part(w->name[0], header+w->bytes[0]);
+        if(mpi_rank==0){
+            copy_header(w->dat, dipoles);
+        }
+    }
+
+    if((output_formats&FORMAT_ADDA)!=0){
+        line[0]='\0';
+        if(mpi_rank==0){
+            snprintf(line, sizeof(line), "#%s: made by spherify from shape.dat, %lld dipoles\n", w->name[1], dipoles);
+            if(geom_materials==1){
+                snprintf(line+strlen(line), sizeof(line)-strlen(line), "Nmat=%d\n", material_count); //(material numbers run from 1 to Nmat: the ICOMPX values in shape.dat, in order)
+            }
+        }
+        w->geom=open_part(w->name[1], (long long)strlen(line)+w->bytes[1]);
+        fputs(line, w->geom);
+    }
+
+    if((output_formats&FORMAT_RAW)!=0){
+        w->raw=open_part(w->name[2], w->bytes[2]);
+    }
+}
+
+/* MPI: add the length of what writers_dipole() will write for this dipole to the length of this process's part of each file -- every dipole is counted like this before writers_open() (see open_part()) */
+
+static void writers_count(shape_writers* w, long long n, double x, double y, double z, const unsigned char* comp)
+{
+    int a, width;
+    double value[3];
+
+    value[0]=x;
+    value[1]=y;
+    value[2]=z;
+    if((output_formats&FORMAT_DDSCAT)!=0){
+        width=text_digits(n);
+        w->bytes[0]=w->bytes[0]+((width>10) ? width : 10)+3*10+6+1; //JA, the three composition columns, the spaces between the columns, and the end of the line...
+        for(a=0;a<3;a++){
+            width=text_digits((long long)value[a]);
+            w->bytes[0]=w->bytes[0]+((width>10) ? width : 10); //...and x, y and z
+        }
+    }
+    if((output_formats&FORMAT_ADDA)!=0){
+        w->bytes[1]=w->bytes[1]+text_digits((long long)x)+text_digits((long long)y)+text_digits((long long)z)+3;
+        if(geom_materials==1){
+            w->bytes[1]=w->bytes[1]+1+text_digits(material_number[comp[0]]);
+        }
+    }
+    w->bytes[2]=w->bytes[2]+12;
+}
+
+/* save dipole number n, at x, y, z (in the same "centred" coordinates as shape2.dat), made of materials comp[] (see dipole_material()), to every open file */
+
+static void writers_dipole(shape_writers* w, long long n, double x, double y, double z, const unsigned char* comp)
+{
+    unsigned char bytes[12];
+    int a;
+    unsigned int value[3];
+
+    if(w->dat!=NULL){
+        fprintf(w->dat,"%10lld %10.0f %10.0f %10.0f %10d %10d %10d\n", n, x, y, z, comp[0], comp[1], comp[2]); //(JA needs more than 10 digits above 10^10 dipoles -- the columns then shift, but stay separated by spaces)
+    }
+    if(w->geom!=NULL){
+        if(geom_materials==1){
+            fprintf(w->geom, "%.0f %.0f %.0f %d\n", x, y, z, material_number[comp[0]]);
+        }
+        else{
+            fprintf(w->geom, "%.0f %.0f %.0f\n", x, y, z);
+        }
+    }
+    if(w->raw!=NULL){
+        value[0]=(unsigned int)(int)x;
+        value[1]=(unsigned int)(int)y;
+        value[2]=(unsigned int)(int)z;
+        for(a=0;a<3;a++){
+            bytes[4*a]=value[a]&255; //(little-endian, whatever this computer uses)
+            bytes[4*a+1]=(value[a]>>8)&255;
+            bytes[4*a+2]=(value[a]>>16)&255;
+            bytes[4*a+3]=(value[a]>>24)&255;
+        }
+        fwrite(bytes, 1, 12, w->raw);
+    }
+}
+
+static void writers_close(shape_writers* w)
+{
+    if(w->dat!=NULL){
+        close_part(w->dat, w->name[0]);
+    }
+    if(w->geom!=NULL){
+        close_part(w->geom, w->name[1]);
+    }
+    if(w->raw!=NULL){
+        close_part(w->raw, w->name[2]);
+    }
+}
+
+/* SAME-RESOLUTION SMOOTHING: each pass runs the three sweeps on the original grid (with the run-length kernel), then votes each new 2x2x2 block back down into the cell it came from -- the cell is kept if at least smooth_vote of its 8 new cells are dipoles. The corners are rounded off as usual, but the grid stays the same size, so NAT stays close to that of shape.dat. Passes can be repeated to smooth the shape further
+
+RESOLUTION LADDER: the same particle at several dipole spacings, for convergence studies. Finer rungs are made by running the sweeps again on the last rung (2x, 4x ...), and coarser ones by voting each 2x2x2 block of the last rung down into one cell (1/2x, 1/4x ...) -- all from the one copy of shape.dat, as grids of runs */
+
+typedef struct {
+    int dim;            //the grid is dim x dim x dim
+    size_t* row_start;  //the runs of row x-y are stored as (start z, end z) pairs in runs[row_start[x*dim+y]] -> runs[row_start[x*dim+y+1]-1], as for the original grid in the run-length engine
+    int* runs;
+    long long cells;    //number of dipoles
+} run_grid;
+
+/* vote 4 rows of 2x2 blocks (rows[dx][dy]) down into one row of a grid half the size. Cell z counts towards cell z/2, so the vote can only change where a run starts or ends -- only those cells are checked. Returns the number of runs saved in voted[] */
+
+static int vote_row(int* rows[2][2], int row_count[2][2], int dim, int* candidates, int* voted)
+{
+    int dx, dy, n, z, votes, candidate_count, run_total, inside;
+    int first[2][2];
+
+    candidate_count=0;
+    candidates[candidate_count++]=0;
+    for(dx=0;dx<2;dx++){
+        for(dy=0;dy<2;dy++){
+            first[dx][dy]=0;
+            for(n=0;n<2*row_count[dx][dy];n++){
+                z=rows[dx][dy][n];
+                if(z/2<dim){
+                    candidates[candidate_count++]=z/2;
+                }
+                if((z%2==1)&&(z/2+1<dim)){
+                    candidates[candidate_count++]=z/2+1; //(a run starting or ending half way through a block changes the vote of the next cell as well)
+                }
+            }
+        }
+    }
+    qsort(candidates, candidate_count, sizeof(int), compare_ints);
+
+    run_total=0;
+    inside=0;
+    for(n=0;n<candidate_count;n++){
+        if((n>0)&&(candidates[n]==candidates[n-1])){
+            continue;
+        }
+        z=candidates[n];
+
+        votes=0;
+        for(dx=0;dx<2;dx++){
+            for(dy=0;dy<2;dy++){
+                while((first[dx][dy]<row_count[dx][dy])&&(rows[dx][dy][2*first[dx][dy]+1]<=2*z)){
+                    first[dx][dy]++; //(this run ends before the block, so cannot count towards any later cell either)
+                }
+                votes=votes+run_occupied(rows[dx][dy], row_count[dx][dy], first[dx][dy], 2*z)+run_occupied(rows[dx][dy], row_count[dx][dy], first[dx][dy], 2*z+1);
+            }
+        }
+
+        /* the vote stays the same up to the next candidate */
+        if((votes>=smooth_vote)&&(inside==0)){
+            voted[2*run_total]=z;
+            inside=1;
+        }
+        else if((votes<smooth_vote)&&(inside==1)){
+            voted[2*run_total+1]=z;
+            run_total++;
+            inside=0;
+        }
+    }
+    if(inside==1){
+        voted[2*run_total+1]=dim;
+        run_total++;
+    }
+    return run_total;
+}
+
+/* add a row of n runs onto the end of plane buffer p. Until the whole grid is done, each plane is kept as (2n, runs...) for each of its rows in turn */
+
+static void plane_append(int** p, size_t* size, size_t* capacity, int* runs, int n)
+{
+    if(*size+2*n+1>*capacity){
+        *capacity=2*(*capacity)+2*n+1;
+        *p=(int*)checked_realloc(*p, *capacity*sizeof(int), "grid (runs)");
+    }
+    (*p)[(*size)++]=2*n;
+    memcpy(*p+*size, runs, 2*n*sizeof(int));
+    *size=*size+2*n;
+}
+
+/* join the planes (g->dim of them, each of g->dim rows) into one grid of runs, freeing them as it goes */
+
+static void join_planes(run_grid* g, int** plane_runs, size_t* plane_size)
+{
+    int x;
+    size_t r, p, row;
+
+    r=0;
+    for(x=0;x<g->dim;x++){
+        r=r+plane_size[x]-g->dim; //(minus the row lengths)
+    }
+    g->row_start=(size_t*)checked_malloc(((size_t)g->dim*g->dim+1)*sizeof(size_t), "grid (runs)");
+    g->runs=(int*)checked_malloc((r+1)*sizeof(int), "grid (runs)");
+
+    r=0;
+    for(x=0;x<g->dim;x++){
+        p=0;
+        for(row=(size_t)x*g->dim;row<(size_t)(x+1)*g->dim;row++){
+            g->row_start[row]=r;
+            memcpy(g->runs+r, plane_runs[x]+p+1, plane_runs[x][p]*sizeof(int));
+            r=r+plane_runs[x][p];
+            p=p+plane_runs[x][p]+1;
+        }
+        free((void*)plane_runs[x]);
+    }
+    g->row_start[(size_t)g->dim*g->dim]=r;
+
+    free((void*)plane_runs);
+    free((void*)plane_size);
+}
+
+/* one smoothing pass: replaces the runs of the original grid with the voted ones, and returns the new number of dipoles */
+
+static long long smooth_pass(void)
+{
+    int px;
+    size_t* plane_size;
+    int** plane_runs;
+    run_grid smoothed;
+
+    plane_runs=(int**)checked_calloc(original_lattice_dim, sizeof(int*), "smoothed grid");
+    plane_size=(size_t*)checked_calloc(original_lattice_dim, sizeof(size_t), "smoothed grid");
+    smoothed.dim=original_lattice_dim;
+    smoothed.cells=0;
+
+    #pragma omp parallel
+    {
+        int py, dx, dy, n, voted_count;
+        size_t capacity;
+        long long total;
+        int* events;
+        int* candidates;
+        int* voted;
+        int* new_row[2][2];
+        int new_row_count[2][2];
+
+        events=(int*)checked_malloc((54*original_lattice_dim+1)*sizeof(int), "smoothing buffers");
+        candidates=(int*)checked_malloc((16*new_lattice_dim+17)*sizeof(int), "smoothing buffers");
+        voted=(int*)checked_malloc((2*original_lattice_dim+2)*sizeof(int), "smoothing buffers");
+        for(dx=0;dx<2;dx++){
+            for(dy=0;dy<2;dy++){
+                new_row[dx][dy]=(int*)checked_malloc((2*new_lattice_dim+2)*sizeof(int), "smoothing buffers");
+            }
+        }
+        total=0;
+
+        #pragma omp for schedule(dynamic, 1)
+        for(px=0;px<original_lattice_dim;px++){
+            capacity=0;
+            for(py=0;py<original_lattice_dim;py++){
+                refine_row_runs(px, py, events, new_row, new_row_count);
+                voted_count=vote_row(new_row, new_row_count, original_lattice_dim, candidates, voted);
+                plane_append(&plane_runs[px], &plane_size[px], &capacity, voted, voted_count);
+                for(n=0;n<voted_count;n++){
+                    total=total+voted[2*n+1]-voted[2*n];
+                }
+            }
+        }
+
+        #pragma omp atomic
+        smoothed.cells+=total;
+
+        free((void*)events);
+        free((void*)candidates);
+        free((void*)voted);
+        for(dx=0;dx<2;dx++){
+            for(dy=0;dy<2;dy++){
+                free((void*)new_row[dx][dy]);
+            }
+        }
+    }
+
+    join_planes(&smoothed, plane_runs, plane_size);
+    free((void*)original_row_start);
+    free((void*)original_runs);
+    original_row_start=smoothed.row_start;
+    original_runs=smoothed.runs;
+    return smoothed.cells;
+}
+
+/* run the three sweeps on grid g (with the run-length kernel), making grid h at twice the resolution */
+
+static void refine_grid(run_grid* g, run_grid* h)
+{
+    int px, saved_dim;
+    size_t* saved_row_start;
+    int* saved_runs;
+    size_t* plane_size;
+    int** plane_runs;
+
+    /* refine_row_runs() works on the original grid -- point it at g for now */
+    saved_dim=original_lattice_dim;
+    saved_row_start=original_row_start;
+    saved_runs=original_runs;
+    original_lattice_dim=g->dim;
+    original_row_start=g->row_start;
+    original_runs=g->runs;
+    new_lattice_dim=2*g->dim;
+
+    h->dim=new_lattice_dim;
+    h->cells=0;
+    plane_runs=(int**)checked_calloc(h->dim, sizeof(int*), "refined grid");
+    plane_size=(size_t*)checked_calloc(h->dim, sizeof(size_t), "refined grid");
+
+    #pragma omp parallel
+    {
+        int py, dx, dy, n;
+        size_t capacity[2];
+        long long total;
+        int* events;
+        int* new_row[2][2];
+        int new_row_count[2][2];
+
+        events=(int*)checked_malloc((54*original_lattice_dim+1)*sizeof(int), "refining buffers");
+        for(dx=0;dx<2;dx++){
+            for(dy=0;dy<2;dy++){
+                new_row[dx][dy]=(int*)checked_malloc((2*new_lattice_dim+2)*sizeof(int), "refining buffers");
+            }
+        }
+        total=0;
+
+        #pragma omp for schedule(dynamic, 1)
+        for(px=0;px<original_lattice_dim;px++){
+            capacity[0]=0;
+            capacity[1]=0;
+            for(py=0;py<original_lattice_dim;py++){
+                refine_row_runs(px, py, events, new_row, new_row_count);
+                for(dx=0;dx<2;dx++){
+                    for(dy=0;dy<2;dy++){
+                        plane_append(&plane_runs[2*px+dx], &plane_size[2*px+dx], &capacity[dx], new_row[dx][dy], new_row_count[dx][dy]); //(row 2py+dy of plane 2px+dx)
+                        for(n=0;n<new_row_count[dx][dy];n++){
+                            total=total+new_row[dx][dy][2*n+1]-new_row[dx][dy][2*n];
+                        }
+                    }
+                }
+            }
         }
-    }
 
-    /* initially, set values at all positions to 0 */
+        #pragma omp atomic
+        h->cells+=total;
 
-    for(x=0;x<original_lattice_dim;x++){
-        for(y=0;y<original_lattice_dim;y++){
-            for(z=0;z<original_lattice_dim;z++){
-                original_grid[x][y][z]=0; //set values at all positions to 0
+        free((void*)events);
+        for(dx=0;dx<2;dx++){
+            for(dy=0;dy<2;dy++){
+                free((void*)new_row[dx][dy]);
             }
         }
     }
 
-    /* then go through list of dipoles, saving their x-y-z coords, and adjust the value or in the original_grid array to 1 if there is a dipole at this position */
+    join_planes(h, plane_runs, plane_size);
 
-    for(i=0;i<original_N;i++){
-        x=STAG_dipole_positions[i][0];
-        y=STAG_dipole_positions[i][1];
-        z=STAG_dipole_positions[i][2];
+    original_lattice_dim=saved_dim;
+    original_row_start=saved_row_start;
+    original_runs=saved_runs;
+    new_lattice_dim=2*original_lattice_dim;
+}
 
-        //printf("\n x=%d y= %d z= %d",x,y,z);
-        original_grid[x][y][z]=1; //set the value at this position to 1
-    }
+/* vote each 2x2x2 block of grid g down into one cell of grid h, at half the resolution -- a cell is kept if at least smooth_vote of the 8 cells in its block are dipoles */
 
-   /*for(x=0;x<original_lattice_dim;x++){
-        for(y=0;y<original_lattice_dim;y++){
-            for(z=0;z<original_lattice_dim;z++){
-                printf("\n ALTERED GRID: %d", original_grid[x][y][z]);
+static void coarsen_grid(run_grid* g, run_grid* h)
+{
+    int px;
+    size_t* plane_size;
+    int** plane_runs;
+
+    h->dim=(g->dim+1)/2; //(the last block is cut short by the edge of g when g->dim is odd)
+    h->cells=0;
+    plane_runs=(int**)checked_calloc(h->dim, sizeof(int*), "coarse grid");
+    plane_size=(size_t*)checked_calloc(h->dim, sizeof(size_t), "coarse grid");
+
+    #pragma omp parallel
+    {
+        int py, dx, dy, n, voted_count;
+        size_t r, capacity;
+        long long total;
+        int* candidates;
+        int* voted;
+        int* rows[2][2];
+        int row_count[2][2];
+
+        candidates=(int*)checked_malloc((8*g->dim+9)*sizeof(int), "coarsening buffers");
+        voted=(int*)checked_malloc((2*h->dim+2)*sizeof(int), "coarsening buffers");
+        total=0;
+
+        #pragma omp for schedule(dynamic, 1)
+        for(px=0;px<h->dim;px++){
+            capacity=0;
+            for(py=0;py<h->dim;py++){
+                for(dx=0;dx<2;dx++){
+                    for(dy=0;dy<2;dy++){
+                        rows[dx][dy]=NULL;
+                        row_count[dx][dy]=0;
+                        if((2*px+dx<g->dim)&&(2*py+dy<g->dim)){
+                            r=(size_t)(2*px+dx)*g->dim+(2*py+dy);
+                            rows[dx][dy]=g->runs+g->row_start[r];
+                            row_count[dx][dy]=(g->row_start[r+1]-g->row_start[r])/2;
+                        }
+                    }
+                }
+                voted_count=vote_row(rows, row_count, h->dim, candidates, voted);
+                plane_append(&plane_runs[px], &plane_size[px], &capacity, voted, voted_count);
+                for(n=0;n<voted_count;n++){
+                    total=total+voted[2*n+1]-voted[2*n];
+                }
             }
         }
-    }*/
 
-    printf(" Translation complete. (%d x %d x %d) grid created. \n\n", original_lattice_dim, original_lattice_dim, original_lattice_dim);
+        #pragma omp atomic
+        h->cells+=total;
 
-    /* save original resolution output to STAG_spherify data file (to visualise it in 3D) */
-    printf(" Exporting original data to S.T.A.G...");
+        free((void*)candidates);
+        free((void*)voted);
+    }
 
-    original_grid_outfile=fopen("original.txt","w"); //open file for saving dipole positions
+    join_planes(h, plane_runs, plane_size);
+}
 
-    dipole_count=0;
-    for(x=0;x<original_lattice_dim;x++){
-        for(y=0;y<original_lattice_dim;y++){
-            for(z=0;z<original_lattice_dim;z++){
-                if(original_grid[x][y][z]==1){
-                    fprintf(original_grid_outfile,"%d, %d, %d\n", x,y,z); //save x-y-z coords of any dipoles that have values > 0. Any dipoles will have values == 1 at this stage.
-                    dipole_count++; //keep track of how many dipoles we are recording
+/* save grid g, at scale times the original resolution, as stem.dat etc. (see output_formats). The dipoles are put back in their "centred" positions, with the offset scaled to match (and less shift, for a grid with shift empty cells added around it) */
+
+static void save_grid(run_grid* g, double scale, int shift, const char* stem)
+{
+    long long n;
+    size_t r, m;
+    shape_writers writers;
+
+    memset(&writers, 0, sizeof(writers));
+    writers_open(&writers, g->cells, stem);
+    n=0;
+    for(x=0;x<g->dim;x++){
+        for(y=0;y<g->dim;y++){
+            r=(size_t)x*g->dim+y;
+            for(m=g->row_start[r];m<g->row_start[r+1];m=m+2){
+                for(z=g->runs[m];z<g->runs[m+1];z++){
+                    n++;
+                    writers_dipole(&writers, n, floor(x-shift-scale*STAG_offset[0]), floor(y-shift-scale*STAG_offset[1]), floor(z-shift-scale*STAG_offset[2]), dipole_material((int)floor((x-shift)/scale), (int)floor((y-shift)/scale), (int)floor((z-shift)/scale)));
                 }
             }
         }
     }
+    writers_close(&writers);
+}
 
-    /* The final row is extra data needed for the python visulisation S.T.A.G program, NOT a dipole! */
-    fprintf(original_grid_outfile,"%d, %d, %d\n", original_lattice_dim, dipole_count, original_lattice_dim); //the final row contains the number of dipoles, the grid size, and a random number just to keep the shape of three columns for python to read */
-    fclose(original_grid_outfile);
+/* the original grid, as a grid of runs (any repeated dipoles in shape.dat are only counted once) */
 
-    printf(" Export complete.\n");
+static void original_run_grid(run_grid* g)
+{
+    size_t r;
+
+    build_original_runs(0);
+    g->dim=original_lattice_dim;
+    g->row_start=original_row_start;
+    g->runs=original_runs;
+    g->cells=0;
+    for(r=0;r<original_row_start[(size_t)original_lattice_dim*original_lattice_dim];r=r+2){
+        g->cells=g->cells+original_runs[r+1]-original_runs[r];
+    }
+}
 
-    /* initialise new 3D grid at higher resolution */
+static void smooth_mode(void)
+{
+    int pass;
+    long long before, after;
+    double start;
+    run_grid smoothed;
+
+    new_lattice_dim=2*original_lattice_dim;
+    original_run_grid(&smoothed);
+    before=smoothed.cells;
+
+    printf("\n\n Smoothing at the original resolution: %d pass%s, keeping a cell if at least %d of its 8 new cells are dipoles.\n", smooth_iterations, (smooth_iterations==1) ? "" : "es", smooth_vote);
+    printf("\n \t pass      dipoles    change     time (s)");
+    printf("\n \t    0 %12lld", before);
+    after=before;
+    for(pass=1;pass<=smooth_iterations;pass++){
+        start=omp_get_wtime();
+        after=smooth_pass();
+        printf("\n \t %4d %12lld  %+7.2f%%   %10.4f", pass, after, 100.0*(after-before)/(before>0 ? before : 1), omp_get_wtime()-start);
+    }
 
-    new_lattice_dim= 2*original_lattice_dim; // new grid resolution will be twice as large
+    /* save the smoothed shape (as shape2.dat etc.), at the same resolution (and in the same place) as shape.dat */
 
-    new_grid = (int***)malloc(new_lattice_dim*sizeof(int**));
-    for (i=0;i<new_lattice_dim;i++) {
-        new_grid[i] = (int**)malloc(new_lattice_dim*sizeof(int*));
-        for (j=0;j<new_lattice_dim;j++) {
-          new_grid[i][j] = (int*)malloc(new_lattice_dim*sizeof(int));
-        }
-    }
+    printf("\n\n Exporting the smoothed shape... ");
+    smoothed.row_start=original_row_start;
+    smoothed.runs=original_runs;
+    smoothed.cells=after;
+    save_grid(&smoothed, 1.0, 0, "shape2"); //(the offset is not doubled -- the grid is the same size)
+    printf("Done!\n\n Exported data for %lld dipoles (%d in shape.dat).\n\n", after, original_N);
 
-    //set all values == 0
+    free((void*)original_row_start);
+    free((void*)original_runs);
+}
 
-    for(x=0;x<new_lattice_dim;x++){
-        for(y=0;y<new_lattice_dim;y++){
-            for(z=0;z<new_lattice_dim;z++){
-                new_grid[x][y][z]=0;
+/* ROUNDING ENGINE: an opening (erode, then dilate) or closing (dilate, then erode) of the lattice by a sphere of radius rounding_radius, instead of spherify's one-cell rules -- so facets, edges and dents of any size up to the radius are rounded off in a single step. Each erosion or dilation is an exact Euclidean distance transform of the lattice (squared distances, in cells), worked out one axis at a time: along z, then y, then x, each as the lower envelope of parabolas along every line of the grid (linear in the length of the line). The lines of each axis are shared between threads */
+
+#define EDT_FAR 2147483647 //(no feature cell on the line, or further than any distance in the grid)
+
+/* squared distance transform along one line of n cells: f[] holds the squared distance of each cell found so far (0 for a feature cell, EDT_FAR for none), and d[] gets the new squared distances. v[] and zb[] are space for n parabolas */
+
+static void edt_line(const int* f, int n, int* d, int* v, double* zb)
+{
+    int q, j, k;
+    long long distance;
+    double s;
+
+    k=-1;
+    s=0.0;
+    for(q=0;q<n;q++){
+        if(f[q]==EDT_FAR){
+            continue;
+        }
+        while(k>=0){
+            s=((f[q]+(double)q*q)-(f[v[k]]+(double)v[k]*v[k]))/(2.0*(q-v[k])); //where the parabola from q overtakes the one from v[k]
+            if(s<=zb[k]){
+                k--; //(the parabola from v[k] is never the lowest)
+            }
+            else{
+                break;
             }
         }
+        k++;
+        v[k]=q;
+        zb[k]=(k==0) ? -HUGE_VAL : s;
     }
 
-    printf("\n New high-resolution grid initialised (%d x %d x %d).\n\n", new_lattice_dim, new_lattice_dim, new_lattice_dim);
-
-    /* search through y-z slices along the x-axis */
+    if(k<0){
+        for(q=0;q<n;q++){
+            d[q]=EDT_FAR;
+        }
+        return;
+    }
+    j=0;
+    for(q=0;q<n;q++){
+        while((j<k)&&(zb[j+1]<q)){
+            j++;
+        }
+        distance=(long long)(q-v[j])*(q-v[j])+f[v[j]];
+        d[q]=(distance<EDT_FAR) ? (int)distance : EDT_FAR;
+    }
+}
 
-    for(x=0;x<original_lattice_dim;x++){
-        for(y=0;y<original_lattice_dim;y++){
-            for(z=0;z<original_lattice_dim;z++){
+/* erode (dilate = 0) or dilate (dilate = 1) the lattice in grid[] (dim^3 cells, 1 = dipole) by a sphere of squared radius r2. The squared distance of every cell to the nearest empty cell (erosion) or dipole (dilation) is worked out in grid[] itself, which is then set back to 0 or 1 */
 
-                // edge definitions
-                // original_grid[x][y][z+1] == right
-                // original_grid[x][y][z-1] == left
-                // original_grid[x][y+1][z] == top
-                // original_grid[x][y-1][z] == bottom
+static void edt_morphology(int* grid, int dim, int dilate, long long r2)
+{
+    int axis;
+    size_t c, cells, stride[3];
 
-                edgecase=0;
+    cells=(size_t)dim*dim*dim;
+    stride[0]=(size_t)dim*dim;
+    stride[1]=dim;
+    stride[2]=1;
 
-                /* check if there are only two occupied edges, and define which type of shape they are in */
+    #pragma omp parallel for
+    for(c=0;c<cells;c++){
+        grid[c]=(grid[c]==dilate) ? 0 : EDT_FAR; //(the feature cells: empty cells for an erosion, dipoles for a dilation)
+    }
 
-                //edge case 1: bottom-left
+    for(axis=2;axis>=0;axis--){
+        size_t line;
+
+        #pragma omp parallel
+        {
+            int n, a, b;
+            size_t first, step[2];
+            int* f;
+            int* d;
+            int* v;
+            double* zb;
+
+            f=(int*)checked_malloc(dim*sizeof(int), "rounding buffers");
+            d=(int*)checked_malloc(dim*sizeof(int), "rounding buffers");
+            v=(int*)checked_malloc(dim*sizeof(int), "rounding buffers");
+            zb=(double*)checked_malloc((dim+1)*sizeof(double), "rounding buffers");
+            step[0]=stride[(axis+1)%3]; //(the two axes across the lines)
+            step[1]=stride[(axis+2)%3];
+
+            #pragma omp for schedule(static)
+            for(line=0;line<(size_t)dim*dim;line++){
+                a=(int)(line/dim);
+                b=(int)(line%dim);
+                first=a*step[0]+b*step[1];
+                for(n=0;n<dim;n++){
+                    f[n]=grid[first+n*stride[axis]];
+                }
+                edt_line(f, dim, d, v, zb);
+                for(n=0;n<dim;n++){
+                    grid[first+n*stride[axis]]=d[n];
+                }
+            }
 
-                if((z>0)&&(y>0)&&((original_grid[x][y][z-1]==1)&&(original_grid[x][y-1][z]==1))&&((z==(original_lattice_dim-1))||(original_grid[x][y][z+1]==0))&&((y==(original_lattice_dim-1))||(original_grid[x][y+1][z]==0))){ // LOGIC: Only check this edge if z and y are > 0 (if z and y are not in the bottom row/column). Check if bottom and left edges are occupied (==1). Finally, seperately check that the other two edges are either the boundaries of the grid (in the far-right column or top row of the grid for this case) or unoccupied (==0).
+            free((void*)f);
+            free((void*)d);
+            free((void*)v);
+            free((void*)zb);
+        }
+    }
 
-                    if(diagnostics==1){
-                        printf("\n %d %d %d   Edge case 1 found.", x, y, z);
-                    }
-                    //rule 1
-                    if(original_grid[x][y][z]==0){ //if cell is unoccupied
-                        new_grid[2*x][2*y][2*z]=3; //follow rule 1 for edge case 1
-                        new_grid[2*x+1][2*y][2*z]=3; // repeat for new x-position (because we double the resolution, there are two x-positions to apply this rule to!)
-                        edgecase=1; //set switch to state that an "edge case has been assigned"
-                    }
+    #pragma omp parallel for
+    for(c=0;c<cells;c++){
+        if(dilate==1){
+            grid[c]=((long long)grid[c]<=r2) ? 1 : 0; //a dipole within the radius
+        }
+        else{
+            grid[c]=((long long)grid[c]>r2) ? 1 : 0; //no empty cell within the radius
+        }
+    }
+}
 
-                    //rule 2
-                    if((original_grid[x][y][z]==1)&&((y==(original_lattice_dim-1))||(z==0)||(original_grid[x][y+1][z-1]==0))&&((y==0)||(z==(original_lattice_dim-1))||(original_grid[x][y-1][z+1]==0))){ //if cell is occupied, and both cells along the diagonal are also unoccupied (if either is occupied, we ignore rule 2 -- see 08/08/22). The code snippets like: "y==(N-1))||(z==0)||" are to check if we are at the edge of the grid -- if so, we don't want to check the next cell because we will be going out of bounds of our matrix, so we exit the statement. But as a whole, "((y==(N-1))||(z==0)||(original_grid[x][y+1][z-1]==0))" just checks "Is the North-West cell empty?"
-                        new_grid[2*x][2*y][2*z]++; //inner edge
-                        new_grid[2*x][2*y+1][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x][2*y+1][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x][2*y][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-
-                        //repeat for 2x+1 positions (doubled-resolution in x-y-z causes 1 cube -> 8 cubes)
-                        new_grid[2*x+1][2*y][2*z]++; //inner edge
-                        new_grid[2*x+1][2*y+1][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y+1][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        edgecase=1; //set switch to state that an "edge case has been assigned"
-                    }
+/* round grid g off (rounding = 1: opening, 2: closing), making grid h with pad empty cells added around every side */
 
+static void round_grid(run_grid* g, run_grid* h, int pad)
+{
+    int px;
+    long long r2;
+    size_t* plane_size;
+    int** plane_runs;
+    int* grid;
+
+    h->dim=g->dim+2*pad;
+    h->cells=0;
+    grid=(int*)checked_malloc((size_t)h->dim*h->dim*h->dim*sizeof(int), "rounding grid");
+    r2=(long long)floor(rounding_radius*rounding_radius+1e-9);
+
+    #pragma omp parallel for
+    for(px=0;px<h->dim;px++){
+        int py, z;
+        size_t r, m, row;
+
+        memset(grid+(size_t)px*h->dim*h->dim, 0, (size_t)h->dim*h->dim*sizeof(int));
+        if((px<pad)||(px>=g->dim+pad)){
+            continue;
+        }
+        for(py=0;py<g->dim;py++){
+            r=(size_t)(px-pad)*g->dim+py;
+            row=((size_t)px*h->dim+py+pad)*h->dim+pad;
+            for(m=g->row_start[r];m<g->row_start[r+1];m=m+2){
+                for(z=g->runs[m];z<g->runs[m+1];z++){
+                    grid[row+z]=1;
                 }
+            }
+        }
+    }
 
-                //edge case 2: top-left
-
-                else if((z>0)&&(y<(original_lattice_dim-1))&&((original_grid[x][y+1][z]==1)&&(original_grid[x][y][z-1]==1))&&((y==0)||(original_grid[x][y-1][z]==0))&&((z==(original_lattice_dim-1))||(original_grid[x][y][z+1]==0))){ // check if left and top edges are occupied (and check that the other two edges are unoccupied). Only check this edge if z>0 and y<new_lattice_dim (check z is not in first column and y is not in the top row).
-
-                    if(diagnostics==1){
-                        printf("\n %d %d %d   Edge case 2 found.", x, y, z);
+    edt_morphology(grid, h->dim, (rounding==1) ? 0 : 1, r2);
+    edt_morphology(grid, h->dim, (rounding==1) ? 1 : 0, r2);
+
+    /* back to runs */
+    plane_runs=(int**)checked_calloc(h->dim, sizeof(int*), "rounded grid");
+    plane_size=(size_t*)checked_calloc(h->dim, sizeof(size_t), "rounded grid");
+
+    #pragma omp parallel
+    {
+        int py, z, n;
+        size_t capacity, row;
+        long long total;
+        int* runs;
+
+        runs=(int*)checked_malloc((2*h->dim+2)*sizeof(int), "rounded grid");
+        total=0;
+
+        #pragma omp for schedule(dynamic, 1)
+        for(px=0;px<h->dim;px++){
+            capacity=0;
+            for(py=0;py<h->dim;py++){
+                row=((size_t)px*h->dim+py)*h->dim;
+                n=0;
+                for(z=0;z<h->dim;z++){
+                    if((grid[row+z]==1)&&((z==0)||(grid[row+z-1]==0))){
+                        runs[2*n]=z;
                     }
-                    //rule 1
-                    if(original_grid[x][y][z]==0){ //if cell is unoccupied
-                        new_grid[2*x][2*y+1][2*z]=3; //follow rule 1 for edge case 2
-                        new_grid[2*x+1][2*y+1][2*z]=3; // repeat for new x-position (because we double the resolution, there are two x-positions to apply this rule to!)
-                        edgecase=1; //set switch to state that an "edge case has been assigned"
-                    }
-
-                    //rule 2
-                    if((original_grid[x][y][z]==1)&&((y==(original_lattice_dim-1))||(z==(original_lattice_dim-1))||(original_grid[x][y+1][z+1]==0))&&((y==0)||(z==0)||(original_grid[x][y-1][z-1]==0))){ //if cell is occupied, and both cells along the diagonal are also unoccupied (if either is occupied, we ignore rule 2 -- see 08/08/22). The code snippets like: "y==(N-1))||(z==0)||" are to check if we are at the edge of the grid -- if so, we don't want to check the next cell because we will be going out of bounds of our matrix, so we exit the statement. But as a whole, "((y==(N-1))||(z==0)||(original_grid[x][y+1][z-1]==0))" just checks "Is the North-West cell empty?"
-                        new_grid[2*x][2*y][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x][2*y+1][2*z]++; //inner edge
-                        new_grid[2*x][2*y+1][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x][2*y][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-
-                        //repeat for 2x+1 positions (doubled-resolution in x-y-z causes 1 cube -> 8 cubes)
-                        new_grid[2*x+1][2*y][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y+1][2*z]++; //inner edge
-                        new_grid[2*x+1][2*y+1][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        edgecase=1; //set switch to state that an "edge case has been assigned"
+                    if((grid[row+z]==1)&&((z==h->dim-1)||(grid[row+z+1]==0))){
+                        runs[2*n+1]=z+1;
+                        total=total+runs[2*n+1]-runs[2*n];
+                        n++;
                     }
                 }
+                plane_append(&plane_runs[px], &plane_size[px], &capacity, runs, n);
+            }
+        }
 
-                //edge case 3: top-right
+        #pragma omp atomic
+        h->cells+=total;
 
-                else if((z<(original_lattice_dim-1))&&(y<(original_lattice_dim-1))&&((original_grid[x][y][z+1]==1)&&(original_grid[x][y+1][z]==1))&&((z==0)||(original_grid[x][y][z-1]==0))&&((y==0)||(original_grid[x][y-1][z]==0))){ // check if top and right edges are occupied (and check that the other two edges are unoccupied). Only check this edge if z and y < new_lattice_dim (check z and y are not in the top row/column).
+        free((void*)runs);
+    }
 
-                    if(diagnostics==1){
-                        printf("\n %d %d %d   Edge case 3 found.", x, y, z);
-                    }
-                    //rule 1
-                    if(original_grid[x][y][z]==0){ //if cell is unoccupied
-                        new_grid[2*x][2*y+1][2*z+1]=3; //follow rule 1 for edge case 3
-                        new_grid[2*x+1][2*y+1][2*z+1]=3; // repeat for new x-position (because we double the resolution, there are two x-positions to apply this rule to!)
-                        edgecase=1; //set switch to state that an "edge case has been assigned"
-                    }
+    free((void*)grid);
+    join_planes(h, plane_runs, plane_size);
+}
 
-                    //rule 2
-                    if((original_grid[x][y][z]==1)&&((y==(original_lattice_dim-1))||(z==0)||(original_grid[x][y+1][z-1]==0))&&((y==0)||(z==(original_lattice_dim-1))||(original_grid[x][y-1][z+1]==0))){ //if cell is occupied, and both cells along the diagonal are also unoccupied (if either is occupied, we ignore rule 2 -- see 08/08/22). The code snippets like: "y==(N-1))||(z==0)||" are to check if we are at the edge of the grid -- if so, we don't want to check the next cell because we will be going out of bounds of our matrix, so we exit the statement. But as a whole, "((y==(N-1))||(z==0)||(original_grid[x][y+1][z-1]==0))" just checks "Is the North-West cell empty?"
-                        new_grid[2*x][2*y][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x][2*y+1][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x][2*y+1][2*z+1]++; //inner edge
-                        new_grid[2*x][2*y][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-
-                        //repeat for 2x+1 positions (doubled-resolution in x-y-z causes 1 cube -> 8 cubes)
-                        new_grid[2*x+1][2*y][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y+1][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y+1][2*z+1]++; //inner edge
-                        new_grid[2*x+1][2*y][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        edgecase=1; //set switch to state that an "edge case has been assigned"
-                    }
-                }
+static void rounding_mode(void)
+{
+    int pad;
+    double scale, start;
+    run_grid shape, refined, rounded;
+
+    start=omp_get_wtime();
+    original_run_grid(&shape);
+    scale=1.0;
+    printf("\n\n Rounding engine: %s by a sphere of radius %g cells, at %s resolution.\n", (rounding==1) ? "opening" : "closing", rounding_radius, (rounding_resolution==2) ? "the refined" : "the original");
+    printf("\n \t %lld dipoles in shape.dat", shape.cells);
+    if(rounding_resolution==2){
+        new_lattice_dim=2*original_lattice_dim;
+        refine_grid(&shape, &refined);
+        free((void*)shape.row_start);
+        free((void*)shape.runs);
+        shape=refined;
+        scale=2.0;
+        printf(", %lld after spherify", shape.cells);
+    }
 
-                //edge case 4: bottom-right
+    pad=(rounding==2) ? (int)ceil(rounding_radius)+1 : 1; //(a closing grows the shape by up to the radius before shrinking it back -- it must not reach the edge of the grid)
+    printf(" (%d x %d x %d distance grid, %.1f MB)... ", shape.dim+2*pad, shape.dim+2*pad, shape.dim+2*pad, pow(shape.dim+2*pad, 3.0)*sizeof(int)/1048576.0);
+    fflush(stdout);
+    round_grid(&shape, &rounded, pad);
+    printf("%lld dipoles after rounding (%.4f s).\n", rounded.cells, omp_get_wtime()-start);
+    free((void*)shape.row_start);
+    free((void*)shape.runs);
+
+    printf("\n Exporting the rounded shape... ");
+    save_grid(&rounded, scale, pad, "shape2");
+    printf("Done!\n\n Exported data for %lld dipoles.\n\n", rounded.cells);
+    free((void*)rounded.row_start);
+    free((void*)rounded.runs);
+}
 
-                else if((z<(original_lattice_dim-1))&&(y>0)&&((original_grid[x][y-1][z]==1)&&(original_grid[x][y][z+1]==1))&&((y==(original_lattice_dim-1))||(original_grid[x][y+1][z]==0))&&((z==0)||(original_grid[x][y][z-1]==0))){ // check if right and bottom edges are occupied (and check that the other two edges are unoccupied). Only check this edge if y>0 and z<new_lattice_dim (check y is not in first row z is not in the final column). Finally, this code "((y==(N-1))||(original_grid[x][y+1][z]==0))" checks if the edges are the boundaries of the grid (and so are also unuccupied), or whether the next cell is there but unoccupied.
+static void ladder_mode(void)
+{
+    int rung, level, rungs;
+    double scale, start;
+    char stem[100];
+    run_grid original, current, next;
+    run_grid* rung_grid;
+    double* rung_seconds;
+    FILE* summary;
+
+    rungs=ladder_coarse+ladder_fine+1;
+    rung_grid=(run_grid*)checked_calloc(rungs, sizeof(run_grid), "resolution ladder"); //(only the sizes are kept -- each grid is freed once the next rung has been made from it)
+    rung_seconds=(double*)checked_calloc(rungs, sizeof(double), "resolution ladder");
+
+    printf("\n\n Resolution ladder: %d coarser and %d finer rung%s. Coarse cells are kept if at least %d of the 8 cells in their block are dipoles.\n\n", ladder_coarse, ladder_fine, (ladder_fine==1) ? "" : "s", smooth_vote);
+
+    start=omp_get_wtime();
+    original_run_grid(&original);
+    save_grid(&original, 1.0, 0, "shape_1x");
+    rung_grid[ladder_coarse]=original;
+    rung_seconds[ladder_coarse]=omp_get_wtime()-start;
+
+    /* coarser rungs, each from the one before */
+    current=original;
+    scale=1.0;
+    for(level=1;level<=ladder_coarse;level++){
+        start=omp_get_wtime();
+        scale=scale/2.0;
+        coarsen_grid(&current, &next);
+        snprintf(stem, sizeof(stem), "shape_%gx", scale);
+        save_grid(&next, scale, 0, stem);
+        if(level>1){
+            free((void*)current.row_start);
+            free((void*)current.runs);
+        }
+        current=next;
+        rung_grid[ladder_coarse-level]=next;
+        rung_seconds[ladder_coarse-level]=omp_get_wtime()-start;
+    }
+    if(ladder_coarse>0){
+        free((void*)current.row_start);
+        free((void*)current.runs);
+    }
 
-                    if(diagnostics==1){
-                        printf("\n %d %d %d   Edge case 4 found.", x, y, z);
-                    }
-                    //rule 1
-                    if(original_grid[x][y][z]==0){ //if cell is unoccupied
-                        new_grid[2*x][2*y][2*z+1]=3; //follow rule 1 for edge case 4
-                        new_grid[2*x+1][2*y][2*z+1]=3; // repeat for new x-position (because we double the resolution, there are two x-positions to apply this rule to!)
-                        edgecase=1; //set switch to state that an "edge case has been assigned"
-                    }
+    /* finer rungs, each spherified from the one before */
+    current=original;
+    scale=1.0;
+    for(level=1;level<=ladder_fine;level++){
+        start=omp_get_wtime();
+        scale=scale*2.0;
+        refine_grid(&current, &next);
+        snprintf(stem, sizeof(stem), "shape_%gx", scale);
+        save_grid(&next, scale, 0, stem);
+        if(level>1){
+            free((void*)current.row_start);
+            free((void*)current.runs);
+        }
+        current=next;
+        rung_grid[ladder_coarse+level]=next;
+        rung_seconds[ladder_coarse+level]=omp_get_wtime()-start;
+    }
+    if(ladder_fine>0){
+        free((void*)current.row_start);
+        free((void*)current.runs);
+    }
+    free((void*)original.row_start);
+    free((void*)original.runs);
+
+    /* dipole-count summary, printed and saved as ladder.txt. The spacing d and a_eff (the radius of a sphere of the same volume) are in units of the spacing of shape.dat */
+
+    summary=fopen("ladder.txt", "w");
+    printf("\n \t        file   spacing (d)        grid            NAT    a_eff (d)    time (s)");
+    fprintf(summary, "#file spacing(d) grid NAT a_eff(d)\n");
+    scale=pow(0.5, ladder_coarse);
+    for(rung=0;rung<rungs;rung++){
+        snprintf(stem, sizeof(stem), "shape_%gx", scale);
+        printf("\n \t %11s  %12g   %9d   %12lld   %10.4f  %10.4f", stem, 1.0/scale, rung_grid[rung].dim, rung_grid[rung].cells, cbrt(3.0*rung_grid[rung].cells/(4.0*M_PI))/scale, rung_seconds[rung]);
+        fprintf(summary, "%s.dat %g %d %lld %.6f\n", stem, 1.0/scale, rung_grid[rung].dim, rung_grid[rung].cells, cbrt(3.0*rung_grid[rung].cells/(4.0*M_PI))/scale);
+        scale=scale*2.0;
+    }
+    fclose(summary);
+    printf("\n\n Saved %d rungs (dipole counts in ladder.txt).\n\n", rungs);
 
-                    //rule 2
-                    if((original_grid[x][y][z]==1)&&((y==(original_lattice_dim-1))||(z==(original_lattice_dim-1))||(original_grid[x][y+1][z+1]==0))&&((y==0)||(z==0)||(original_grid[x][y-1][z-1]==0))){ //if cell is occupied, and both cells along the diagonal are also unoccupied (if either is occupied, we ignore rule 2 -- see 08/08/22). The code snippets like: "y==(N-1))||(z==0)||" are to check if we are at the edge of the grid -- if so, we don't want to check the next cell because we will be going out of bounds of our matrix, so we exit the statement. But as a whole, "((y==(N-1))||(z==0)||(original_grid[x][y+1][z-1]==0))" just checks "Is the North-West cell empty?"
-                        new_grid[2*x][2*y][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x][2*y+1][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x][2*y+1][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x][2*y][2*z+1]++; //inner edge
-
-                        //repeat for 2x+1 positions (doubled-resolution in x-y-z causes 1 cube -> 8 cubes)
-                        new_grid[2*x+1][2*y][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y+1][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y+1][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y][2*z+1]++; //inner edge
-                        edgecase=1; //set switch to state that an "edge case has been assigned"
-                    }
-                }
+    free((void*)rung_grid);
+    free((void*)rung_seconds);
+}
 
-                //if none of the edge cases are satisfied (or if an edge was found, but the checks for RULE 2 failed, leaving edgecase==0 still), fill the new grid with 1's if occupied
-                if((edgecase==0)&&(original_grid[x][y][z]==1)){
-                    if(diagnostics==1){
-                        printf("\n %d %d %d   No edge case found, filling with 1's.", x, y, z);
-                    }
-                    new_grid[2*x][2*y][2*z]++;
-                    new_grid[2*x][2*y+1][2*z]++;
-                    new_grid[2*x][2*y+1][2*z+1]++;
-                    new_grid[2*x][2*y][2*z+1]++;
-
-                    new_grid[2*x+1][2*y][2*z]++;       // 1 dipole in original grid -> 8 dipoles in new grid
-                    new_grid[2*x+1][2*y+1][2*z]++;
-                    new_grid[2*x+1][2*y+1][2*z+1]++;
-                    new_grid[2*x+1][2*y][2*z+1]++;
-                }
-                //or 0's if unoccupied
-                else if(edgecase==0){
-                    if(diagnostics==1){
-                        printf("\n %d %d %d   No edge case found, filling with 0's.", x, y, z);
-                    }
-                    new_grid[2*x][2*y][2*z]--;
-                    new_grid[2*x][2*y+1][2*z]--;
-                    new_grid[2*x][2*y+1][2*z+1]--;
-                    new_grid[2*x][2*y][2*z+1]--;
+/* TRACE QUERY (trace_query = 1): read back trace.bin (and trace_1.bin ... from an MPI run), print each record with a cell inside the box trace_low -> trace_high whose decisions match trace_rule, and count the matching cells by sweep and decision. Only the sweeps of a record that match are counted: a record can hold the decisions of one sweep (the dense engine saves one record per sweep) or of all three, so counting the others as well would count a cell again for every sweep that didn't match */
 
-                    new_grid[2*x+1][2*y][2*z]--;       // 1 dipole in original grid -> 8 dipoles in new grid
-                    new_grid[2*x+1][2*y+1][2*z]--;
-                    new_grid[2*x+1][2*y+1][2*z+1]--;
-                    new_grid[2*x+1][2*y][2*z+1]--;
-                }
+static const char* trace_decision(int field)
+{
+    static const char* outcome[5]={"-", "fill 0's", "fill 1's", "rule 1", "rule 2"};
+    static char text[4][40];
+    static int next=0;
+    char* t;
 
-            }
-        }
+    if((field>>3)==0){
+        return outcome[field&7];
     }
+    t=text[next];
+    next=(next+1)%4; //(called up to three times in one printf)
+    snprintf(t, sizeof(text[0]), "edge %d, %s", field>>3, outcome[field&7]);
+    return t;
+}
 
-    /* diagnostics - print original grid to screen (only for small grid sizes that will display in the console) */
+static int trace_matches(int field)
+{
+    if(field==0){
+        return 0; //this sweep isn't part of the record
+    }
+    if(trace_rule==0){
+        return 1;
+    }
+    if(trace_rule<=4){
+        return (field>>3)==trace_rule;
+    }
+    if(trace_rule==5){
+        return (field&7)==TRACE_RULE_1;
+    }
+    if(trace_rule==6){
+        return (field&7)==TRACE_RULE_2;
+    }
+    if(trace_rule==7){
+        return ((field>>3)!=0)&&((field&7)==TRACE_FILL_1); //edge case found, but rule 2 didn't apply
+    }
+    return field==TRACE_FILL_1;
+}
 
-    if(diagnostics==1){
-        printf ("\n\n --------------------- Original grid ---------------------\n");
-        for(x=0;x<original_lattice_dim;x++){
-            printf("\n  y-z slice at x = %d    \n", x);
-            printf("\n        Coordinates                                 Values                                       xyz coords  \n\n");
-            for(y=(original_lattice_dim-1);y>(-1);y--){
-                for(z=0;z<original_lattice_dim;z++){
-                    printf("   %d-%d   ", y,z); //print coord positions
-                }
-                printf("                  ");
-                for(z=0;z<original_lattice_dim;z++){
-                    printf("   %d   ", original_grid[x][y][z]); //print values at these coords
-                }
-                printf("                  ");
-                for(z=0;z<original_lattice_dim;z++){
-                    printf("   %d %d %d   ", x,y,z); //print values at these coords
-                }
-                printf("\n\n");
+static int query_trace(void)
+{
+    char name[32], magic[4];
+    int rank, header[4], s, field, match, z0, z1;
+    long long records, r, shown;
+    long long cells[3][5];
+    trace_record* block;
+    size_t n, b;
+    FILE* trace;
+    static const char* sweep_name[3]={"y-z", "z-x", "x-y"};
+    static const char* row_name[5]={"fill 0's", "fill 1's", "rule 1", "rule 2", "edge case, no rule"};
+
+    memset(cells, 0, sizeof(cells));
+    block=(trace_record*)checked_malloc(TRACE_BUFFER*sizeof(trace_record), "trace query");
+    shown=0;
+
+    printf("\n Decisions in x %d-%d, y %d-%d, z %d-%d", trace_low[0], trace_high[0], trace_low[1], trace_high[1], trace_low[2], trace_high[2]);
+    if(trace_rule>0){
+        printf(" (trace_rule = %d only)", trace_rule);
+    }
+    printf(":\n\n      x      y      z  cells        y-z sweep                z-x sweep                x-y sweep\n");
+
+    for(rank=0;;rank++){
+        trace_name(name, sizeof(name), rank);
+        trace=fopen(name, "rb");
+        if(trace==NULL){
+            if(rank==0){
+                printf("\n\nError- could not open trace.bin -- save one first with trace_output = 1!! \n\n\n");
+                free((void*)block);
+                return 1;
             }
-            printf("\n\n\n\n");
+            break;
+        }
+        if((fread(magic, 1, 4, trace)!=4)||(memcmp(magic, "SPTR", 4)!=0)||(fread(header, sizeof(int), 4, trace)!=4)||(header[0]!=1)||(fread(&records, sizeof(long long), 1, trace)!=1)){
+            printf("\n\nError- %s is not a decision trace saved by this version of spherify!! \n\n\n", name);
+            fclose(trace);
+            free((void*)block);
+            return 1;
         }
 
-        printf ("\n\n --------------------- New grid ---------------------\n");
-        for(x=0;x<new_lattice_dim;x++){
-            printf("\n  y-z slice at x = %d    \n", x);
-            printf("\n                       Coordinates                                                       Values                                                            xyz coords \n\n");
-            for(y=(new_lattice_dim-1);y>(-1);y--){
-                for(z=0;z<new_lattice_dim;z++){
-                    printf("   %d-%d   ", y,z); //print coord positions
-                }
-                printf("                  ");
-                for(z=0;z<new_lattice_dim;z++){
-                    printf("   %d   ", new_grid[x][y][z]); //print values at these coords
+        for(r=0;r<records;r=r+n){
+            n=fread(block, sizeof(trace_record), TRACE_BUFFER, trace);
+            if(n==0){
+                printf("\n (%s stops after %lld of %lld records)\n", name, r, records);
+                break;
+            }
+            for(b=0;b<n;b++){
+                if((block[b].x<trace_low[0])||(block[b].x>trace_high[0])||(block[b].y<trace_low[1])||(block[b].y>trace_high[1])){
+                    continue;
                 }
-                printf("                  ");
-                for(z=0;z<new_lattice_dim;z++){
-                    printf("   %d %d %d   ", x,y,z); //print values at these coords
+                z0=(block[b].z>trace_low[2]) ? block[b].z : trace_low[2]; //the part of this record's cells inside the box
+                z1=(block[b].z+block[b].length-1<trace_high[2]) ? block[b].z+block[b].length-1 : trace_high[2];
+                if(z0>z1){
+                    continue;
                 }
-                printf("\n\n");
-            }
-            printf("\n\n\n\n");
-        }
 
+                match=0;
+                for(s=0;s<3;s++){
+                    match=match|trace_matches((block[b].code>>(6*s))&63);
+                }
+                if(match==0){
+                    continue;
+                }
 
-        /* save high resolution output to STAG_spherify data file */
-
-        new_grid_outfile=fopen("high_res.txt","w"); //open file for saving dipole positions
-
-        dipole_count=0;
-        for(x=0;x<new_lattice_dim;x++){
-            for(y=0;y<new_lattice_dim;y++){
-                for(z=0;z<new_lattice_dim;z++){
-                    if(new_grid[x][y][z]>0){
-                        fprintf(new_grid_outfile,"%d, %d, %d\n", x,y,z); //save x-y-z coords of any dipoles that have values > 0 (should still be dipoles, on average, after three "sweeps" in the x-,  y- and z- directions)
-                        dipole_count++; //keep track of how many dipoles we are recording
+                printf(" %6d %6d %6d %6d   %-24s %-24s %-24s\n", block[b].x, block[b].y, z0, z1-z0+1, trace_decision(block[b].code&63), trace_decision((block[b].code>>6)&63), trace_decision((block[b].code>>12)&63));
+                shown++;
+                for(s=0;s<3;s++){
+                    field=(block[b].code>>(6*s))&63;
+                    if(trace_matches(field)==0){
+                        continue; //(not part of this record, or filtered out by trace_rule)
+                    }
+                    if(((field>>3)!=0)&&((field&7)==TRACE_FILL_1)){
+                        cells[s][4]=cells[s][4]+z1-z0+1;
+                    }
+                    else{
+                        cells[s][(field&7)-1]=cells[s][(field&7)-1]+z1-z0+1;
                     }
                 }
             }
         }
+        printf("\n (%s: %d x %d x %d grid, engine %d, trace_output = %d, %lld records)\n", name, header[1], header[1], header[1], header[2], header[3], records);
+        fclose(trace);
+    }
 
-        /* The final row is extra data needed for the python visulisation S.T.A.G program, NOT a dipole! */
-        fprintf(new_grid_outfile,"%d, %d, %d\n", new_lattice_dim, dipole_count, new_lattice_dim); //the final row contains the number of dipoles, the grid size, and a random number just to keep the shape of three columns for python to read */
-        fclose(new_grid_outfile);
+    printf("\n %lld records matched. Cells decided in each sweep (matching decisions only):\n\n                      ", shown);
+    for(s=0;s<3;s++){
+        printf("%12s", sweep_name[s]);
+    }
+    for(field=0;field<5;field++){
+        printf("\n %20s ", row_name[field]);
+        for(s=0;s<3;s++){
+            printf("%12lld", cells[s][field]);
+        }
+    }
+    printf("\n\n");
 
-        /* run xSTAG_spherify on each file - views both the original and higher resolution images in 3D */
+    free((void*)block);
+    return 0;
+}
 
-        system("xSTAG_spherify.bat"); //opens a batch file with a command to run STAG_spherify as a python script
-    }
+/* SELF TESTS: each makes up its own shape.dat in a folder of its own, spherifies it as a normal run, and then checks the files saved */
 
+static void write_test_header(FILE* out, const char* title, long long count)
+{
+    fprintf(out, " >spherify %s\n", title);
+    fprintf(out, "   %lld = NAT\n", count);
+    fprintf(out, "  1.000000  0.000000  0.000000 = A_1 vector\n");
+    fprintf(out, "  0.000000  1.000000  0.000000 = A_2 vector\n");
+    fprintf(out, "  1.000000  1.000000  1.000000 = lattice spacings (d_x,d_y,d_z)/d\n");
+    fprintf(out, " -0.50000 -0.50000 -0.50000 = lattice offset x0(1-3) = (x_TF,y_TF,z_TF)/d for dipole 0 0 0\n");
+    fprintf(out, "     JA  IX  IY  IZ ICOMP(x,y,z)\n");
+}
 
+/* MATERIAL TEST: spherify a made-up sphere of two materials -- compositions 1 1 1 where IX < 0, and 3 2 3 elsewhere -- in the folder material_test, then check every dipole of shape2.dat and shape2.geom against it */
 
-    /* search through z-x slices along the y-axis */
+#define MATERIAL_TEST_RADIUS 6
 
-    for(y=0;y<original_lattice_dim;y++){
-        for(z=0;z<original_lattice_dim;z++){
-            for(x=0;x<original_lattice_dim;x++){
+static const unsigned char material_test_comp[2][3]={{1, 1, 1}, {3, 2, 3}};
 
-                // edge definitions
-                // original_grid[x+1][y][z] == right
-                // original_grid[x-1][y][z] == left
-                // original_grid[x][y][z+1] == top
-                // original_grid[x][y][z-1] == bottom
+static int material_test_inside(int x, int y, int z)
+{
+    return x*x+y*y+z*z<=MATERIAL_TEST_RADIUS*MATERIAL_TEST_RADIUS;
+}
 
-                edgecase=0;
+/* write the test shape as material_test/shape.dat, and carry on in that folder, saving shape2.geom with its material column as well */
 
-                /* check if there are only two occupied edges, and define which type of shape they are in */
+static void material_test_shape(void)
+{
+    FILE* out;
+    int x, y, z, count;
 
-                //edge case 1: bottom-left
+    mkdir("material_test", 0777);
+    if((chdir("material_test")!=0)||((out=fopen("shape.dat", "w"))==NULL)){
+        printf("\n\nError- could not make material_test/shape.dat!! \n\n\n");
+        exit(1);
+    }
+    count=0;
+    for(x=-MATERIAL_TEST_RADIUS;x<=MATERIAL_TEST_RADIUS;x++){
+        for(y=-MATERIAL_TEST_RADIUS;y<=MATERIAL_TEST_RADIUS;y++){
+            for(z=-MATERIAL_TEST_RADIUS;z<=MATERIAL_TEST_RADIUS;z++){
+                count=count+material_test_inside(x, y, z);
+            }
+        }
+    }
+    write_test_header(out, "material test: a sphere in two halves", count);
+    count=0;
+    for(x=-MATERIAL_TEST_RADIUS;x<=MATERIAL_TEST_RADIUS;x++){
+        for(y=-MATERIAL_TEST_RADIUS;y<=MATERIAL_TEST_RADIUS;y++){
+            for(z=-MATERIAL_TEST_RADIUS;z<=MATERIAL_TEST_RADIUS;z++){
+                if(material_test_inside(x, y, z)){
+                    count++;
+                    fprintf(out, "%7d %3d %3d %3d %d %d %d\n", count, x, y, z, material_test_comp[x>=0][0], material_test_comp[x>=0][1], material_test_comp[x>=0][2]);
+                }
+            }
+        }
+    }
+    fclose(out);
+    output_formats=FORMAT_DDSCAT|FORMAT_ADDA;
+    geom_materials=1;
+    compress_output=0;
+    printf("\n Material test: spherifying a two-material sphere (%d dipoles) in material_test.\n", count);
+}
 
-                if((z>0)&&(x>0)&&((original_grid[x][y][z-1]==1)&&(original_grid[x-1][y][z]==1))&&((x==(original_lattice_dim-1))||(original_grid[x+1][y][z]==0))&&((z==(original_lattice_dim-1))||(original_grid[x][y][z+1]==0))){ // LOGIC: Only check this edge if z and x are > 0 (if z and x are not in the bottom row/column). Check if bottom and left edges are occupied (==1). Finally, seperately check that the other two edges are either the boundaries of the grid (in the far-right column or top row of the grid for this case) or unoccupied (==0).
+/* read back shape2.dat and shape2.geom: a dipole whose parent (IX/2, IY/2, IZ/2, rounded down) is in the sphere must have the compositions of its parent, and one that spherify added must have those of a dipole next to its parent. The geom column must number the materials 1 and 2 (Nmat=2). Returns 0 if every dipole passes */
 
-                    if(diagnostics==1){
-                        printf("\n %d %d %d   Edge case 1 found.", x, y, z);
-                    }
-                    //rule 1
-                    if(original_grid[x][y][z]==0){ //if cell is unoccupied
-                        new_grid[2*x][2*y][2*z]=3; //follow rule 1 for edge case 1
-                        new_grid[2*x][2*y+1][2*z]=3; // repeat for new y-position (because we double the resolution, there are two y-positions to apply this rule to!)
-                        edgecase=1; //set switch to state that an "edge case has been assigned"
+static int check_material_test(void)
+{
+    FILE* dat;
+    FILE* geom;
+    long long JA, checked, wrong, made[2];
+    int X, Y, Z, gx, gy, gz, comp[3], material, nmat, p[3], side, dx, dy, dz, allowed[2], ok;
+
+    dat=fopen("shape2.dat", "r");
+    geom=fopen("shape2.geom", "r");
+    if((dat==NULL)||(geom==NULL)){
+        printf("\n Material test FAILED: could not open shape2.dat and shape2.geom.\n\n");
+        return 1;
+    }
+    while((fgets(buf, LINE_LENGTH, dat)!=NULL)&&!((strstr(buf,"JA")!=NULL)&&(strstr(buf,"IX")!=NULL))){ //(skip the header)
+    }
+    nmat=0;
+    while((fgets(buf, LINE_LENGTH, geom)!=NULL)&&(buf[0]=='#')){
+    }
+    sscanf(buf, "Nmat=%d", &nmat);
+
+    checked=0;
+    wrong=0;
+    made[0]=0;
+    made[1]=0;
+    while(fscanf(dat, " %lld %d %d %d %d %d %d", &JA, &X, &Y, &Z, &comp[0], &comp[1], &comp[2])==7){
+        ok=(fscanf(geom, " %d %d %d %d", &gx, &gy, &gz, &material)==4)&&(gx==X)&&(gy==Y)&&(gz==Z);
+        p[0]=(int)floor(X/2.0);
+        p[1]=(int)floor(Y/2.0);
+        p[2]=(int)floor(Z/2.0);
+        allowed[0]=0;
+        allowed[1]=0;
+        if(material_test_inside(p[0], p[1], p[2])){
+            allowed[p[0]>=0]=1;
+        }
+        else{
+            for(dx=-1;dx<=1;dx++){
+                for(dy=-1;dy<=1;dy++){
+                    for(dz=-1;dz<=1;dz++){
+                        if(material_test_inside(p[0]+dx, p[1]+dy, p[2]+dz)){
+                            allowed[p[0]+dx>=0]=1;
+                        }
                     }
+                }
+            }
+        }
+        side=-1;
+        for(dx=0;dx<2;dx++){
+            if((comp[0]==material_test_comp[dx][0])&&(comp[1]==material_test_comp[dx][1])&&(comp[2]==material_test_comp[dx][2])){
+                side=dx;
+            }
+        }
+        ok=ok&&(side>=0)&&(allowed[side]==1)&&(material==side+1);
+        if(ok){
+            made[side]++;
+        }
+        else if(wrong<10){
+            printf("\n \t dipole %lld at %d %d %d: compositions %d %d %d, material %d -- wrong", JA, X, Y, Z, comp[0], comp[1], comp[2], material);
+        }
+        wrong=wrong+(ok==0);
+        checked++;
+    }
+    fclose(dat);
+    fclose(geom);
 
-                    //rule 2
-                    if((original_grid[x][y][z]==1)&&((z==(original_lattice_dim-1))||(x==0)||(original_grid[x-1][y][z+1]==0))&&((z==0)||(x==(original_lattice_dim-1))||(original_grid[x+1][y][z-1]==0))){ //if cell is occupied, and both cells along the diagonal are also unoccupied (if either is occupied, we ignore rule 2 -- see 08/08/22). The code snippets like: "y==(N-1))||(z==0)||" are to check if we are at the edge of the grid -- if so, we don't want to check the next cell because we will be going out of bounds of our matrix, so we exit the statement. But as a whole, "((y==(N-1))||(z==0)||(original_grid[x][y+1][z-1]==0))" just checks "Is the North-West cell empty?"
-                        new_grid[2*x][2*y][2*z]++; //inner edge
-                        new_grid[2*x+1][2*y][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x][2*y][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-
-                        //repeat for 2y+1 positions (doubled-resolution in x-y-z causes 1 cube -> 8 cubes)
-                        new_grid[2*x][2*y+1][2*z]++; //inner edge
-                        new_grid[2*x+1][2*y+1][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y+1][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x][2*y+1][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        edgecase=1; //set switch to state that an "edge case has been assigned"
-                    }
+    if((wrong>0)||(nmat!=2)||(made[0]==0)||(made[1]==0)||(checked!=dipole_count)){
+        printf("\n Material test FAILED: %lld of %lld dipoles wrong, Nmat=%d (should be 2).\n\n", wrong, checked, nmat);
+        return 1;
+    }
+    printf(" Material test passed: %lld dipoles checked -- %lld of compositions 1 1 1 (material 1) and %lld of 3 2 3 (material 2), Nmat=2.\n\n", checked, made[0], made[1]);
+    return 0;
+}
 
-                }
+/* LARGE-LATTICE TEST: two small spheres at opposite corners of a grid so big that the new grid has more than 2^31 cells -- spherified with the run-length engine, which never holds a dense grid. Both spheres must come out the same, and shape2.dat must number its dipoles 1 to NAT */
 
-                //edge case 2: top-left
+#define LARGE_TEST_RADIUS 5
+#define LARGE_TEST_GAP 720 //(a (2*(720+2*5+1))^3 = 3.1e9-cell new grid)
 
-                else if((x>0)&&(z<(original_lattice_dim-1))&&((original_grid[x][y][z+1]==1)&&(original_grid[x-1][y][z]==1))&&((z==0)||(original_grid[x][y][z-1]==0))&&((x==(original_lattice_dim-1))||(original_grid[x+1][y][z]==0))){ // check if left and top edges are occupied (and check that the other two edges are unoccupied). Only check this edge if x>0 and z<new_lattice_dim (check x is not in first column and z is not in the top row).
+static void large_test_shape(void)
+{
+    FILE* out;
+    int x, y, z, s, count;
 
-                    if(diagnostics==1){
-                        printf("\n %d %d %d   Edge case 2 found.", x, y, z);
-                    }
-                    //rule 1
-                    if(original_grid[x][y][z]==0){ //if cell is unoccupied
-                        new_grid[2*x][2*y][2*z+1]=3; //follow rule 1 for edge case 2
-                        new_grid[2*x][2*y+1][2*z+1]=3; // repeat for new y-position (because we double the resolution, there are two y-positions to apply this rule to!)
-                        edgecase=1; //set switch to state that an "edge case has been assigned"
+    mkdir("large_test", 0777);
+    if((chdir("large_test")!=0)||((out=fopen("shape.dat", "w"))==NULL)){
+        printf("\n\nError- could not make large_test/shape.dat!! \n\n\n");
+        exit(1);
+    }
+    count=0;
+    for(x=-LARGE_TEST_RADIUS;x<=LARGE_TEST_RADIUS;x++){
+        for(y=-LARGE_TEST_RADIUS;y<=LARGE_TEST_RADIUS;y++){
+            for(z=-LARGE_TEST_RADIUS;z<=LARGE_TEST_RADIUS;z++){
+                count=count+(x*x+y*y+z*z<=LARGE_TEST_RADIUS*LARGE_TEST_RADIUS);
+            }
+        }
+    }
+    write_test_header(out, "large-lattice test: two spheres far apart", 2*(long long)count);
+    count=0;
+    for(s=0;s<2;s++){
+        for(x=-LARGE_TEST_RADIUS;x<=LARGE_TEST_RADIUS;x++){
+            for(y=-LARGE_TEST_RADIUS;y<=LARGE_TEST_RADIUS;y++){
+                for(z=-LARGE_TEST_RADIUS;z<=LARGE_TEST_RADIUS;z++){
+                    if(x*x+y*y+z*z<=LARGE_TEST_RADIUS*LARGE_TEST_RADIUS){
+                        count++;
+                        fprintf(out, "%7d %3d %3d %3d 1 1 1\n", count, x+s*LARGE_TEST_GAP, y+s*LARGE_TEST_GAP, z+s*LARGE_TEST_GAP);
                     }
+                }
+            }
+        }
+    }
+    fclose(out);
+    engine=2;
+    output_formats=FORMAT_DDSCAT;
+    compress_output=0;
+    printf("\n Large-lattice test: spherifying two spheres %d cells apart (%d dipoles) in large_test, with the run-length engine.\n", LARGE_TEST_GAP, count);
+}
+
+/* read back shape2.dat: NAT, the JA numbering and the dipoles of each sphere (the second one is the first moved by 2*LARGE_TEST_GAP along each axis). Returns 0 if they are all right */
+
+static int check_large_test(void)
+{
+    FILE* dat;
+    long long nat, JA, expected, cells, half[2];
+    int X, Y, Z, comp[3], ok;
+
+    cells=(long long)new_lattice_dim*new_lattice_dim*new_lattice_dim;
+    if((dat=fopen("shape2.dat", "r"))==NULL){
+        printf("\n Large-lattice test FAILED: could not open shape2.dat.\n\n");
+        return 1;
+    }
+    nat=-1;
+    while(fgets(buf, LINE_LENGTH, dat)!=NULL){
+        if(strstr(buf,"NAT")!=NULL){
+            sscanf(buf, "%lld", &nat);
+        }
+        if((strstr(buf,"JA")!=NULL)&&(strstr(buf,"IX")!=NULL)){
+            break;
+        }
+    }
 
-                    //rule 2
-                    if((original_grid[x][y][z]==1)&&((z==(original_lattice_dim-1))||(x==(original_lattice_dim-1))||(original_grid[x+1][y][z+1]==0))&&((z==0)||(x==0)||(original_grid[x-1][y][z-1]==0))){ //if cell is occupied, and both cells along the diagonal are also unoccupied (if either is occupied, we ignore rule 2 -- see 08/08/22). The code snippets like: "y==(N-1))||(z==0)||" are to check if we are at the edge of the grid -- if so, we don't want to check the next cell because we will be going out of bounds of our matrix, so we exit the statement. But as a whole, "((y==(N-1))||(z==0)||(original_grid[x][y+1][z-1]==0))" just checks "Is the North-West cell empty?"
-                        new_grid[2*x][2*y][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x][2*y][2*z+1]++; //inner edge
-
-                        //repeat for 2y+1 positions (doubled-resolution in x-y-z causes 1 cube -> 8 cubes)
-                        new_grid[2*x][2*y+1][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y+1][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y+1][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x][2*y+1][2*z+1]++; //inner edge
-                        edgecase=1; //set switch to state that an "edge case has been assigned"
-                    }
-                }
+    ok=1;
+    expected=0;
+    half[0]=0;
+    half[1]=0;
+    while(fscanf(dat, " %lld %d %d %d %d %d %d", &JA, &X, &Y, &Z, &comp[0], &comp[1], &comp[2])==7){
+        expected++;
+        if((JA!=expected)&&(ok==1)){
+            printf("\n \t line %lld of the dipoles has JA = %lld", expected, JA);
+            ok=0;
+        }
+        half[X>=LARGE_TEST_GAP]++; //(the refined coordinates are doubled: the second sphere is around 2*LARGE_TEST_GAP)
+    }
+    fclose(dat);
 
-                //edge case 3: top-right
+    ok=ok&&(cells>2147483648LL)&&(nat==dipole_count)&&(expected==dipole_count)&&(half[0]==half[1])&&(half[0]>0);
+    printf("\n Large-lattice test %s: %d x %d x %d = %lld cells in the new grid (2^31 = 2147483648), %lld dipoles (NAT = %lld, last JA = %lld), %lld and %lld from the two spheres.\n\n", (ok==1) ? "passed" : "FAILED", new_lattice_dim, new_lattice_dim, new_lattice_dim, cells, dipole_count, nat, expected, half[0], half[1]);
+    return (ok==1) ? 0 : 1;
+}
 
-                else if((x<(original_lattice_dim-1))&&(z<(original_lattice_dim-1))&&((original_grid[x][y][z+1]==1)&&(original_grid[x+1][y][z]==1))&&((x==0)||(original_grid[x-1][y][z]==0))&&((z==0)||(original_grid[x][y][z-1]==0))){ // check if top and right edges are occupied (and check that the other two edges are unoccupied). Only check this edge if z and x < new_lattice_dim (check z and x are not in the top row/column).
+int main()
+{
+    shape_writers writers;
+    long long part_bytes;
 
-                    if(diagnostics==1){
-                        printf("\n %d %d %d   Edge case 3 found.", x, y, z);
-                    }
-                    //rule 1
-                    if(original_grid[x][y][z]==0){ //if cell is unoccupied
-                        new_grid[2*x+1][2*y][2*z+1]=3; //follow rule 1 for edge case 3
-                        new_grid[2*x+1][2*y+1][2*z+1]=3; // repeat for new y-position (because we double the resolution, there are two y-positions to apply this rule to!)
-                        edgecase=1; //set switch to state that an "edge case has been assigned"
-                    }
 
-                    //rule 2
-                    if((original_grid[x][y][z]==1)&&((z==(original_lattice_dim-1))||(x==0)||(original_grid[x-1][y][z+1]==0))&&((z==0)||(x==(original_lattice_dim-1))||(original_grid[x+1][y][z-1]==0))){ //if cell is occupied, and both cells along the diagonal are also unoccupied (if either is occupied, we ignore rule 2 -- see 08/08/22). The code snippets like: "y==(N-1))||(z==0)||" are to check if we are at the edge of the grid -- if so, we don't want to check the next cell because we will be going out of bounds of our matrix, so we exit the statement. But as a whole, "((y==(N-1))||(z==0)||(original_grid[x][y+1][z-1]==0))" just checks "Is the North-West cell empty?"
-                        new_grid[2*x][2*y][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y][2*z+1]++; //inner edge
-                        new_grid[2*x][2*y][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-
-                        //repeat for 2y+1 positions (doubled-resolution in x-y-z causes 1 cube -> 8 cubes)
-                        new_grid[2*x][2*y+1][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y+1][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y+1][2*z+1]++; //inner edge
-                        new_grid[2*x][2*y+1][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        edgecase=1; //set switch to state that an "edge case has been assigned"
-                    }
-                }
+    printf("\n\n ---------------------------------------------------------------------------------------------------------------------");
+    printf("\n ---------------------------------------------------------------------------------------------------------------------");
+    printf("\n\n                                                  WELCOME TO SPHERIFY!                            \n\n");
 
-                //edge case 4: bottom-right
 
-                else if((x<(original_lattice_dim-1))&&(z>0)&&((original_grid[x][y][z-1]==1)&&(original_grid[x+1][y][z]==1))&&((z==(original_lattice_dim-1))||(original_grid[x][y][z+1]==0))&&((x==0)||(original_grid[x-1][y][z]==0))){ // check if right and bottom edges are occupied (and check that the other two edges are unoccupied). Only check this edge if y>0 and z<new_lattice_dim (check y is not in first row z is not in the final column). Finally, this code "((y==(N-1))||(original_grid[x][y+1][z]==0))" checks if the edges are the boundaries of the grid (and so are also unuccupied), or whether the next cell is there but unoccupied.
+    printf("\n                  ________________                     __________                          .  =  .                    ");
+    printf("\n                 |                |                   |          |                       '         '                  ");
+    printf("\n                 |                |                  (            )                    /             \\                ");
+    printf("\n                 |                |                 |              |                  |               |               ");
+    printf("\n                 |                |      --->      (                )      --->       |               |               ");
+    printf("\n                 |                |                 |              |                   \\             /                ");
+    printf("\n                 |                |                  (            )                      .         .                  ");
+    printf("\n                 |________________|                   |__________|                         '  =  '                    ");
 
-                    if(diagnostics==1){
-                        printf("\n %d %d %d   Edge case 4 found.", x, y, z);
-                    }
-                    //rule 1
-                    if(original_grid[x][y][z]==0){ //if cell is unoccupied
-                        new_grid[2*x+1][2*y][2*z]=3; //follow rule 1 for edge case 4
-                        new_grid[2*x+1][2*y+1][2*z]=3; // repeat for new y-position (because we double the resolution, there are two y-positions to apply this rule to!)
-                        edgecase=1; //set switch to state that an "edge case has been assigned"
-                    }
 
-                    //rule 2
-                    if((original_grid[x][y][z]==1)&&((z==(original_lattice_dim-1))||(x==(original_lattice_dim-1))||(original_grid[x+1][y][z+1]==0))&&((z==0)||(x==0)||(original_grid[x-1][y][z-1]==0))){ //if cell is occupied, and both cells along the diagonal are also unoccupied (if either is occupied, we ignore rule 2 -- see 08/08/22). The code snippets like: "y==(N-1))||(z==0)||" are to check if we are at the edge of the grid -- if so, we don't want to check the next cell because we will be going out of bounds of our matrix, so we exit the statement. But as a whole, "((y==(N-1))||(z==0)||(original_grid[x][y+1][z-1]==0))" just checks "Is the North-West cell empty?"
-                        new_grid[2*x][2*y][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y][2*z]++; //inner edge
-                        new_grid[2*x+1][2*y][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x][2*y][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-
-                        //repeat for 2y+1 positions (doubled-resolution in x-y-z causes 1 cube -> 8 cubes)
-                        new_grid[2*x][2*y+1][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y+1][2*z]++; //inner edge
-                        new_grid[2*x+1][2*y+1][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x][2*y+1][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        edgecase=1; //set switch to state that an "edge case has been assigned"
-                    }
-                }
 
-                //if none of the edge cases are satisfied fill new grid with 1's if occupied
-                if((edgecase==0)&&(original_grid[x][y][z]==1)){
-                    if(diagnostics==1){
-                        printf("\n %d %d %d   No edge case found, filling with 1's.", x, y, z);
-                    }
-                    new_grid[2*x][2*y][2*z]++;
-                    new_grid[2*x+1][2*y][2*z]++;
-                    new_grid[2*x+1][2*y][2*z+1]++;
-                    new_grid[2*x][2*y][2*z+1]++;
-
-                    new_grid[2*x][2*y+1][2*z]++;       // 1 dipole in original grid -> 8 dipoles in new grid
-                    new_grid[2*x+1][2*y+1][2*z]++;
-                    new_grid[2*x+1][2*y+1][2*z+1]++;
-                    new_grid[2*x][2*y+1][2*z+1]++;
-                }
-                //or 0's if unoccupied
-                else if(edgecase==0){
-                    if(diagnostics==1){
-                        printf("\n %d %d %d   No edge case found, filling with 0's.", x, y, z);
-                    }
-                    new_grid[2*x][2*y][2*z]--;
-                    new_grid[2*x+1][2*y][2*z]--;
-                    new_grid[2*x+1][2*y][2*z+1]--;
-                    new_grid[2*x][2*y][2*z+1]--;
+    printf("\n\n\n ---------------------------------------------------------------------------------------------------------------------");
+    printf("\n ---------------------------------------------------------------------------------------------------------------------\n\n");
 
-                    new_grid[2*x][2*y+1][2*z]--;       // 1 dipole in original grid -> 8 dipoles in new grid
-                    new_grid[2*x+1][2*y+1][2*z]--;
-                    new_grid[2*x+1][2*y+1][2*z+1]--;
-                    new_grid[2*x][2*y+1][2*z+1]--;
-                }
+    diagnostics=0; //set = 1 to print diagnostic statements
+    trace_output=0; //set = 1 to save trace.bin: the decision each sweep made (edge case, rule 1 or 2, or fill) for every cell where an edge case was found, as a few bits per cell -- cheap enough to leave on for large runs, unlike diagnostics. Set = 2 to also keep the cells filled with 1's
+    trace_query=0; //set = 1 to read back trace.bin from an earlier run instead of spherifying: prints the decisions for the cells between trace_low and trace_high that match trace_rule, and counts them by sweep
+    trace_low[0]=0; trace_low[1]=0; trace_low[2]=0; //x, y and z of one corner of the box of original cells trace_query looks at...
+    trace_high[0]=65535; trace_high[1]=65535; trace_high[2]=65535; //...and of the opposite corner (included) -- the whole grid by default
+    trace_rule=0; //decisions trace_query prints: 0 = all, 1-4 = edge case 1-4, 5 = rule 1, 6 = rule 2, 7 = edge case found but neither rule applied, 8 = filled with 1's (no edge case)
+    layout=0; //how the grids are stored in memory for the dense and surface engines: 0 = rows of z-values (the original layout), 1 = 8x8x8 tiles (keeps the neighbours of each cell in the cache for all three sweeps -- faster for large grids)
+    benchmark=0; //set = 1 to time the dense sweeps with both layouts at the end of the run, or = 2 to time them with the grids placed in memory by one thread and by first touch (see first_touch)
+    query_benchmark=0; //set = 1 to test the query API after the sweeps -- query_occupied(), query_row() and query_cells() answer whether cells of the new grid are dipoles straight from the original grid, without building the new grid. Every cell is checked against the new grid, and random queries are timed
+    query_input=0; //set = 1 to answer queries after the sweeps: cells of the new grid (X Y Z, one per line) are read from query.txt -- or from stdin if there is no query.txt -- and printed with 1 if the cell is a dipole, 0 if not (worked out with the query API)
+    count_only=0; //set = 1 to only count how many dipoles spherify would make (fast -- the new grid is never built, and nothing is saved)
+    voxel_spacing=0; //set to a dipole spacing (in the units of the mesh) to build the shape by voxelising a closed triangle mesh, shape.obj or shape.stl, instead of reading shape.dat (0 = read shape.dat)
+    dipole_budget=0; //set to a number of dipoles (NAT) to resample the input shape at the scale that spherifies to as close to this many dipoles as possible -- only that shape is saved (0 = off)
+    connectivity=0; //set = 1 to count the connected pieces of both lattices (spherify can cut thin necks between monomers), or = 2 to also stop before the new shape is saved if the number of pieces has changed
+    smooth_iterations=0; //set to a number of passes to smooth the shape at its own resolution instead of doubling it: each pass runs the three sweeps, then keeps a cell if at least smooth_vote of the 8 cells it became are dipoles. Only shape2.dat is saved, with about as many dipoles as shape.dat (0 = off)
+    smooth_vote=4; //how many of the 8 new cells must be dipoles to keep a cell when smoothing, or when coarsening for the resolution ladder (1-8: lower values grow the shape, higher values shrink it)
+    rounding=0; //set = 1 to round the shape off with an opening by a sphere of radius rounding_radius (cuts away corners, edges and spikes sharper than the sphere), or = 2 with a closing (fills in dents and crevices narrower than it), using exact Euclidean distances instead of spherify's one-cell rules. Only shape2.dat etc. are saved
+    rounding_radius=2.0; //radius of the sphere, in cells of the lattice being rounded
+    rounding_resolution=1; //1 = round the original lattice (shape2.dat has the resolution of shape.dat), 2 = spherify first and round the refined lattice
+    ladder=0; //set = 1 to save the shape at several resolutions for a convergence study: shape_1x.dat as read in, coarser rungs (shape_0.5x.dat ...) made by voting each 2x2x2 block down into one cell, and finer rungs (shape_2x.dat, shape_4x.dat ...) made by running spherify again on the rung before. NAT of each rung is listed in ladder.txt, and nothing else is saved
+    ladder_coarse=1; //number of coarser rungs (halving the resolution each time)
+    ladder_fine=2; //number of finer rungs (doubling the resolution each time)
+    orientations=0; //set = 1 to spherify the shape in many orientations -- one for each line of orientations.txt (three Euler angles in degrees, for rotations about z, then y, then z), or the 24 right-angle rotations of the lattice if there is no orientations.txt. Each orientation is saved in its own folder (orientation_001 ...)
+    orientation_jobs=0; //orientations spherified at the same time (0 = one for each core)
+    batch=0; //set = 1 to spherify every folder listed in manifest.txt (one per line, each holding its own shape.dat) with these settings. Start as many copies of spherify as you like in the same folder -- they share the targets out between them, and batch_journal.txt records each target done, so a batch that was stopped carries on where it left off when started again
+    delta_output=0; //set = 1 to also save delta.bin: only the cells that spherify added or removed, compared with simply doubling the resolution (tiny for smooth particles), or = 2 to rebuild the high-resolution shape from shape.dat and delta.bin instead of running spherify
+    image_output=0; //set = 1 to save pictures of both lattices -- slices across x, y and z, and projections along them showing how thick the particle is -- as PNG files (PGM without zlib). Much quicker to look at than diagnostics, and they work on computers without a display
+    image_slice=0.5; //where the slices are taken, as a fraction of the way across the grid
+    mesh_output=0; //set = 1 to save the surfaces of both lattices as meshes (original.ply and high_res.ply) that any mesh viewer can open -- much faster to view than STAG_spherify.py for large particles
+    statistics=0; //set = 1 to print morphology statistics of both lattices (volume, surface area, radius of gyration, equivalent-volume radius and sphericity), worked out as original.txt and high_res.txt are saved
+    compress_output=0; //set = 1 (fastest) to 9 (smallest) to write shape2.dat, high_res.txt and original.txt gzip-compressed, as .gz files (needs zlib -- see instructions at the top)
+    engine=0; //engine used for the three sweeps: 0 = dense (sweep every cell of the grid), 1 = surface (only sweep cells next to the surface of the particle -- much faster for large, compact particles), 2 = run-length (store both grids as runs of dipoles along z -- much less memory for large, mostly solid particles), 3 = streaming (never store the new grid -- least memory of all)
+    first_touch=1; //set = 1 to zero the dense grids in parallel, each block of planes by the thread that will sweep it, and to store large grids in huge pages where the system allows -- on computers with more than one socket, every thread then sweeps memory next to it. Set = 0 to zero them on one thread
+    output_formats=1; //formats the new shape is saved in, added together: 1 = shape2.dat (DDSCAT), 2 = shape2.geom (ADDA), 4 = shape2.raw (x, y, z of each dipole as little-endian 32-bit integers, for reading straight into other programs). All of them are written in the same pass over the grid, e.g. 3 saves both shape2.dat and shape2.geom
+    geom_materials=0; //set = 1 to add a material column (and an Nmat line) to shape2.geom, from ICOMPX in shape.dat
+    large_test=0; //set = 1 to test a new grid of more than 2^31 cells: spherifies two small made-up spheres far apart (in the folder large_test, instead of shape.dat) with the run-length engine, and checks the dipole count, NAT and JA numbering of shape2.dat
+    material_test=0; //set = 1 to test the composition columns: spherifies a made-up sphere of two materials in the folder material_test (instead of shape.dat), and checks every dipole of shape2.dat and shape2.geom against it
+    memory_limit=0; //memory spherify may use, in MB (0 = all of the physical memory). If the chosen engine would need more, a leaner one is used instead
+
+    mpi_rank=0;
+    mpi_size=1;
+#ifdef USE_MPI
+    start_mpi();
+#endif
+#ifndef USE_ZLIB
+    if(compress_output>0){
+        printf("\n Compiled without zlib -- writing uncompressed files.\n");
+        compress_output=0;
+    }
+#endif
 
-            }
-        }
+    if(trace_query==1){
+        return query_trace();
     }
 
-    if(diagnostics==1){
-        printf ("\n\n --------------------- Original grid ---------------------\n");
-        for(y=0;y<original_lattice_dim;y++){
-            printf("\n  z-x slice at y = %d    \n", y);
-            printf("\n        Coordinates                                 Values                                       xyz coords  \n\n");
-            for(z=(original_lattice_dim-1);z>(-1);z--){
-                for(x=0;x<original_lattice_dim;x++){
-                    printf("   %d-%d   ", z,x); //print coord positions
-                }
-                printf("                  ");
-                for(x=0;x<original_lattice_dim;x++){
-                    printf("   %d   ", original_grid[x][y][z]); //print values at these coords
-                }
-                printf("                  ");
-                for(x=0;x<original_lattice_dim;x++){
-                    printf("   %d %d %d   ", x,y,z); //print values at these coords
-                }
-                printf("\n\n");
-            }
-            printf("\n\n\n\n");
-        }
+    if(material_test==1){
+        material_test_shape();
+    }
+    else if(large_test==1){
+        large_test_shape();
+    }
 
-        printf ("\n\n --------------------- New grid ---------------------\n");
-        for(y=0;y<new_lattice_dim;y++){
-            printf("\n  z-x slice at y = %d    \n", y);
-            printf("\n                       Coordinates                                                       Values                                                            xyz coords \n\n");
-            for(z=(new_lattice_dim-1);z>(-1);z--){
-                for(x=0;x<new_lattice_dim;x++){
-                    printf("   %d-%d   ", z,x); //print coord positions
-                }
-                printf("                  ");
-                for(x=0;x<new_lattice_dim;x++){
-                    printf("   %d   ", new_grid[x][y][z]); //print values at these coords
-                }
-                printf("                  ");
-                for(x=0;x<new_lattice_dim;x++){
-                    printf("   %d %d %d   ", x,y,z); //print values at these coords
-                }
-                printf("\n\n");
-            }
-            printf("\n\n\n\n");
+    if(batch==1){
+        if((k=run_batch())>0){
+            return k-1; //(every target has been spherified by its own copy of spherify)
         }
+    }
 
-        /* save high resolution output to STAG_spherify data file */
+    /* read in the shape -- from shape.dat, or from a triangle mesh */
 
-        new_grid_outfile=fopen("high_res.txt","w"); //open file for saving dipole positions
+    if(((voxel_spacing>0) ? voxelise_mesh() : read_shape_file())==0){
+        return 1;
+    }
 
-        dipole_count=0;
-        for(x=0;x<new_lattice_dim;x++){
-            for(y=0;y<new_lattice_dim;y++){
-                for(z=0;z<new_lattice_dim;z++){
-                    if(new_grid[x][y][z]>0){
-                        fprintf(new_grid_outfile,"%d, %d, %d\n", x,y,z); //save x-y-z coords of any dipoles that have values > 0 (should still be dipoles, on average, after three "sweeps" in the x-,  y- and z- directions)
-                        dipole_count++; //keep track of how many dipoles we are recording
-                    }
-                }
-            }
+    if(orientations==1){
+        if((k=run_orientations())>0){
+            return k-1; //(every orientation has been saved by its own copy of spherify)
         }
+    }
 
-        /* The final row is extra data needed for the python visulisation S.T.A.G program, NOT a dipole! */
-        fprintf(new_grid_outfile,"%d, %d, %d\n", new_lattice_dim, dipole_count, new_lattice_dim); //the final row contains the number of dipoles, the grid size, and a random number just to keep the shape of three columns for python to read */
-        fclose(new_grid_outfile);
+    /* convert dipole positions to STAG grid format -- all need to be > 0 (positive integers)*/
 
-        /* run xSTAG_spherify on each file - views both the original and higher resolution images in 3D */
+    printf(" \n Translating %d dipoles to positive values... ", original_N);
+    /* Search to find the most negative x,y,z points in the dipole positions - in a moment, we will need to translate them again to make them all positive for viewing in S.T.A.G */
+    dipole_bounds();
+    compact_dipole_table();
+    printf("\n Dipole table: %.1f MB (%d-bit coordinates). ", (double)original_N*(3*dipole_bits/8+3)/(1024.0*1024.0), dipole_bits);
 
-        system("xSTAG_spherify.bat"); //opens a batch file with a command to run STAG_spherify as a python script
+    if(dipole_budget>0){
+        dipole_budget_mode(); //rescale the dipoles to get as close to the budget as possible
     }
 
+    place_dipoles();
+#ifdef USE_MPI
+    if(mpi_size>original_lattice_dim){
+        printf("\n\nError- %d processes, but the grid only has %d planes to share between them!! \n\n\n", mpi_size, original_lattice_dim);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+#endif
+    decompose_slabs();
+    materials_init(); //(before the table is trimmed, so that the materials are numbered the same on every process)
+
+    if(rounding>0){
+        rounding_mode();
+        free(dipole_table);
+        free((void*)material_cells);
+        return 0;
+    }
 
+    if(ladder==1){
+        ladder_mode();
+        free(dipole_table);
+        free((void*)material_cells);
+        return 0;
+    }
 
+    if(smooth_iterations>0){
+        smooth_mode();
+        free(dipole_table);
+        free((void*)material_cells);
+        return 0;
+    }
 
+    if(count_only==1){
+        printf("\n\n Count-only pass: %lld dipoles after spherify (%d x %d x %d grid, %d dipoles in).\n\n", count_refined(), 2*original_lattice_dim, 2*original_lattice_dim, 2*original_lattice_dim, original_N);
+        free(dipole_table);
+        free((void*)material_cells);
+#ifdef USE_MPI
+        MPI_Finalize();
+#endif
+        return 0;
+    }
 
-    /* search through x-y slices along the z-axis */
-
-    for(z=0;z<original_lattice_dim;z++){
-        for(x=0;x<original_lattice_dim;x++){
-            for(y=0;y<original_lattice_dim;y++){
-
-                // edge definitions
-                // original_grid[x][y+1][z] == right
-                // original_grid[x][y-1][z] == left
-                // original_grid[x+1][y][z] == top
-                // original_grid[x-1][y][z] == bottom
+    trim_dipole_table(); //(MPI: each process keeps only the dipoles in its own slab)
+    plan_memory(); //(may change engine)
+    if(delta_output==2){
+        engine=4; //rebuild the new grid from delta.bin rather than running the sweeps (the original grid is kept as runs, like the run-length engine)
+    }
 
-                edgecase=0;
+    /* print diagnostics and dipole transformations - two different versions, either for imported coords or sphere-made coords
 
-                /* check if there are only two occupied edges, and define which type of shape they are in */
+    //printf("\n\n\n                 SPHERE POSITION                   LOCATIONS                      TRANSLATED POSITION          FINAL STAG POSITION \n\n");
+    //for(i=0;i<number_of_spheres;i++){
+    //    for(j=0;j<sphere_N;j++){
+    //        //printf(" %4d %4d     %5.2f %5.2f %5.2f       +       %5.2f %5.2f %5.2f     -->           %5.2f %5.2f %5.2f            %5.2f %5.2f %5.2f \n", i, j, sphere_dipole_positions[j][0], sphere_dipole_positions[j][1], sphere_dipole_positions[j][2], sphere_locations[i][0]+sphere_odd_even_offset, sphere_locations[i][1]+sphere_odd_even_offset, sphere_locations[i][2]+sphere_odd_even_offset, dipole_positions[i*sphere_N+j][0], dipole_positions[i*sphere_N+j][1], dipole_positions[i*sphere_N+j][2], STAG_dipole_positions[i*sphere_N+j][0], STAG_dipole_positions[i*sphere_N+j][1], STAG_dipole_positions[i*sphere_N+j][2]);
+    //    }
+    //}
 
-                //edge case 1: bottom-left
+    printf("\n\n\n             IMPORTED POSITION      ( + %.1f %.1f %.1f )       FINAL STAG POSITION \n\n", STAG_offset[0], STAG_offset[1], STAG_offset[2]);
+    for(i=0;i<original_N;i++){
+        printf(" %4d      %6d %6d %6d             -->              %6d %6d %6d            \n", i, dipole_position(i, 0), dipole_position(i, 1), dipole_position(i, 2), dipole_cell(i, 0), dipole_cell(i, 1), dipole_cell(i, 2));
+    }
 
-                if((x>0)&&(y>0)&&((original_grid[x-1][y][z]==1)&&(original_grid[x][y-1][z]==1))&&((x==(original_lattice_dim-1))||(original_grid[x+1][y][1]==0))&&((y==(original_lattice_dim-1))||(original_grid[x][y+1][z]==0))){ // LOGIC: Only check this edge if x and y are > 0 (if z and y are not in the bottom row/column). Check if bottom and left edges are occupied (==1). Finally, seperately check that the other two edges are either the boundaries of the grid (in the far-right column or top row of the grid for this case) or unoccupied (==0).
 
-                    if(diagnostics==1){
-                        printf("\n %d %d %d   Edge case 1 found.", x, y, z);
-                    }
-                    //rule 1
-                    if(original_grid[x][y][z]==0){ //if cell is unoccupied
-                        new_grid[2*x][2*y][2*z]=3; //follow rule 1 for edge case 1
-                        new_grid[2*x][2*y][2*z+1]=3; // repeat for new z-position (because we double the resolution, there are two z-positions to apply this rule to!)
-                        edgecase=1; //set switch to state that an "edge case has been assigned"
-                    }
+    /* initialise original grid array */
 
-                    //rule 2
-                    if((original_grid[x][y][z]==1)&&((x==(original_lattice_dim-1))||(y==0)||(original_grid[x+1][y-1][z]==0))&&((x==0)||(y==(original_lattice_dim-1))||(original_grid[x-1][y+1][z]==0))){ //if cell is occupied, and both cells along the diagonal are also unoccupied (if either is occupied, we ignore rule 2 -- see 08/08/22). The code snippets like: "y==(N-1))||(z==0)||" are to check if we are at the edge of the grid -- if so, we don't want to check the next cell because we will be going out of bounds of our matrix, so we exit the statement. But as a whole, "((y==(N-1))||(z==0)||(original_grid[x][y+1][z-1]==0))" just checks "Is the North-West cell empty?"
-                        new_grid[2*x][2*y][2*z]++; //inner edge
-                        new_grid[2*x][2*y+1][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y+1][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-
-                        //repeat for 2z+1 positions (doubled-resolution in x-y-z causes 1 cube -> 8 cubes)
-                        new_grid[2*x][2*y][2*z+1]++; //inner edge
-                        new_grid[2*x][2*y+1][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y+1][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        edgecase=1; //set switch to state that an "edge case has been assigned"
-                    }
+    if(engine>=2){
+        build_original_runs(1); //the run-length and streaming engines never build the full grid -- just a list of runs along each row
+    }
+    else{
+        build_original_grid();
+    }
 
-                }
+    printf(" Translation complete. (%d x %d x %d) grid created. \n\n", original_lattice_dim, original_lattice_dim, original_lattice_dim);
 
-                //edge case 2: top-left
+    /* save original resolution output to STAG_spherify data file (to visualise it in 3D) */
+    printf(" Exporting original data to S.T.A.G...");
 
-                else if((y>0)&&(x<(original_lattice_dim-1))&&((original_grid[x+1][y][z]==1)&&(original_grid[x][y-1][z]==1))&&((x==0)||(original_grid[x-1][y][z]==0))&&((y==(original_lattice_dim-1))||(original_grid[x][y+1][z]==0))){ // check if left and top edges are occupied (and check that the other two edges are unoccupied). Only check this edge if z>0 and y<new_lattice_dim (check z is not in first column and y is not in the top row).
+    part_bytes=(mpi_size>1) ? stag_part_bytes(0) : 0; //(in an MPI run, each process counts how long its part of the file is before writing it)
+    original_grid_outfile=open_part("original.txt", part_bytes); //open file for saving dipole positions
 
-                    if(diagnostics==1){
-                        printf("\n %d %d %d   Edge case 2 found.", x, y, z);
-                    }
-                    //rule 1
-                    if(original_grid[x][y][z]==0){ //if cell is unoccupied
-                        new_grid[2*x+1][2*y][2*z]=3; //follow rule 1 for edge case 2
-                        new_grid[2*x+1][2*y][2*z+1]=3; // repeat for new z-position (because we double the resolution, there are two z-positions to apply this rule to!)
-                        edgecase=1; //set switch to state that an "edge case has been assigned"
-                    }
+    row_runs=(int*)checked_malloc((2*original_lattice_dim+2)*sizeof(int), "row buffer"); //holds the runs of dipoles along one row of the grid at a time
+    export_time[0]=omp_get_wtime();
+    stats_begin(&original_stats, original_lattice_dim);
+    images_begin(&original_images, original_lattice_dim);
 
-                    //rule 2
-                    if((original_grid[x][y][z]==1)&&((x==(original_lattice_dim-1))||(y==(original_lattice_dim-1))||(original_grid[x+1][y+1][z]==0))&&((x==0)||(y==0)||(original_grid[x-1][y-1][z]==0))){ //if cell is occupied, and both cells along the diagonal are also unoccupied (if either is occupied, we ignore rule 2 -- see 08/08/22). The code snippets like: "y==(N-1))||(z==0)||" are to check if we are at the edge of the grid -- if so, we don't want to check the next cell because we will be going out of bounds of our matrix, so we exit the statement. But as a whole, "((y==(N-1))||(z==0)||(original_grid[x][y+1][z-1]==0))" just checks "Is the North-West cell empty?"
-                        new_grid[2*x][2*y][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x][2*y+1][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y+1][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y][2*z]++; //inner edge
-
-                        //repeat for 2z+1 positions (doubled-resolution in x-y-z causes 1 cube -> 8 cubes)
-                        new_grid[2*x][2*y][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x][2*y+1][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y+1][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y][2*z+1]++; //inner edge
-                        edgecase=1; //set switch to state that an "edge case has been assigned"
-                    }
+    dipole_count=0;
+    for(x=slab_begin;x<slab_end;x++){
+        for(y=0;y<original_lattice_dim;y++){
+            run_count=original_row(x, y, row_runs);
+            if(statistics==1){
+                stats_row(&original_stats, x, y, row_runs, run_count);
+            }
+            if(image_output==1){
+                images_row(&original_images, x, y, row_runs, run_count);
+            }
+            for(i=0;i<run_count;i++){
+                for(z=row_runs[2*i];z<row_runs[2*i+1];z++){
+                    fprintf(original_grid_outfile,"%d, %d, %d\n", x,y,z); //save x-y-z coords of any dipoles that have values > 0. Any dipoles will have values == 1 at this stage.
+                    dipole_count++; //keep track of how many dipoles we are recording
                 }
+            }
+        }
+    }
 
-                //edge case 3: top-right
+    free((void*)row_runs);
+    stats_finish(&original_stats);
+    images_finish(&original_images, "original");
+    dipole_count=global_count(dipole_count, NULL);
 
-                else if((x<(original_lattice_dim-1))&&(y<(original_lattice_dim-1))&&((original_grid[x+1][y][z]==1)&&(original_grid[x][y+1][z]==1))&&((x==0)||(original_grid[x-1][y][z]==0))&&((y==0)||(original_grid[x][y-1][z]==0))){ // check if top and right edges are occupied (and check that the other two edges are unoccupied). Only check this edge if z and y < new_lattice_dim (check z and y are not in the top row/column).
+    /* The final row is extra data needed for the python visulisation S.T.A.G program, NOT a dipole! */
+    if(mpi_rank==mpi_size-1){
+        fprintf(original_grid_outfile,"%d, %lld, %d\n", original_lattice_dim, dipole_count, original_lattice_dim); //the final row contains the number of dipoles, the grid size, and a random number just to keep the shape of three columns for python to read */
+    }
+    close_part(original_grid_outfile, "original.txt");
+    export_time[0]=omp_get_wtime()-export_time[0];
 
-                    if(diagnostics==1){
-                        printf("\n %d %d %d   Edge case 3 found.", x, y, z);
-                    }
-                    //rule 1
-                    if(original_grid[x][y][z]==0){ //if cell is unoccupied
-                        new_grid[2*x+1][2*y+1][2*z]=3; //follow rule 1 for edge case 3
-                        new_grid[2*x+1][2*y+1][2*z+1]=3; // repeat for new z-position (because we double the resolution, there are two z-positions to apply this rule to!)
-                        edgecase=1; //set switch to state that an "edge case has been assigned"
-                    }
+    printf(" Export complete.\n");
 
-                    //rule 2
-                    if((original_grid[x][y][z]==1)&&((x==(original_lattice_dim-1))||(y==0)||(original_grid[x+1][y-1][z]==0))&&((x==0)||(y==(original_lattice_dim-1))||(original_grid[x-1][y+1][z]==0))){ //if cell is occupied, and both cells along the diagonal are also unoccupied (if either is occupied, we ignore rule 2 -- see 08/08/22). The code snippets like: "y==(N-1))||(z==0)||" are to check if we are at the edge of the grid -- if so, we don't want to check the next cell because we will be going out of bounds of our matrix, so we exit the statement. But as a whole, "((y==(N-1))||(z==0)||(original_grid[x][y+1][z-1]==0))" just checks "Is the North-West cell empty?"
-                        new_grid[2*x][2*y][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x][2*y+1][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y+1][2*z]++; //inner edge
-                        new_grid[2*x+1][2*y][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-
-                        //repeat for 2z+1 positions (doubled-resolution in x-y-z causes 1 cube -> 8 cubes)
-                        new_grid[2*x][2*y][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x][2*y+1][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y+1][2*z+1]++; //inner edge
-                        new_grid[2*x+1][2*y][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        edgecase=1; //set switch to state that an "edge case has been assigned"
-                    }
-                }
+    /* initialise new 3D grid at higher resolution */
 
-                //edge case 4: bottom-right
+    new_lattice_dim= 2*original_lattice_dim; // new grid resolution will be twice as large
 
-                else if((y<(original_lattice_dim-1))&&(x>0)&&((original_grid[x-1][y][z]==1)&&(original_grid[x][y+1][z]==1))&&((x==(original_lattice_dim-1))||(original_grid[x+1][y][z]==0))&&((y==0)||(original_grid[x][y-1][z]==0))){ // check if right and bottom edges are occupied (and check that the other two edges are unoccupied). Only check this edge if y>0 and z<new_lattice_dim (check y is not in first row z is not in the final column). Finally, this code "((y==(N-1))||(original_grid[x][y+1][z]==0))" checks if the edges are the boundaries of the grid (and so are also unuccupied), or whether the next cell is there but unoccupied.
+    if(engine<2){
+        build_new_grid();
 
-                    if(diagnostics==1){
-                        printf("\n %d %d %d   Edge case 4 found.", x, y, z);
-                    }
-                    //rule 1
-                    if(original_grid[x][y][z]==0){ //if cell is unoccupied
-                        new_grid[2*x][2*y+1][2*z]=3; //follow rule 1 for edge case 4
-                        new_grid[2*x][2*y+1][2*z+1]=3; // repeat for new z-position (because we double the resolution, there are two z-positions to apply this rule to!)
-                        edgecase=1; //set switch to state that an "edge case has been assigned"
-                    }
+        printf("\n New high-resolution grid initialised (%d x %d x %d).\n\n", new_lattice_dim, new_lattice_dim, new_lattice_dim);
+    }
 
-                    //rule 2
-                    if((original_grid[x][y][z]==1)&&((x==(original_lattice_dim-1))||(y==(original_lattice_dim-1))||(original_grid[x+1][y+1][z]==0))&&((x==0)||(y==0)||(original_grid[x-1][y-1][z]==0))){ //if cell is occupied, and both cells along the diagonal are also unoccupied (if either is occupied, we ignore rule 2 -- see 08/08/22). The code snippets like: "y==(N-1))||(z==0)||" are to check if we are at the edge of the grid -- if so, we don't want to check the next cell because we will be going out of bounds of our matrix, so we exit the statement. But as a whole, "((y==(N-1))||(z==0)||(original_grid[x][y+1][z-1]==0))" just checks "Is the North-West cell empty?"
-                        new_grid[2*x][2*y][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x][2*y+1][2*z]++; //inner edge
-                        new_grid[2*x+1][2*y+1][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y][2*z]--; //follow rule 2 and set all new cells to zero except inner edge
-
-                        //repeat for 2z+1 positions (doubled-resolution in x-y-z causes 1 cube -> 8 cubes)
-                        new_grid[2*x][2*y][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x][2*y+1][2*z+1]++; //inner edge
-                        new_grid[2*x+1][2*y+1][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        new_grid[2*x+1][2*y][2*z+1]--; //follow rule 2 and set all new cells to zero except inner edge
-                        edgecase=1; //set switch to state that an "edge case has been assigned"
-                    }
-                }
+    /* run the three sweeps with the chosen engine */
 
-                //if none of the edge cases are satisfied fill new grid with 1's if occupied
-                if((edgecase==0)&&(original_grid[x][y][z]==1)){
-                    if(diagnostics==1){
-                        printf("\n %d %d %d   No edge case found, filling with 1's.", x, y, z);
-                    }
-                    new_grid[2*x][2*y][2*z]++;
-                    new_grid[2*x][2*y+1][2*z]++;
-                    new_grid[2*x+1][2*y+1][2*z]++;
-                    new_grid[2*x+1][2*y][2*z]++;
-
-                    new_grid[2*x][2*y][2*z+1]++;       // 1 dipole in original grid -> 8 dipoles in new grid
-                    new_grid[2*x][2*y+1][2*z+1]++;
-                    new_grid[2*x+1][2*y+1][2*z+1]++;
-                    new_grid[2*x+1][2*y][2*z+1]++;
-                }
-                //or 0's if unoccupied
-                else if(edgecase==0){
-                    if(diagnostics==1){
-                        printf("\n %d %d %d   No edge case found, filling with 0's.", x, y, z);
-                    }
-                    new_grid[2*x][2*y][2*z]--;
-                    new_grid[2*x][2*y+1][2*z]--;
-                    new_grid[2*x+1][2*y+1][2*z]--;
-                    new_grid[2*x+1][2*y][2*z]--;
+    trace_begin();
+    if(engine==1){
+        surface_engine();
+    }
+    else if(engine==2){
+        rle_engine();
+    }
+    else if(engine==3){
+        streaming_engine();
+    }
+    else if(engine==4){
+        if(load_delta()==0){
+            return 1;
+        }
+    }
+    else{
+        dense_engine();
+    }
+    trace_finish(); //(before the benchmark sweeps the grid again)
 
-                    new_grid[2*x][2*y][2*z+1]--;       // 1 dipole in original grid -> 8 dipoles in new grid
-                    new_grid[2*x][2*y+1][2*z+1]--;
-                    new_grid[2*x+1][2*y+1][2*z+1]--;
-                    new_grid[2*x+1][2*y][2*z+1]--;
-                }
+    if(benchmark>0){
+        benchmark_layouts(benchmark-1);
+    }
 
-            }
-        }
+    if(query_benchmark==1){
+        benchmark_queries();
     }
 
-    if(diagnostics==1){
-        printf ("\n\n --------------------- Original grid ---------------------\n");
-        for(z=0;z<original_lattice_dim;z++){
-            printf("\n  x-y slice at z = %d    \n", z);
-            printf("\n        Coordinates                                 Values                                       xyz coords  \n\n");
-            for(x=(original_lattice_dim-1);x>(-1);x--){
-                for(y=0;y<original_lattice_dim;y++){
-                    printf("   %d-%d   ", x,y); //print coord positions
-                }
-                printf("                  ");
-                for(y=0;y<original_lattice_dim;y++){
-                    printf("   %d   ", original_grid[x][y][z]); //print values at these coords
-                }
-                printf("                  ");
-                for(y=0;y<original_lattice_dim;y++){
-                    printf("   %d %d %d   ", x,y,z); //print values at these coords
-                }
-                printf("\n\n");
-            }
-            printf("\n\n\n\n");
-        }
+    if(query_input==1){
+        answer_queries();
+    }
 
-        printf ("\n\n --------------------- New grid ---------------------\n");
-        for(z=0;z<new_lattice_dim;z++){
-            printf("\n  x-y slice at z = %d    \n", z);
-            printf("\n                       Coordinates                                                       Values                                                            xyz coords \n\n");
-            for(x=(new_lattice_dim-1);x>(-1);x--){
-                for(y=0;y<new_lattice_dim;y++){
-                    printf("   %d-%d   ", x,y); //print coord positions
-                }
-                printf("                  ");
-                for(y=0;y<new_lattice_dim;y++){
-                    printf("   %d   ", new_grid[x][y][z]); //print values at these coords
-                }
-                printf("                  ");
-                for(y=0;y<new_lattice_dim;y++){
-                    printf("   %d %d %d   ", x,y,z); //print values at these coords
-                }
-                printf("\n\n");
-            }
-            printf("\n\n\n\n");
-        }
+    if(connectivity>0){
+        check_connectivity();
     }
 
     /* save high resolution output to STAG_spherify data file */
 
     printf(" Analysis complete. Exporting high-resolution data to S.T.A.G...");
 
-    new_grid_outfile=fopen("high_res.txt","w"); //open file for saving dipole positions
+    row_runs=(int*)checked_malloc((2*new_lattice_dim+2)*sizeof(int), "row buffer"); //holds the runs of dipoles along one row of the new grid at a time
+    part_bytes=(mpi_size>1) ? stag_part_bytes(1) : 0;
+    new_grid_outfile=open_part("high_res.txt", part_bytes); //open file for saving dipole positions
+
+    export_time[1]=omp_get_wtime();
+    stats_begin(&new_stats, new_lattice_dim);
+    images_begin(&new_images, new_lattice_dim);
+    if(delta_output==1){
+        delta_begin();
+    }
 
     dipole_count=0;
-    for(x=0;x<new_lattice_dim;x++){
+    for(x=2*slab_begin;x<2*slab_end;x++){
         for(y=0;y<new_lattice_dim;y++){
-            for(z=0;z<new_lattice_dim;z++){
-                if(new_grid[x][y][z]>0){
+            run_count=refined_row(x, y, row_runs);
+            if(statistics==1){
+                stats_row(&new_stats, x, y, row_runs, run_count);
+            }
+            if(image_output==1){
+                images_row(&new_images, x, y, row_runs, run_count);
+            }
+            if(delta_output==1){
+                delta_row(x, y, row_runs, run_count);
+            }
+            for(i=0;i<run_count;i++){
+                for(z=row_runs[2*i];z<row_runs[2*i+1];z++){
                     fprintf(new_grid_outfile,"%d, %d, %d\n", x,y,z); //save x-y-z coords of any dipoles that have values > 0 (should still be dipoles, on average, after three "sweeps" in the x-,  y- and z- directions)
                     dipole_count++; //keep track of how many dipoles we are recording
                 }
@@ -1126,11 +7093,43 @@ int main()
         }
     }
 
+    stats_finish(&new_stats);
+    images_finish(&new_images, "high_res");
+    dipole_count=global_count(dipole_count, &dipoles_before);
+
     /* The final row is extra data needed for the python visulisation S.T.A.G program, NOT a dipole! */
-    fprintf(new_grid_outfile,"%d, %d, %d\n", new_lattice_dim, dipole_count, new_lattice_dim); //the final row contains the number of dipoles, the grid size, and a random number just to keep the shape of three columns for python to read */
-    fclose(new_grid_outfile);
+    if(mpi_rank==mpi_size-1){
+        fprintf(new_grid_outfile,"%d, %lld, %d\n", new_lattice_dim, dipole_count, new_lattice_dim); //the final row contains the number of dipoles, the grid size, and a random number just to keep the shape of three columns for python to read */
+    }
+    close_part(new_grid_outfile, "high_res.txt");
+    export_time[1]=omp_get_wtime()-export_time[1];
+    if(delta_output==1){
+        save_delta();
+    }
 
-    printf(" Exported %d dipoles.\n", dipole_count);
+    printf(" Exported %lld dipoles.\n", dipole_count);
+
+    if(statistics==1){
+        printf("\n Morphology (lengths in units of the original dipole spacing d):\n");
+        printf("\n   %-18s %14s %14s %14s %14s %12s", "lattice", "volume (d^3)", "surface (d^2)", "R_gyration (d)", "R_eq.vol (d)", "sphericity");
+        print_stats("original", &original_stats, 1.0);
+        print_stats("high-resolution", &new_stats, 0.5);
+        printf("\n\n Statistics took %.4f s (%.1f%% of the %.4f s spent exporting original.txt and high_res.txt).\n", original_stats.seconds+new_stats.seconds, 100.0*(original_stats.seconds+new_stats.seconds)/(export_time[0]+export_time[1]), export_time[0]+export_time[1]);
+    }
+
+    if(image_output==1){
+#ifdef USE_ZLIB
+        printf("\n Images saved as original_yz_slice.png, original_yz_projection.png ... high_res_xy_projection.png (12 in all) in %.4f s.\n", original_images.seconds+new_images.seconds);
+#else
+        printf("\n Images saved as original_yz_slice.pgm, original_yz_projection.pgm ... high_res_xy_projection.pgm (12 in all) in %.4f s.\n", original_images.seconds+new_images.seconds);
+#endif
+    }
+
+    if(mesh_output==1){
+        export_mesh("original.ply", original_row, original_lattice_dim, 1.0);
+        export_mesh("high_res.ply", refined_row, new_lattice_dim, 0.5);
+        printf("\n");
+    }
 
     /* SAVE DATA IN DDSCAT FORMAT AT HIGHER RESOLUTION */
 
@@ -1138,89 +7137,95 @@ int main()
 
     /* we have all the info we need from the first scan -- write the new file */
 
-    DDSCAT_infile=fopen("shape.dat","r");
-    DDSCAT_outfile=fopen("shape2.dat","w");
-
-    /* duplicate the information from the header of the DDSCAT file */
-
     printf("\n \t Duplicating header section... ");
-
-    while (fgets(buf,1000, DDSCAT_infile)!=NULL){
-
-        if(strstr(buf,"NAT") != NULL){ //check if "NAT" is in the string for this line
-            fprintf(DDSCAT_outfile,"   %d   = NAT\n", dipole_count); // is so, print a special line for the new dipole number (at higher resolution)
-
-        }
-        else if(strstr(buf,"JA") != NULL){
-            if(strstr(buf,"IX") != NULL){       //check if the current line contains the strings "JA", "IX", "IY" and "IZ" (seperately in case the spacing is changed by the user).
-                if(strstr(buf,"IY") != NULL){
-                    if(strstr(buf,"IZ") != NULL){
-                        fputs(buf, DDSCAT_outfile); //print this final line and then...
-                        break;		// ...we have finished the header section -- exit the loop to start writing data
+    memset(&writers, 0, sizeof(writers));
+    if(mpi_size>1){ //(each process counts how long its part of each file is before writing it)
+        JA=dipoles_before;
+        for(x=2*slab_begin;x<2*slab_end;x++){
+            for(y=0;y<new_lattice_dim;y++){
+                run_count=refined_row(x, y, row_runs);
+                for(i=0;i<run_count;i++){
+                    for(z=row_runs[2*i];z<row_runs[2*i+1];z++){
+                        JA++;
+                        writers_count(&writers, JA, x-2*STAG_offset[0], y-2*STAG_offset[1], z-2*STAG_offset[2], dipole_material(x/2, y/2, z/2));
                     }
                 }
             }
         }
-        else{
-            fputs(buf, DDSCAT_outfile); //otherwise, copy and paste the line exactly "as is" from the old file to the new one
-        }
     }
+    writers_open(&writers, dipole_count, "shape2");
 
     /* save high-res dipole data */
-    printf("\n \t Saving high-resolution dipole data for %d dipoles... ", dipole_count);
+    printf("\n \t Saving high-resolution dipole data for %lld dipoles... ", dipole_count);
 
-    k=0;
-    for(x=0;x<new_lattice_dim;x++){
+    JA=dipoles_before;
+    for(x=2*slab_begin;x<2*slab_end;x++){
         for(y=0;y<new_lattice_dim;y++){
-            for(z=0;z<new_lattice_dim;z++){
-                if(new_grid[x][y][z]>0){
+            run_count=refined_row(x, y, row_runs);
+            for(i=0;i<run_count;i++){
+                for(z=row_runs[2*i];z<row_runs[2*i+1];z++){
 
-                    k++; //keep track of how many dipoles we are recording
+                    JA++; //keep track of how many dipoles we are recording
 
-                    fprintf(DDSCAT_outfile,"%10d %10.0f %10.0f %10.0f %10d %10d %10d\n", k, x-2*STAG_offset[0], y-2*STAG_offset[1], z-2*STAG_offset[2], ICOMPX, ICOMPY, ICOMPZ); //reverse the offset (doubled, because the grid size is doubled) and save the dipoles in their original "centred" positions, but with the high res interpolations and at twice the resolution
+                    writers_dipole(&writers, JA, x-2*STAG_offset[0], y-2*STAG_offset[1], z-2*STAG_offset[2], dipole_material(x/2, y/2, z/2)); //reverse the offset (doubled, because the grid size is doubled) and save the dipoles in their original "centred" positions, but with the high res interpolations and at twice the resolution
                 }
             }
         }
     }
 
+    free((void*)row_runs);
 
-    printf("Done! \n\n Exported data for %d dipoles. Spherify program compete! Enjoy your new smooth shapes.\n\n", k);
 
-    fclose(DDSCAT_infile);
-    fclose(DDSCAT_outfile);
+    printf("Done! \n\n Exported data for %lld dipoles. Spherify program compete! Enjoy your new smooth shapes.\n\n", dipole_count);
+    check_memory_plan();
+
+    writers_close(&writers);
 
     /* run xSTAG_spherify on each file - views both the original and higher resolution images in 3D */
 
     //system("xSTAG_spherify.bat"); //WINDOWS VERSION: opens a batch file with a command to run STAG_spherify as a python script
-    system("python STAG_spherify.py"); // MAC version -- open file in python
+    if((mpi_rank==0)&&(orientations==0)&&(batch==0)&&(material_test==0)&&(large_test==0)){
+        system("python STAG_spherify.py"); // MAC version -- open file in python
+    }
 
     /* free memory for arrays */
 
-    for (i=0; i<original_N; i++) {
-        free((void*)STAG_dipole_positions[i]);
-    }
-    free((void*)STAG_dipole_positions);
+    free(dipole_table);
+    free((void*)material_cells);
 
-    for (i=0; i<original_N; i++) {
-        free((void*)dipole_info[i]);
+    if(engine==2){
+        free((void*)original_row_start);
+        free((void*)original_runs);
+        free((void*)new_row_start);
+        free((void*)new_runs);
     }
-    free((void*)dipole_info);
-
-    for(i=0;i<original_lattice_dim;i++){
-        for(j=0;j<original_lattice_dim;j++){
-            free((void*)original_grid[i][j]);
-        }
-        free((void*)original_grid[i]);
+    else if(engine==4){
+        free((void*)original_row_start);
+        free((void*)original_runs);
+        free((void*)delta_row_start);
+        free((void*)delta_toggles);
     }
-    free((void*)original_grid);
-
-    for(i=0;i<new_lattice_dim;i++){
-        for(j=0;j<new_lattice_dim;j++){
-            free((void*)new_grid[i][j]);
+    else if(engine==3){
+        free((void*)original_row_start);
+        free((void*)original_runs);
+        free((void*)stream_events);
+        for(i=0;i<4;i++){
+            free((void*)stream_rows[i/2][i%2]);
         }
-        free((void*)new_grid[i]);
     }
-    free((void*)new_grid);
+    else{
+        free_grids();
+    }
+
+#ifdef USE_MPI
+    MPI_Finalize();
+#endif
 
+    if(material_test==1){
+        return check_material_test();
+    }
+    if(large_test==1){
+        return check_large_test();
+    }
     return 0;
 }